@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive_index.h"
+#include "archive_io.h"
+#include "compress.h"
+#include "copy_engine.h"
+#include "minitar.h"
+
+#define MAX_MSG_LEN 512
+#define MAX_PATH_LEN 4096
+
+// Results of trying to load a sidecar from disk
+#define SIDECAR_LOADED 0
+#define SIDECAR_MISSING 1
+#define SIDECAR_STALE 2
+
+void archive_index_init(archive_index_t *index) {
+    memset(index, 0, sizeof(archive_index_t));
+}
+
+void archive_index_free(archive_index_t *index) {
+    free(index->entries);
+    free(index->names);
+    archive_index_init(index);
+}
+
+const char *archive_index_name(const archive_index_t *index, const index_entry_t *entry) {
+    return index->names + entry->name_offset;
+}
+
+const char *archive_index_link_target(const archive_index_t *index, const index_entry_t *entry) {
+    return index->names + entry->link_offset;
+}
+
+static int sidecar_name(const char *archive_name, char *index_name) {
+    if (snprintf(index_name, MAX_PATH_LEN, "%s%s", archive_name, INDEX_SUFFIX) >= MAX_PATH_LEN) {
+        printf("Error: archive name %s is too long\n", archive_name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sort entries by name, and members with the same name by their position in the archive
+ */
+static int compare_entries(const void *a, const void *b, void *arg) {
+    const archive_index_t *index = arg;
+    const index_entry_t *ea = a;
+    const index_entry_t *eb = b;
+    int cmp = strcmp(archive_index_name(index, ea), archive_index_name(index, eb));
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ea->header_offset < eb->header_offset ? -1 : ea->header_offset > eb->header_offset;
+}
+
+int archive_index_add(archive_index_t *index, const archive_member_t *member) {
+    const char *name = member->name;
+    size_t len = strlen(name);
+    size_t link_len = member->linkname != NULL ? strlen(member->linkname) + 1 : 0;   // stored right after the name
+    if (index->num_entries == index->entries_cap) {
+        uint32_t cap = index->entries_cap ? index->entries_cap * 2 : 64;
+        index_entry_t *entries = realloc(index->entries, cap * sizeof(index_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        index->entries = entries;
+        index->entries_cap = cap;
+    }
+    while (index->names_len + len + 1 + link_len > index->names_cap) {
+        uint32_t cap = index->names_cap ? index->names_cap * 2 : 4096;
+        char *names = realloc(index->names, cap);
+        if (names == NULL) {
+            return -1;
+        }
+        index->names = names;
+        index->names_cap = cap;
+    }
+    index_entry_t *entry = &index->entries[index->num_entries++];
+    entry->header_offset = member->header_offset;
+    entry->data_offset = member->data_offset;
+    entry->size = member->size;
+    entry->real_size = member->real_size;
+    entry->mtime = member->mtime;
+    entry->name_offset = index->names_len;
+    entry->name_len = len;
+    entry->flags = (member->sparse ? INDEX_SPARSE : 0) | (member->linkname != NULL ? INDEX_HARDLINK : 0);
+    entry->link_offset = 0;
+    memcpy(index->names + index->names_len, name, len + 1);
+    index->names_len += len + 1;
+    if (member->linkname != NULL) {
+        entry->link_offset = index->names_len;
+        memcpy(index->names + index->names_len, member->linkname, link_len);
+        index->names_len += link_len;
+    }
+    return 0;
+}
+
+/*
+ * Adds the members behind 'read_fn' from the index's end offset on. With 'first_only' a
+ * name that was already indexed is passed over, and with 'stop_names' as well the walk
+ * ends as soon as every one of them has been indexed
+ * Returns 0 on success, -1 on error
+ */
+static int scan_members(archive_pread_fn read_fn, void *ctx, int first_only, const file_list_t *stop_names,
+                        archive_index_t *index) {
+    archive_reader_t reader;
+    archive_reader_init(&reader, read_fn, ctx);
+    reader.offset = index->end_offset;
+    file_list_t seen;
+    file_list_init(&seen);
+    int found = 0;
+    const archive_member_t *member;
+    int status = 0;
+    while ((stop_names == NULL || found < stop_names->table_used)
+           && (status = archive_reader_next(&reader, &member)) == 1) {
+        if (first_only && file_list_contains(&seen, member->name)) {
+            continue;
+        }
+        if ((first_only && file_list_add(&seen, member->name) != 0) || archive_index_add(index, member) != 0) {
+            perror("Failed to add member to archive index");
+            status = -1;
+            break;
+        }
+        if (stop_names != NULL && file_list_contains(stop_names, member->name)) {
+            found++;
+        }
+    }
+    file_list_clear(&seen);
+    archive_reader_free(&reader);
+    if (status == -1) {
+        return -1;
+    }
+    index->end_offset = reader.offset;
+    archive_index_sort(index);
+    return 0;
+}
+
+int archive_index_scan_from(archive_pread_fn read_fn, void *ctx, archive_index_t *index) {
+    return scan_members(read_fn, ctx, 0, NULL, index);
+}
+
+int archive_index_scan_first_from(archive_pread_fn read_fn, void *ctx, const file_list_t *names,
+                                  archive_index_t *index) {
+    return scan_members(read_fn, ctx, 1, names, index);
+}
+
+void archive_index_sort(archive_index_t *index) {
+    qsort_r(index->entries, index->num_entries, sizeof(index_entry_t), compare_entries, index);
+}
+
+/*
+ * scan_members over the archive file 'archive_name'
+ * Returns 0 on success, -1 on error
+ */
+static int scan_archive(const char *archive_name, int first_only, const file_list_t *stop_names,
+                        archive_index_t *index) {
+    int fd = open(archive_name, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open archive file in archive_index_scan");
+        return -1;
+    }
+    // Compressed archives are walked through their chunk table, inflating only chunks that hold headers
+    mtz_reader_t mtz;
+    int status = mtz_open(fd, &mtz);
+    if (status == 1) {
+        status = scan_members(mtz_pread, &mtz, first_only, stop_names, index);
+        mtz_close(&mtz);
+    } else if (status == 0) {
+        status = scan_members(fd_pread, &fd, first_only, stop_names, index);
+    }
+    close(fd);
+    return status;
+}
+
+int archive_index_scan(const char *archive_name, archive_index_t *index) {
+    return scan_archive(archive_name, 0, NULL, index);
+}
+
+int archive_index_scan_first(const char *archive_name, const file_list_t *names, archive_index_t *index) {
+    return scan_archive(archive_name, 1, names, index);
+}
+
+/*
+ * Read the sidecar 'index_name' into 'index' if it still describes the archive in 'archive_stat'
+ * Returns SIDECAR_LOADED, SIDECAR_MISSING, SIDECAR_STALE (which also covers a corrupt sidecar) or -1
+ */
+static int load_sidecar(const char *index_name, const struct stat *archive_stat, archive_index_t *index) {
+    int fd = open(index_name, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return SIDECAR_MISSING;
+        }
+        perror("Failed to open archive index");
+        return -1;
+    }
+
+    index_file_header_t file_header;
+    if (pread(fd, &file_header, sizeof(file_header), 0) != sizeof(file_header)
+        || memcmp(file_header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+        || file_header.archive_size != (uint64_t)archive_stat->st_size
+        || file_header.archive_mtime_sec != archive_stat->st_mtim.tv_sec
+        || file_header.archive_mtime_nsec != archive_stat->st_mtim.tv_nsec) {
+        close(fd);
+        return SIDECAR_STALE;
+    }
+
+    // Entries and names follow the header back to back, read them in one go
+    size_t entries_len = file_header.num_entries * sizeof(index_entry_t);
+    size_t body_len = entries_len + file_header.names_len;
+    char *body = malloc(body_len > 0 ? body_len : 1);
+    if (body == NULL) {
+        perror("Failed to allocate archive index");
+        close(fd);
+        return -1;
+    }
+    ssize_t n = pread(fd, body, body_len, sizeof(file_header));
+    close(fd);
+    if (n != (ssize_t)body_len) {
+        free(body);
+        return SIDECAR_STALE;
+    }
+
+    archive_index_free(index);
+    index->entries = malloc(entries_len > 0 ? entries_len : 1);
+    index->names = malloc(file_header.names_len > 0 ? file_header.names_len : 1);
+    if (index->entries == NULL || index->names == NULL) {
+        perror("Failed to allocate archive index");
+        free(body);
+        archive_index_free(index);
+        return -1;
+    }
+    memcpy(index->entries, body, entries_len);
+    memcpy(index->names, body + entries_len, file_header.names_len);
+    free(body);
+    index->num_entries = index->entries_cap = file_header.num_entries;
+    index->names_len = index->names_cap = file_header.names_len;
+    index->end_offset = file_header.end_offset;
+
+    // Don't trust name offsets from disk blindly
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        const index_entry_t *entry = &index->entries[i];
+        if ((uint64_t)entry->name_offset + entry->name_len >= index->names_len
+            || index->names[entry->name_offset + entry->name_len] != '\0'
+            || ((entry->flags & INDEX_HARDLINK)
+                && (entry->link_offset >= index->names_len
+                    || memchr(index->names + entry->link_offset, '\0', index->names_len - entry->link_offset) == NULL))) {
+            archive_index_free(index);
+            return SIDECAR_STALE;
+        }
+    }
+    return SIDECAR_LOADED;
+}
+
+int archive_index_open(const char *archive_name, archive_index_t *index, int create) {
+    archive_index_init(index);
+    char index_name[MAX_PATH_LEN];
+    if (sidecar_name(archive_name, index_name) != 0) {
+        return -1;
+    }
+    struct stat archive_stat;
+    if (stat(archive_name, &archive_stat) != 0) {
+        perror("Failed to stat archive in archive_index_open");
+        return -1;
+    }
+
+    int status = load_sidecar(index_name, &archive_stat, index);
+    if (status == -1 || status == SIDECAR_LOADED) {
+        return status;
+    }
+    if (status == SIDECAR_MISSING && !create) {
+        return 1;
+    }
+
+    // Stale or missing: rebuild from the headers. Writing it back is best effort, a
+    // read-only directory shouldn't stop us from using the rebuilt index in memory.
+    if (archive_index_scan(archive_name, index) != 0) {
+        archive_index_free(index);
+        return -1;
+    }
+    archive_index_write(archive_name, index);
+    return 0;
+}
+
+int archive_index_write(const char *archive_name, const archive_index_t *index) {
+    char index_name[MAX_PATH_LEN];
+    char tmp_name[MAX_PATH_LEN];
+    if (sidecar_name(archive_name, index_name) != 0) {
+        return -1;
+    }
+    if (snprintf(tmp_name, MAX_PATH_LEN, "%s.tmp", index_name) >= MAX_PATH_LEN) {
+        printf("Error: archive name %s is too long\n", archive_name);
+        return -1;
+    }
+    struct stat archive_stat;
+    if (stat(archive_name, &archive_stat) != 0) {
+        perror("Failed to stat archive in archive_index_write");
+        return -1;
+    }
+
+    index_file_header_t file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    file_header.archive_size = archive_stat.st_size;
+    file_header.archive_mtime_sec = archive_stat.st_mtim.tv_sec;
+    file_header.archive_mtime_nsec = archive_stat.st_mtim.tv_nsec;
+    file_header.end_offset = index->end_offset;
+    file_header.num_entries = index->num_entries;
+    file_header.names_len = index->names_len;
+
+    int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create archive index %s: %s\n", tmp_name, strerror(errno));
+        return -1;
+    }
+    if (write_all(fd, &file_header, sizeof(file_header)) != 0
+        || write_all(fd, index->entries, index->num_entries * sizeof(index_entry_t)) != 0
+        || write_all(fd, index->names, index->names_len) != 0) {
+        fprintf(stderr, "Failed to write archive index %s: %s\n", tmp_name, strerror(errno));
+        close(fd);
+        unlink(tmp_name);
+        return -1;
+    }
+    if (close(fd) != 0 || rename(tmp_name, index_name) != 0) {
+        fprintf(stderr, "Failed to save archive index %s: %s\n", index_name, strerror(errno));
+        unlink(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+const index_entry_t *archive_index_find(const archive_index_t *index, const char *name) {
+    // Find the first entry that sorts after every member called 'name'
+    uint32_t low = 0;
+    uint32_t high = index->num_entries;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (strcmp(archive_index_name(index, &index->entries[mid]), name) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // The entry just before it is the latest version, if the name is there at all
+    if (low == 0 || strcmp(archive_index_name(index, &index->entries[low - 1]), name) != 0) {
+        return NULL;
+    }
+    return &index->entries[low - 1];
+}
+
+const index_entry_t *archive_index_resolve(const archive_index_t *index, const index_entry_t *entry) {
+    if (!(entry->flags & INDEX_HARDLINK)) {
+        return entry;
+    }
+    // The link stands for the data its target had when the link was written, later versions don't count.
+    // Versions of a name are adjacent and ordered by offset, so walk back from the latest one.
+    const char *name = archive_index_link_target(index, entry);
+    const index_entry_t *target = archive_index_find(index, name);
+    while (target != NULL && target->header_offset >= entry->header_offset) {    // a name given twice links to itself
+        target = target > index->entries && strcmp(archive_index_name(index, target - 1), name) == 0 ? target - 1 : NULL;
+    }
+    return target != NULL && !(target->flags & INDEX_HARDLINK) ? target : NULL;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const index_entry_t *ea = *(const index_entry_t *const *)a;
+    const index_entry_t *eb = *(const index_entry_t *const *)b;
+    return ea->header_offset < eb->header_offset ? -1 : ea->header_offset > eb->header_offset;
+}
+
+void archive_index_archive_order(const archive_index_t *index, const index_entry_t **order) {
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        order[i] = &index->entries[i];
+    }
+    qsort(order, index->num_entries, sizeof(index_entry_t *), compare_offsets);
+}
+
+uint32_t archive_index_latest(const archive_index_t *index, const index_entry_t **live) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        // Versions of a name are adjacent and ordered by offset, so only the last one survives
+        if (i + 1 < index->num_entries
+            && index->entries[i].name_len == index->entries[i + 1].name_len
+            && strcmp(archive_index_name(index, &index->entries[i]),
+                      archive_index_name(index, &index->entries[i + 1])) == 0) {
+            continue;
+        }
+        live[count++] = &index->entries[i];
+    }
+    qsort(live, count, sizeof(index_entry_t *), compare_offsets);
+    return count;
+}
@@ -0,0 +1,141 @@
+#ifndef _ARCHIVE_INDEX_H
+#define _ARCHIVE_INDEX_H
+#include <stdint.h>
+
+#include "minitar.h"
+
+// The sidecar index of "foo.tar" lives next to it in "foo.tar.idx"
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC "MTIDX04"
+
+// One member of the archive. This is also the on-disk record, so loading is a single read
+typedef struct {
+    uint64_t header_offset;     // where the member's first header block (extended headers included) starts in the archive
+    uint64_t data_offset;       // where the member's data starts
+    uint64_t size;              // size of the member's data in bytes
+    uint64_t real_size;         // size of the file it unpacks to, differs from 'size' for sparse members
+    int64_t mtime;              // modification time recorded in the header
+    uint32_t name_offset;       // start of the member's null-terminated name in the name table
+    uint32_t name_len;          // length of the name, not counting the null terminator
+    uint32_t flags;             // INDEX_* flags
+    uint32_t link_offset;       // start of the null-terminated link target in the name table, 0 unless INDEX_HARDLINK
+} index_entry_t;
+
+// index_entry_t flags
+#define INDEX_SPARSE 1          // data is a sparse map and extents, see sparse.h
+#define INDEX_HARDLINK 2        // hard link to the member named at 'link_offset', no data of its own
+
+// Fixed-size block at the start of the sidecar file
+typedef struct {
+    char magic[8];
+    uint64_t archive_size;      // archive size and mtime when the index was written,
+    int64_t archive_mtime_sec;  // if either changed since then the index is stale
+    int64_t archive_mtime_nsec;
+    uint64_t end_offset;        // offset of the archive's end-of-archive marker
+    uint32_t num_entries;
+    uint32_t names_len;
+} index_file_header_t;
+
+// In-memory index, entries sorted by name and then by header offset
+typedef struct {
+    index_entry_t *entries;
+    uint32_t num_entries;
+    uint32_t entries_cap;
+    char *names;
+    uint32_t names_len;
+    uint32_t names_cap;
+    uint64_t end_offset;
+} archive_index_t;
+
+// Initialize a new, empty index
+void archive_index_init(archive_index_t *index);
+
+// Free all memory held by the index
+void archive_index_free(archive_index_t *index);
+
+/*
+ * Get an index for the archive 'archive_name'. A fresh sidecar is loaded as is; a stale
+ * one (the archive was changed behind its back) is rebuilt from the archive's headers
+ * and written back. A missing sidecar is only built and written if 'create' is set.
+ * Returns 0 if 'index' is ready to use, 1 if there is no sidecar and 'create' is 0,
+ * or -1 if an error occurred
+ */
+int archive_index_open(const char *archive_name, archive_index_t *index, int create);
+
+/*
+ * Add the members found by walking the headers of 'archive_name' from the index's
+ * current end offset onwards (from the start for an empty index), then re-sort it.
+ * Used to build an index from scratch and to pick up members an append just wrote.
+ * Offsets are positions in the tar stream, also for compressed archives.
+ * Returns 0 on success, -1 on error
+ */
+int archive_index_scan(const char *archive_name, archive_index_t *index);
+
+// Same as archive_index_scan, for a tar stream that is already open behind 'read_fn'
+int archive_index_scan_from(archive_pread_fn read_fn, void *ctx, archive_index_t *index);
+
+/*
+ * Same as archive_index_scan, but only the first member of each name goes into 'index'.
+ * If 'names' isn't NULL the scan also stops as soon as every name in it has been found,
+ * without reading the rest of the archive (--occurrence). The index then ends where the
+ * scan stopped, so it must not be written as a sidecar.
+ * Returns 0 on success, -1 on error
+ */
+int archive_index_scan_first(const char *archive_name, const file_list_t *names, archive_index_t *index);
+
+// Same as archive_index_scan_first, for a tar stream that is already open behind 'read_fn'
+int archive_index_scan_first_from(archive_pread_fn read_fn, void *ctx, const file_list_t *names,
+                                  archive_index_t *index);
+
+/*
+ * Append an entry for 'member' to 'index', for callers that walk the headers themselves.
+ * The index can't be searched until archive_index_sort has run
+ * Returns 0 on success, -1 if out of memory
+ */
+int archive_index_add(archive_index_t *index, const archive_member_t *member);
+
+// Sort the entries by name and then archive position, as lookups expect
+void archive_index_sort(archive_index_t *index);
+
+/*
+ * Write 'index' to the sidecar of 'archive_name', stamped with the archive's current
+ * size and mtime. The sidecar is replaced atomically with a rename.
+ * Returns 0 on success, -1 on error
+ */
+int archive_index_write(const char *archive_name, const archive_index_t *index);
+
+/*
+ * Look up the most recently added member called 'name' with a binary search
+ * Returns the entry, or NULL if no member has that name
+ */
+const index_entry_t *archive_index_find(const archive_index_t *index, const char *name);
+
+// Name of an index entry
+const char *archive_index_name(const archive_index_t *index, const index_entry_t *entry);
+
+// Link target of an INDEX_HARDLINK entry
+const char *archive_index_link_target(const archive_index_t *index, const index_entry_t *entry);
+
+/*
+ * The entry whose data 'entry' unpacks to: for an INDEX_HARDLINK entry the last version
+ * of its link target that comes before the link in the archive (what the target was when
+ * the link was made, like GNU tar), 'entry' itself otherwise.
+ * Returns NULL if there is no such version of the link target (or it is a link itself)
+ */
+const index_entry_t *archive_index_resolve(const archive_index_t *index, const index_entry_t *entry);
+
+/*
+ * Fill 'order' (num_entries pointers) with the index's entries sorted by their
+ * position in the archive, i.e. the order a header scan would visit them
+ */
+void archive_index_archive_order(const archive_index_t *index, const index_entry_t **order);
+
+/*
+ * Fill 'live' (room for num_entries pointers) with the most recent version of every
+ * distinct member name, sorted by position in the archive. Older versions that a
+ * later member of the same name supersedes are left out.
+ * Returns the number of entries written to 'live'
+ */
+uint32_t archive_index_latest(const archive_index_t *index, const index_entry_t **live);
+
+#endif
@@ -0,0 +1,390 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive_io.h"
+#include "copy_engine.h"
+#include "links.h"
+#include "minitar.h"
+#include "sparse.h"
+#include "stats.h"
+
+#define NUM_TRAILING_BLOCKS 2
+#define MAX_MSG_LEN 512
+// First allocation of a memory sink, doubled whenever it fills up
+#define BUFFER_INIT_CAP (64 * BLOCK_SIZE)
+
+static int fd_write(void *ctx, const void *buf, size_t len) {
+    return write_all((int)(intptr_t)ctx, buf, len);
+}
+
+void archive_sink_fd(archive_sink_t *sink, int fd) {
+    sink->write_fn = fd_write;
+    sink->ctx = (void *)(intptr_t)fd;
+    sink->fd = fd;
+}
+
+static int buffer_write(void *ctx, const void *buf, size_t len) {
+    archive_buffer_t *buffer = ctx;
+    if (buffer->len + len > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap : BUFFER_INIT_CAP;
+        while (cap < buffer->len + len) {
+            cap *= 2;
+        }
+        char *data = realloc(buffer->data, cap);
+        if (data == NULL) {
+            perror("Failed to grow archive buffer");
+            return -1;
+        }
+        buffer->data = data;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, buf, len);
+    buffer->len += len;
+    return 0;
+}
+
+void archive_sink_memory(archive_sink_t *sink, archive_buffer_t *buffer) {
+    sink->write_fn = buffer_write;
+    sink->ctx = buffer;
+    sink->fd = -1;
+}
+
+void archive_buffer_free(archive_buffer_t *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(archive_buffer_t));
+}
+
+ssize_t buffer_pread(void *ctx, void *buf, size_t len, off_t offset) {
+    const archive_buffer_t *buffer = ctx;
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((size_t)offset >= buffer->len) {
+        return 0;
+    }
+    size_t n = buffer->len - offset < len ? buffer->len - offset : len;
+    memcpy(buf, buffer->data + offset, n);
+    return n;
+}
+
+void archive_writer_init(archive_writer_t *writer, const archive_sink_t *sink) {
+    memset(writer, 0, sizeof(archive_writer_t));
+    writer->sink = *sink;
+    link_table_init(&writer->links);
+}
+
+void archive_writer_free(archive_writer_t *writer) {
+    link_table_free(&writer->links);
+    free(writer->buf);
+    writer->buf = NULL;
+}
+
+/*
+ * Hands 'len' bytes to the sink. Once a write has failed nothing more goes out
+ * Returns 0 on success, -1 on error
+ */
+static int sink_write(archive_writer_t *writer, const void *buf, size_t len) {
+    if (writer->failed || writer->sink.write_fn(writer->sink.ctx, buf, len) != 0) {
+        writer->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Same as sink_write, for 'len' zero bytes
+static int sink_zeros(archive_writer_t *writer, off_t len) {
+    static const char zeros[BLOCK_SIZE * 8];
+    while (len > 0) {
+        size_t chunk = len > (off_t)sizeof(zeros) ? sizeof(zeros) : len;
+        if (sink_write(writer, zeros, chunk) != 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Same as sink_write, for the zeros that complete the last block of a body of 'size' bytes
+static int sink_padding(archive_writer_t *writer, off_t size) {
+    size_t remainder = size % BLOCK_SIZE;
+    return remainder != 0 ? sink_zeros(writer, BLOCK_SIZE - remainder) : 0;
+}
+
+/*
+ * Writes the header blocks of 'mh', the extended header first
+ * Returns 0 on success, -1 on error
+ */
+static int sink_header(archive_writer_t *writer, const member_header_t *mh) {
+    if (mh->pax != NULL && sink_write(writer, mh->pax, mh->pax_len) != 0) {
+        return -1;
+    }
+    return sink_write(writer, &mh->header, BLOCK_SIZE);
+}
+
+// Records a member of 'header_len' header bytes and 'size' data bytes in the --stats counters
+static void count_member(off_t header_len, off_t size) {
+    stats_count(STAT_FILES, 1);
+    stats_count(STAT_DATA_BYTES, size);
+    stats_count(STAT_BLOCKS, (header_len + size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+static ssize_t fd_read(void *ctx, void *buf, size_t len) {
+    ssize_t n;
+    do {
+        n = read(*(int *)ctx, buf, len);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/*
+ * Moves 'size' bytes from 'read_fn' to the sink through the writer's staging buffer,
+ * zero filling whatever 'read_fn' doesn't deliver, then pads the last block
+ * Returns 0 on success, -1 on error
+ */
+static int sink_body(archive_writer_t *writer, off_t size, archive_read_fn read_fn, void *ctx) {
+    if (writer->buf == NULL && (writer->buf = malloc(COPY_BUF_SIZE)) == NULL) {
+        perror("Failed to allocate archive writer buffer");
+        return -1;
+    }
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n = read_fn(ctx, writer->buf, size - done > COPY_BUF_SIZE ? COPY_BUF_SIZE : size - done);
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (sink_write(writer, writer->buf, n) != 0) {
+            return -1;
+        }
+        done += n;
+    }
+    if (sink_zeros(writer, size - done) != 0) {
+        return -1;
+    }
+    return sink_padding(writer, size);
+}
+
+/*
+ * Builds and writes the header blocks for 'name' described by 'stat_buf'
+ * Returns the number of header bytes written, or -1 on error
+ */
+static off_t begin_member(archive_writer_t *writer, const char *name, const struct stat *stat_buf) {
+    member_header_t hed;
+    if (fill_member_header(&hed, name, stat_buf) != 0) {
+        return -1;
+    }
+    off_t header_len = hed.pax_len + BLOCK_SIZE;
+    int status = sink_header(writer, &hed);
+    member_header_free(&hed);
+    if (status != 0) {
+        perror("Failed to write the header into archive");
+        return -1;
+    }
+    return header_len;
+}
+
+int archive_writer_add_buffer(archive_writer_t *writer, const char *name, const struct stat *stat_buf,
+                              const void *data) {
+    off_t header_len = begin_member(writer, name, stat_buf);
+    if (header_len == -1) {
+        return -1;
+    }
+    off_t size = S_ISDIR(stat_buf->st_mode) ? 0 : stat_buf->st_size;
+    if ((size > 0 && sink_write(writer, data, size) != 0) || sink_padding(writer, size) != 0) {
+        perror("Failed to write member data into archive");
+        return -1;
+    }
+    count_member(header_len, size);
+    return 0;
+}
+
+int archive_writer_add_fd(archive_writer_t *writer, const char *name, const struct stat *stat_buf, int fd) {
+    off_t header_len = begin_member(writer, name, stat_buf);
+    if (header_len == -1) {
+        return -1;
+    }
+    off_t size = S_ISDIR(stat_buf->st_mode) ? 0 : stat_buf->st_size;
+    int status;
+    if (writer->sink.fd != -1) {    // descriptor to descriptor, the copy engine keeps it in the kernel where it can
+        status = writer->failed ? -1 : copy_member_body(fd, writer->sink.fd, size);
+        writer->failed |= status != 0;
+    } else {
+        status = sink_body(writer, size, fd_read, &fd);
+    }
+    if (status != 0) {
+        perror("Failed to write member data into archive");
+        return -1;
+    }
+    count_member(header_len, size);
+    return 0;
+}
+
+int archive_writer_add_callback(archive_writer_t *writer, const char *name, const struct stat *stat_buf,
+                                archive_read_fn read_fn, void *ctx) {
+    off_t header_len = begin_member(writer, name, stat_buf);
+    if (header_len == -1) {
+        return -1;
+    }
+    off_t size = S_ISDIR(stat_buf->st_mode) ? 0 : stat_buf->st_size;
+    if (sink_body(writer, size, read_fn, ctx) != 0) {
+        perror("Failed to write member data into archive");
+        return -1;
+    }
+    char extra;
+    ssize_t n = read_fn(ctx, &extra, 1);
+    if (n != 0) {
+        if (n > 0) {
+            printf("Error: data for member %s is longer than its size of %lld bytes\n", name, (long long)size);
+        }
+        writer->failed = 1;     // the data written no longer matches the header
+        return -1;
+    }
+    count_member(header_len, size);
+    return 0;
+}
+
+int archive_writer_add_link(archive_writer_t *writer, const char *name, const struct stat *stat_buf,
+                            const char *target) {
+    member_header_t hed;
+    if (fill_link_member_header(&hed, name, stat_buf, target) != 0) {
+        return -1;
+    }
+    off_t header_len = hed.pax_len + BLOCK_SIZE;
+    int status = sink_header(writer, &hed);
+    member_header_free(&hed);
+    if (status != 0) {
+        perror("Failed to write the header into archive");
+        return -1;
+    }
+    count_member(header_len, 0);
+    return 0;
+}
+
+int archive_writer_add_file(archive_writer_t *writer, const char *path) {
+    char err_msg[MAX_MSG_LEN];
+    uint64_t start = stats_phase_begin();
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", path);
+        perror(err_msg);
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", path);
+        perror(err_msg);
+        close(fd);
+        return -1;
+    }
+
+    member_header_t hed;
+    sparse_map_t sparse;
+    uint64_t hash;
+    int linked = link_content_hash(fd, &stat_buf, &hash) == 0
+                     ? link_member_header(&writer->links, &hed, path, &stat_buf, hash) : -1;
+    int status = linked == -1 ? -1 : 0;
+    if (linked != 0) {
+        sparse_map_init(&sparse);
+    } else {
+        status = fill_member_header_fd(&hed, path, fd, &stat_buf, &sparse);
+    }
+    if (status != 0) {
+        close(fd);
+        return -1;
+    }
+    stats_phase_end(PHASE_HEADER, start);
+    start = stats_phase_begin();
+    if (sink_header(writer, &hed) != 0) {
+        perror("Failed to write the header into archive");
+        member_header_free(&hed);
+        sparse_map_free(&sparse);
+        close(fd);
+        return -1;
+    }
+    off_t header_len = hed.pax_len + BLOCK_SIZE;   // extended header blocks, if any, and the ustar one
+    member_header_free(&hed);
+    off_t size = S_ISDIR(stat_buf.st_mode) || linked ? 0 : stat_buf.st_size;    // a directory or link is just its header
+    if (sparse.count > 0) {     // only the data extents
+        size = sparse_member_size(&sparse);
+        status = writer->sink.fd != -1 ? sparse_write_body(fd, writer->sink.fd, &sparse)   // extents through the copy engine
+                                       : sparse_write_body_fn(fd, writer->sink.write_fn, writer->sink.ctx, &sparse);
+        sparse_map_free(&sparse);
+    } else if (writer->sink.fd != -1) {
+        status = copy_member_body(fd, writer->sink.fd, size);    // copy_file_range where possible, then the padding
+    } else {
+        status = sink_body(writer, size, fd_read, &fd);
+    }
+    writer->failed |= status != 0;
+    close(fd);
+    if (status != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to copy file %s into archive", path);
+        perror(err_msg);
+        return -1;
+    }
+    stats_phase_end(PHASE_DATA, start);
+    count_member(header_len, size);
+    return 0;
+}
+
+int archive_writer_finish(archive_writer_t *writer) {
+    uint64_t start = stats_phase_begin();
+    if (sink_zeros(writer, NUM_TRAILING_BLOCKS * BLOCK_SIZE) != 0) {
+        perror("Failed to write the footer at the end of archive");
+        return -1;
+    }
+    stats_phase_end(PHASE_FOOTER, start);
+    stats_count(STAT_BLOCKS, NUM_TRAILING_BLOCKS);
+    return 0;
+}
+
+void archive_reader_init(archive_reader_t *reader, archive_pread_fn read_fn, void *ctx) {
+    reader->read_fn = read_fn;
+    reader->ctx = ctx;
+    archive_member_init(&reader->member);
+    reader->offset = 0;
+    reader->data_read = 0;
+}
+
+void archive_reader_free(archive_reader_t *reader) {
+    archive_member_free(&reader->member);
+}
+
+int archive_reader_next(archive_reader_t *reader, const archive_member_t **member) {
+    int status = read_member_from(reader->read_fn, reader->ctx, reader->offset, &reader->member);
+    if (status != 1) {
+        return status;
+    }
+    reader->offset = reader->member.next_offset;
+    reader->data_read = 0;
+    *member = &reader->member;
+    return 1;
+}
+
+ssize_t archive_reader_read(archive_reader_t *reader, void *buf, size_t len) {
+    off_t left = reader->member.size - reader->data_read;
+    if (left <= 0) {
+        return 0;
+    }
+    if ((off_t)len > left) {
+        len = left;
+    }
+    ssize_t n = reader->read_fn(reader->ctx, buf, len, reader->member.data_offset + reader->data_read);
+    if (n == -1) {
+        perror("Failed to read member data from archive");
+        return -1;
+    }
+    if (n == 0) {
+        printf("Error: archive ends in the middle of member %s\n", reader->member.name);
+        return -1;
+    }
+    reader->data_read += n;
+    return n;
+}
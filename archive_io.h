@@ -0,0 +1,148 @@
+#ifndef _ARCHIVE_IO_H
+#define _ARCHIVE_IO_H
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "links.h"
+#include "minitar.h"
+
+/*
+ * Library interface for building and reading archives without going through files named
+ * on a command line. A writer takes members one at a time, with their data coming from a
+ * buffer, a file descriptor or a read callback, and puts the tar stream into a sink: a file
+ * descriptor or a growing memory buffer. A reader walks the members of any tar stream behind
+ * an archive_pread_fn (a descriptor, a memory buffer, stdin) and hands out each member's
+ * header followed by its data. The minitar operations in minitar.h are built on these.
+ */
+
+/*
+ * Writes all 'len' bytes of 'buf' to wherever 'ctx' leads
+ * Returns 0 on success, -1 on error
+ */
+typedef int (*archive_write_fn)(void *ctx, const void *buf, size_t len);
+
+/*
+ * Reads up to 'len' bytes of a member's data into 'buf', continuing where the last call stopped
+ * Returns the number of bytes read, 0 once there is no more, -1 on error
+ */
+typedef ssize_t (*archive_read_fn)(void *ctx, void *buf, size_t len);
+
+// Where a writer puts the tar stream
+typedef struct {
+    archive_write_fn write_fn;
+    void *ctx;
+    int fd;             // descriptor behind the sink or -1, lets data from descriptors go straight through the copy engine.
+                        // A writer's copy may be changed between members
+} archive_sink_t;
+
+// Memory that grows as a sink writes to it, and that buffer_pread can read an archive from
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} archive_buffer_t;
+
+// Sink writing to the descriptor 'fd' at its current offset
+void archive_sink_fd(archive_sink_t *sink, int fd);
+
+// Sink appending to 'buffer', which must have been zeroed or hold earlier output
+void archive_sink_memory(archive_sink_t *sink, archive_buffer_t *buffer);
+
+// Free the memory held by 'buffer'
+void archive_buffer_free(archive_buffer_t *buffer);
+
+// archive_pread_fn for an archive held in memory, 'ctx' points at its archive_buffer_t
+ssize_t buffer_pread(void *ctx, void *buf, size_t len, off_t offset);
+
+// Builds one archive, member by member
+typedef struct {
+    archive_sink_t sink;
+    link_table_t links;     // files written so far that later ones may be stored as hard links to
+    char *buf;              // staging for data that can't go straight to the sink, allocated on first use
+    int failed;             // a write went wrong, the archive is incomplete
+} archive_writer_t;
+
+// Start a new archive in 'sink'
+void archive_writer_init(archive_writer_t *writer, const archive_sink_t *sink);
+
+// Free what 'writer' holds. The sink is left alone
+void archive_writer_free(archive_writer_t *writer);
+
+/*
+ * Add the member 'name' holding the 'stat_buf->st_size' bytes at 'data'. The header is
+ * taken from 'stat_buf' (st_mode, st_size, st_mtime, st_uid and st_gid; everything else
+ * may be zero). A directory (S_ISDIR) has no data and 'data' may be NULL.
+ * Returns 0 on success, -1 on error
+ */
+int archive_writer_add_buffer(archive_writer_t *writer, const char *name, const struct stat *stat_buf,
+                              const void *data);
+
+/*
+ * Same as archive_writer_add_buffer, with the data read from the current offset of 'fd'.
+ * If 'fd' runs out early the rest is zero filled, so the member matches its header
+ * Returns 0 on success, -1 on error
+ */
+int archive_writer_add_fd(archive_writer_t *writer, const char *name, const struct stat *stat_buf, int fd);
+
+/*
+ * Same as archive_writer_add_buffer, with the data coming from 'read_fn' until it returns 0.
+ * Data past 'stat_buf->st_size' is an error, missing data is zero filled
+ * Returns 0 on success, -1 on error
+ */
+int archive_writer_add_callback(archive_writer_t *writer, const char *name, const struct stat *stat_buf,
+                                archive_read_fn read_fn, void *ctx);
+
+/*
+ * Add a hard link member 'name' pointing at the member 'target' written before it
+ * Returns 0 on success, -1 on error
+ */
+int archive_writer_add_link(archive_writer_t *writer, const char *name, const struct stat *stat_buf,
+                            const char *target);
+
+/*
+ * Add the file or directory at 'path' under its own name, the way minitar create does:
+ * a further link to a file already added, or with --dedupe the same contents, becomes a
+ * hard link member, and with --sparse a file with holes becomes a sparse member.
+ * Directories are not descended into, see expand_paths in walk.h.
+ * Returns 0 on success, -1 on error
+ */
+int archive_writer_add_file(archive_writer_t *writer, const char *path);
+
+/*
+ * Write the end-of-archive marker. Nothing may be added after this, unless the sink is a
+ * descriptor that the caller has moved back to the start of the marker
+ * Returns 0 on success, -1 on error (including any earlier write having failed)
+ */
+int archive_writer_finish(archive_writer_t *writer);
+
+// Walks the members of one archive in order
+typedef struct {
+    archive_pread_fn read_fn;
+    void *ctx;
+    archive_member_t member;    // the current member, valid until the next archive_reader_next
+    off_t offset;               // where the next member's headers start, may be set before the first call
+    off_t data_read;            // bytes of the current member's data handed out so far
+} archive_reader_t;
+
+// Start reading the tar stream behind 'read_fn' from its beginning
+void archive_reader_init(archive_reader_t *reader, archive_pread_fn read_fn, void *ctx);
+
+void archive_reader_free(archive_reader_t *reader);
+
+/*
+ * Move on to the next member and point '*member' at it. Whatever is left of the data of
+ * the previous member is skipped. Offsets only ever grow, so forward-only sources such as
+ * stream_pread (stream.h) work too.
+ * Returns 1 if there is a member, 0 at the end of the archive, -1 on error
+ */
+int archive_reader_next(archive_reader_t *reader, const archive_member_t **member);
+
+/*
+ * Read up to 'len' bytes of the current member's data as stored: nothing for a hard link,
+ * the sparse map and then the extents for a sparse member (see sparse.h)
+ * Returns the number of bytes read, 0 at the end of the data, -1 on error
+ */
+ssize_t archive_reader_read(archive_reader_t *reader, void *buf, size_t len);
+
+#endif
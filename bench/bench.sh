@@ -0,0 +1,153 @@
+#!/bin/sh
+# Throughput benchmark for minitar, run by "make bench".
+#
+# Builds three synthetic corpora under $BENCH_DIR (kept between runs, rebuilt when the
+# sizes below change) and times create, list, append, update and extract on each.
+# Every operation prints one JSON object on its own line to stdout, so results can be
+# collected with "make bench > results.jsonl" and compared across versions. Progress
+# goes to stderr. The page cache is not dropped, so timings are warm-cache numbers.
+#
+# Scale with environment variables:
+#   BENCH_TINY_FILES    number of files of 0-1023 bytes           (default 100000)
+#   BENCH_MEDIUM_FILES  number of files of 64 KiB - 8 MiB         (default 200)
+#   BENCH_LARGE_FILES   number of large files                     (default 2)
+#   BENCH_LARGE_MB      size of each large file in MiB            (default 2048)
+#   BENCH_THREADS       -j value passed to minitar                (default 1)
+#   BENCH_OPTS          extra minitar options, e.g. "-z"          (default none)
+#   BENCH_DIR           where corpora and archives live           (default bench-data)
+set -eu
+
+TINY=${BENCH_TINY_FILES:-100000}
+MEDIUM=${BENCH_MEDIUM_FILES:-200}
+LARGE=${BENCH_LARGE_FILES:-2}
+LARGE_MB=${BENCH_LARGE_MB:-2048}
+THREADS=${BENCH_THREADS:-1}
+OPTS=${BENCH_OPTS:-}
+DIR=${BENCH_DIR:-bench-data}
+UPDATE_NAMES=1000   # update takes its names on the command line, so only this many are passed
+
+MINITAR=$(cd "$(dirname "$0")/.." && pwd)/minitar
+RUNSTAT=$(cd "$(dirname "$0")" && pwd)/runstat
+VERSION=$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null || echo unknown)
+
+mkdir -p "$DIR"
+cd "$DIR"
+
+# 8 MiB of random data that the medium and large files are cut from, so they don't compress to nothing
+if [ ! -f seed ]; then
+    head -c 8388608 /dev/urandom > seed
+fi
+
+# make_corpus NAME PARAMS: (re)generate corpus NAME unless it was built with the same PARAMS
+make_corpus() {
+    if [ -f "$1/.params" ] && [ "$(cat "$1/.params")" = "$2" ]; then
+        return
+    fi
+    echo "bench: generating $1 corpus ($2)" >&2
+    rm -rf "$1"
+    mkdir -p "$1"
+    case $1 in
+    tiny)
+        awk -v n="$TINY" 'BEGIN {
+            pad = sprintf("%1024s", "")
+            for (d = 0; d < 100; d++) system("mkdir -p tiny/d" d)
+            for (i = 0; i < n; i++) {
+                f = "tiny/d" (i % 100) "/f" i
+                printf "%s", substr(pad, 1, (i * 7919) % 1024) > f
+                close(f)
+            }
+        }'
+        ;;
+    medium)
+        i=0
+        while [ $i -lt "$MEDIUM" ]; do
+            head -c $((65536 * (1 + (i * 37) % 128))) seed > "medium/f$i"
+            i=$((i + 1))
+        done
+        ;;
+    large)
+        i=0
+        while [ $i -lt "$LARGE" ]; do
+            j=0
+            while [ $j -lt $((LARGE_MB / 8)) ]; do
+                cat seed
+                j=$((j + 1))
+            done > "large/f$i"
+            i=$((i + 1))
+        done
+        ;;
+    esac
+    echo "$2" > "$1/.params"
+}
+
+# run OP CORPUS FILES BYTES COMMAND...: time COMMAND and print its JSON result line
+run() {
+    r_op=$1 r_corpus=$2 r_files=$3 r_bytes=$4     # sh has no locals, keep clear of the caller's names
+    shift 4
+    if ! "$RUNSTAT" "$@" > /dev/null 2> stat.err; then
+        echo "bench: $r_op on $r_corpus failed:" >&2
+        cat stat.err >&2
+        exit 1
+    fi
+    tail -n 1 stat.err | awk -v version="$VERSION" -v op="$r_op" -v corpus="$r_corpus" -v threads="$THREADS" \
+        -v opts="$OPTS" -v files="$r_files" -v bytes="$r_bytes" '{
+        seconds = $2
+        rate = seconds > 0 ? 1 / seconds : 0
+        printf "{\"version\":\"%s\",\"op\":\"%s\",\"corpus\":\"%s\",\"threads\":%d,\"opts\":\"%s\",", version, op, corpus, threads, opts
+        printf "\"files\":%d,\"bytes\":%d,\"seconds\":%.6f,\"mb_per_s\":%.2f,\"files_per_s\":%.1f,\"peak_rss_kb\":%d}\n",
+            files, bytes, seconds, bytes * rate / 1e6, files * rate, $3
+    }'
+}
+
+make_corpus tiny "files=$TINY"
+make_corpus medium "files=$MEDIUM"
+make_corpus large "files=$LARGE size_mb=$LARGE_MB"
+
+for corpus in tiny medium large; do
+    files=$(find "$corpus" -type f ! -name .params | wc -l)
+    bytes=$(find "$corpus" -type f ! -name .params -printf '%s\n' | awk '{ sum += $1 } END { print sum + 0 }')
+    echo "bench: $corpus, $files files, $bytes bytes" >&2
+    rm -f "$corpus.tar" "$corpus.tar.idx"
+
+    # shellcheck disable=SC2086
+    run create "$corpus" "$files" "$bytes" "$MINITAR" -c -j "$THREADS" $OPTS -f "$corpus.tar" "$corpus"
+    # shellcheck disable=SC2086
+    run list "$corpus" "$files" "$bytes" "$MINITAR" -t -j "$THREADS" $OPTS -f "$corpus.tar"
+
+    rm -rf out
+    mkdir out
+    (
+        cd out
+        # shellcheck disable=SC2086
+        run extract "$corpus" "$files" "$bytes" "$MINITAR" -x -j "$THREADS" $OPTS -f "../$corpus.tar"
+    )
+    rm -rf out
+
+    case " $OPTS " in
+    *" -z "*)   # compressed archives can't be appended to or updated
+        continue
+        ;;
+    esac
+
+    # Update: the first UPDATE_NAMES files are named, every tenth of them has changed. They grow
+    # by a byte rather than being touched, mtimes only count whole seconds and may not move.
+    # The bytes reported are those of the changed files, the only ones update appends
+    names=$(find "$corpus" -type f ! -name .params | sort | head -n "$UPDATE_NAMES")
+    changed=$(echo "$names" | awk 'NR % 10 == 1')
+    for f in $changed; do
+        printf x >> "$f"
+    done
+    update_bytes=$(echo "$changed" | xargs stat -c %s | awk '{ sum += $1 } END { print sum + 0 }')
+    # shellcheck disable=SC2086
+    run update "$corpus" "$(echo "$names" | wc -l)" "$update_bytes" "$MINITAR" -u -j "$THREADS" $OPTS -f "$corpus.tar" $names
+    for f in $changed; do      # back to the generated sizes for the next run
+        truncate -s -1 "$f"
+    done
+
+    # Append: the whole corpus again, onto a copy of the archive
+    cp "$corpus.tar" "$corpus-append.tar"
+    # shellcheck disable=SC2086
+    run append "$corpus" "$files" "$bytes" "$MINITAR" -a -j "$THREADS" $OPTS -f "$corpus-append.tar" "$corpus"
+    rm -f "$corpus.tar" "$corpus-append.tar" "$corpus.tar.idx" "$corpus-append.tar.idx"
+done
+rm -f stat.err
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Runs a command and reports how long it took and how much memory it needed, for bench.sh:
+ *
+ *   runstat COMMAND [ARG...]
+ *
+ * The command's own output is left alone. When it exits, one line
+ * "<exit status> <wall seconds> <peak RSS in KiB>" goes to stderr.
+ * Returns the command's exit status, or 127 if it couldn't be started
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s COMMAND [ARG...]\n", argv[0]);
+        return 127;
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Failed to fork in runstat");
+        return 127;
+    }
+    if (pid == 0) {
+        execvp(argv[1], argv + 1);
+        perror("Failed to run command in runstat");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("Failed to wait for command in runstat");
+        return 127;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    fprintf(stderr, "%d %.6f %ld\n", code, seconds, usage.ru_maxrss);  // ru_maxrss is in KiB on Linux
+    return code;
+}
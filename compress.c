@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "copy_engine.h"
+#include "minitar.h"
+#include "stream.h"
+
+// What a chunk slot in the compression pipeline is currently doing
+#define SLOT_FREE 0
+#define SLOT_PENDING 1  // filled with raw data, waiting for a worker
+#define SLOT_WORKING 2
+#define SLOT_DONE 3     // compressed, waiting to be written out
+
+typedef struct {
+    char *raw;
+    size_t raw_len;
+    char *comp;
+    uLongf comp_len;
+    int state;
+    int status;
+} mtz_slot_t;
+
+// State shared between the thread feeding mtz_compress_stream and its workers
+typedef struct {
+    mtz_slot_t *slots;
+    int num_slots;
+    int exiting;                // no more work will arrive
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // a slot became SLOT_PENDING, or it's time to exit
+    pthread_cond_t done;        // a slot became SLOT_DONE
+} mtz_pool_t;
+
+int mtz_default_threads(void) {
+    if (minitar_opts.num_threads_given) {
+        return minitar_opts.num_threads;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+static void *compress_worker(void *arg) {
+    mtz_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        mtz_slot_t *slot = NULL;
+        for (int i = 0; i < pool->num_slots; i++) {
+            if (pool->slots[i].state == SLOT_PENDING) {
+                slot = &pool->slots[i];
+                break;
+            }
+        }
+        if (slot == NULL) {
+            if (pool->exiting) {
+                break;
+            }
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        slot->state = SLOT_WORKING;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->comp_len = compressBound(MTZ_CHUNK_SIZE);
+        int status = compress2((Bytef *)slot->comp, &slot->comp_len, (const Bytef *)slot->raw, slot->raw_len,
+                               Z_DEFAULT_COMPRESSION) == Z_OK ? 0 : -1;
+
+        pthread_mutex_lock(&pool->lock);
+        slot->status = status;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Fill 'buf' with up to 'len' bytes from 'fd', only stopping short at EOF (pipes return partial reads)
+ * Returns the number of bytes read, or -1 on error
+ */
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, buf + total, len - total);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/*
+ * Wait for the chunk in 'slot' to be compressed, write it out at '*offset' and record it in 'table'
+ * Returns 0 on success, -1 on error
+ */
+static int flush_slot(mtz_pool_t *pool, mtz_slot_t *slot, int dst_fd, uint64_t *offset, mtz_chunk_t *table) {
+    pthread_mutex_lock(&pool->lock);
+    while (slot->state != SLOT_DONE) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    int ret = slot->status;
+    if (ret != 0) {
+        printf("Error: failed to compress archive chunk\n");
+    } else if (write_all(dst_fd, slot->comp, slot->comp_len) != 0) {
+        perror("Failed to write compressed chunk");
+        ret = -1;
+    } else {
+        table->comp_offset = *offset;
+        table->comp_len = slot->comp_len;
+        table->raw_len = slot->raw_len;
+        *offset += slot->comp_len;
+    }
+    pthread_mutex_lock(&pool->lock);
+    slot->state = SLOT_FREE;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+int mtz_compress_stream(int src_fd, int dst_fd, int num_threads) {
+    mtz_pool_t pool;
+    memset(&pool, 0, sizeof(mtz_pool_t));
+    pool.num_slots = num_threads * MTZ_SLOTS_PER_THREAD;
+    pool.slots = calloc(pool.num_slots, sizeof(mtz_slot_t));
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    uint64_t table_cap = 64;
+    mtz_chunk_t *table = malloc(sizeof(mtz_chunk_t) * table_cap);
+    int ret = 0;
+    if (pool.slots == NULL || threads == NULL || table == NULL) {
+        ret = -1;
+    }
+    for (int i = 0; ret == 0 && i < pool.num_slots; i++) {
+        pool.slots[i].raw = malloc(MTZ_CHUNK_SIZE);
+        pool.slots[i].comp = malloc(compressBound(MTZ_CHUNK_SIZE));
+        if (pool.slots[i].raw == NULL || pool.slots[i].comp == NULL) {
+            ret = -1;
+        }
+    }
+    if (ret != 0) {
+        perror("Failed to allocate compression buffers");
+    }
+
+    mtz_file_header_t file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, MTZ_MAGIC, sizeof(MTZ_MAGIC));
+    file_header.chunk_size = MTZ_CHUNK_SIZE;
+    if (ret == 0 && write_all(dst_fd, &file_header, sizeof(file_header)) != 0) {
+        perror("Failed to write compressed archive header");
+        ret = -1;
+    }
+
+    int started = 0;
+    if (ret == 0) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.work, NULL);
+        pthread_cond_init(&pool.done, NULL);
+        for (; started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, compress_worker, &pool) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            perror("Failed to start compression threads");
+            ret = -1;
+        }
+    }
+
+    uint64_t offset = sizeof(file_header);
+    uint64_t raw_size = 0;
+    uint64_t next_read = 0;     // chunks handed to workers so far
+    uint64_t next_write = 0;    // chunks written out so far
+    int eof = 0;
+    while (ret == 0 && !eof) {
+        if (next_read - next_write == (uint64_t)pool.num_slots) {  // every slot busy, oldest one goes out first
+            ret = flush_slot(&pool, &pool.slots[next_write % pool.num_slots], dst_fd, &offset, &table[next_write]);
+            next_write++;
+            continue;
+        }
+        mtz_slot_t *slot = &pool.slots[next_read % pool.num_slots];
+        ssize_t n = read_full(src_fd, slot->raw, MTZ_CHUNK_SIZE);
+        if (n == -1) {
+            perror("Failed to read tar stream for compression");
+            ret = -1;
+            break;
+        }
+        if (n < MTZ_CHUNK_SIZE) {
+            eof = 1;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (next_read == table_cap) {
+            table_cap *= 2;
+            mtz_chunk_t *bigger = realloc(table, sizeof(mtz_chunk_t) * table_cap);
+            if (bigger == NULL) {
+                perror("Failed to grow chunk table");
+                ret = -1;
+                break;
+            }
+            table = bigger;
+        }
+        raw_size += n;
+        pthread_mutex_lock(&pool.lock);
+        slot->raw_len = n;
+        slot->state = SLOT_PENDING;
+        pthread_cond_signal(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+        next_read++;
+    }
+    while (next_write < next_read) {    // whatever is still in flight, in order
+        int status = flush_slot(&pool, &pool.slots[next_write % pool.num_slots], dst_fd, &offset, &table[next_write]);
+        if (status != 0) {
+            ret = -1;
+        }
+        next_write++;
+    }
+
+    if (started > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pool.exiting = 1;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.work);
+        pthread_cond_destroy(&pool.done);
+    }
+
+    if (ret == 0) {     // chunk table and trailer, so readers can find every chunk
+        mtz_trailer_t trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        trailer.table_offset = offset;
+        trailer.num_chunks = next_read;
+        trailer.raw_size = raw_size;
+        memcpy(trailer.magic, MTZ_END_MAGIC, sizeof(MTZ_END_MAGIC));
+        if (write_all(dst_fd, table, sizeof(mtz_chunk_t) * next_read) != 0
+            || write_all(dst_fd, &trailer, sizeof(trailer)) != 0) {
+            perror("Failed to write chunk table");
+            ret = -1;
+        }
+    } else {
+        // Keep draining so whoever writes the tar stream into 'src_fd' doesn't block or get SIGPIPE
+        char drain[BLOCK_SIZE * 8];
+        while (read(src_fd, drain, sizeof(drain)) > 0) {
+        }
+    }
+
+    for (int i = 0; pool.slots != NULL && i < pool.num_slots; i++) {
+        free(pool.slots[i].raw);
+        free(pool.slots[i].comp);
+    }
+    free(pool.slots);
+    free(threads);
+    free(table);
+    return ret;
+}
+
+/*
+ * Buffer for the compressed bytes of any chunk of 'reader', aligned for O_DIRECT and with
+ * room for the parts of the blocks before and after the chunk that such a read brings in
+ * Returns the buffer, or NULL if out of memory
+ */
+static char *alloc_comp_buf(const mtz_reader_t *reader) {
+    char *buf;
+    return posix_memalign((void **)&buf, DIRECT_ALIGN, compressBound(reader->chunk_size) + 2 * DIRECT_ALIGN) == 0
+               ? buf : NULL;
+}
+
+int mtz_check_table(const mtz_reader_t *reader) {
+    int problems = 0;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < reader->num_chunks; i++) {
+        uint32_t raw_len = reader->chunks[i].raw_len;
+        if (i + 1 < reader->num_chunks ? raw_len != reader->chunk_size : raw_len == 0 || raw_len > reader->chunk_size) {
+            if (problems == 0) {    // one line is enough, a shifted table would fill the screen
+                printf("Error: chunk %llu of %llu holds %u bytes of tar stream, chunks are %u bytes\n",
+                       (unsigned long long)i, (unsigned long long)reader->num_chunks, raw_len, reader->chunk_size);
+            }
+            problems = 1;
+        }
+        total += raw_len;
+    }
+    if (total != reader->raw_size) {
+        printf("Error: chunks hold %llu bytes of tar stream, the trailer says %llu\n", (unsigned long long)total,
+               (unsigned long long)reader->raw_size);
+        problems++;
+    }
+    return problems;
+}
+
+int mtz_open(int fd, mtz_reader_t *reader) {
+    int status = mtz_open_unchecked(fd, reader);
+    if (status == 1 && mtz_check_table(reader) != 0) {
+        printf("Error: compressed archive has a damaged chunk table\n");
+        mtz_close(reader);
+        return -1;
+    }
+    return status;
+}
+
+int mtz_open_unchecked(int fd, mtz_reader_t *reader) {
+    memset(reader, 0, sizeof(mtz_reader_t));
+    reader->fd = fd;
+    reader->cached_chunk = -1;
+
+    mtz_file_header_t file_header;
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        perror("Failed to stat archive");
+        return -1;
+    }
+    if (stat_buf.st_size < (off_t)(sizeof(file_header) + sizeof(mtz_trailer_t))
+        || pread(fd, &file_header, sizeof(file_header), 0) != sizeof(file_header)
+        || memcmp(file_header.magic, MTZ_MAGIC, sizeof(MTZ_MAGIC)) != 0) {
+        return 0;
+    }
+    mtz_trailer_t trailer;
+    if (pread(fd, &trailer, sizeof(trailer), stat_buf.st_size - sizeof(trailer)) != sizeof(trailer)
+        || memcmp(trailer.magic, MTZ_END_MAGIC, sizeof(MTZ_END_MAGIC)) != 0) {
+        return 0;   // a tar member that happens to be called MTZ1
+    }
+
+    if (file_header.chunk_size == 0 || trailer.num_chunks > (uint64_t)stat_buf.st_size / sizeof(mtz_chunk_t)
+        || trailer.table_offset + trailer.num_chunks * sizeof(mtz_chunk_t) + sizeof(trailer) != (uint64_t)stat_buf.st_size) {
+        printf("Error: compressed archive has a damaged chunk table\n");
+        return -1;
+    }
+    reader->chunk_size = file_header.chunk_size;
+    reader->num_chunks = trailer.num_chunks;
+    reader->raw_size = trailer.raw_size;
+    size_t table_len = sizeof(mtz_chunk_t) * reader->num_chunks;
+    reader->chunks = malloc(table_len > 0 ? table_len : 1);
+    reader->cache = malloc(reader->chunk_size);
+    reader->comp_buf = alloc_comp_buf(reader);
+    if (reader->chunks == NULL || reader->cache == NULL || reader->comp_buf == NULL) {
+        perror("Failed to allocate compressed archive reader");
+        mtz_close(reader);
+        return -1;
+    }
+    if (pread(fd, reader->chunks, table_len, trailer.table_offset) != (ssize_t)table_len) {
+        perror("Failed to read chunk table");
+        mtz_close(reader);
+        return -1;
+    }
+    return 1;
+}
+
+int mtz_bypass_cache(mtz_reader_t *reader) {
+    int flags = fcntl(reader->fd, F_GETFL);
+    if (flags != -1 && fcntl(reader->fd, F_SETFL, flags | O_DIRECT) == 0) {
+        reader->cache_mode = CACHE_DIRECT;
+    } else {
+        reader->cache_mode = CACHE_DROP;
+    }
+    return reader->cache_mode;
+}
+
+void mtz_close(mtz_reader_t *reader) {
+    if (reader->cache_mode == CACHE_DROP) {     // large folios across chunk edges outlive the drop after each chunk
+        posix_fadvise(reader->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    free(reader->chunks);
+    free(reader->cache);
+    free(reader->comp_buf);
+    reader->chunks = NULL;
+    reader->cache = NULL;
+    reader->comp_buf = NULL;
+    reader->cached_chunk = -1;
+    reader->cache_mode = CACHE_KEEP;
+}
+
+/*
+ * Read the compressed bytes of 'chunk' into 'comp', a buffer from alloc_comp_buf. With
+ * O_DIRECT the read covers whole aligned blocks, so the chunk starts a little way in.
+ * Returns a pointer to the chunk's compressed bytes, or NULL on error
+ */
+static const char *read_chunk(const mtz_reader_t *reader, const mtz_chunk_t *chunk, char *comp) {
+    off_t from = chunk->comp_offset;
+    size_t len = chunk->comp_len;
+    if (reader->cache_mode == CACHE_DIRECT) {
+        from &= ~(off_t)(DIRECT_ALIGN - 1);
+        len = (chunk->comp_offset + chunk->comp_len - from + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    }
+    size_t need = chunk->comp_offset + chunk->comp_len - from;
+    size_t done = 0;
+    while (done < need) {   // only an O_DIRECT read at the end of the file may bring in less than 'len'
+        ssize_t n = pread(reader->fd, comp + done, len - done, from + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("Failed to read compressed chunk");
+            return NULL;
+        }
+        done += n;
+    }
+    if (reader->cache_mode == CACHE_DROP) {     // best effort, like the stream reader's
+        posix_fadvise(reader->fd, chunk->comp_offset, chunk->comp_len, POSIX_FADV_DONTNEED);
+    }
+    return comp + (chunk->comp_offset - from);
+}
+
+/*
+ * Inflate chunk 'index' of 'reader' into 'raw', reading its compressed bytes through 'comp',
+ * a buffer from alloc_comp_buf
+ * Returns 0 on success, -1 on error
+ */
+static int inflate_chunk(const mtz_reader_t *reader, uint64_t index, char *comp, char *raw) {
+    const mtz_chunk_t *chunk = &reader->chunks[index];
+    if (chunk->raw_len > reader->chunk_size || chunk->comp_len > compressBound(reader->chunk_size)) {
+        printf("Error: compressed archive has a damaged chunk table\n");
+        return -1;
+    }
+    const char *src = read_chunk(reader, chunk, comp);
+    if (src == NULL) {
+        return -1;
+    }
+    uLongf raw_len = reader->chunk_size;
+    if (uncompress((Bytef *)raw, &raw_len, (const Bytef *)src, chunk->comp_len) != Z_OK || raw_len != chunk->raw_len) {
+        printf("Error: compressed chunk %llu is corrupt\n", (unsigned long long)index);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Make the chunk holding tar stream offset 'offset' the cached chunk of 'reader', and set
+ * '*within' to where 'offset' is in it
+ * Returns the chunk's index, or -1 on error
+ */
+static int64_t load_chunk(mtz_reader_t *reader, uint64_t offset, size_t *within) {
+    uint64_t index = offset / reader->chunk_size;
+    *within = offset % reader->chunk_size;
+    if (index >= reader->num_chunks || *within >= reader->chunks[index].raw_len) {
+        printf("Error: compressed archive has a damaged chunk table\n");
+        errno = EINVAL;
+        return -1;
+    }
+    if (reader->cached_chunk == (int64_t)index) {
+        return index;
+    }
+    reader->cached_chunk = -1;
+    if (inflate_chunk(reader, index, reader->comp_buf, reader->cache) != 0) {
+        return -1;
+    }
+    reader->cached_chunk = index;
+    return index;
+}
+
+ssize_t mtz_pread(void *arg, void *buf, size_t len, off_t offset) {
+    mtz_reader_t *reader = arg;
+    if ((uint64_t)offset >= reader->raw_size) {
+        return 0;
+    }
+    if (len > reader->raw_size - offset) {
+        len = reader->raw_size - offset;
+    }
+    size_t done = 0;
+    while (done < len) {
+        size_t within;
+        int64_t index = load_chunk(reader, offset + done, &within);
+        if (index == -1) {
+            return -1;
+        }
+        size_t n = reader->chunks[index].raw_len - within;
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy((char *)buf + done, reader->cache + within, n);
+        done += n;
+    }
+    return done;
+}
+
+int mtz_copy_range(mtz_reader_t *reader, off_t offset, off_t len, int out_fd) {
+    if ((uint64_t)(offset + len) > reader->raw_size) {
+        printf("Error: compressed archive is truncated\n");
+        return -1;
+    }
+    while (len > 0) {
+        size_t within;
+        int64_t index = load_chunk(reader, offset, &within);
+        if (index == -1) {
+            return -1;
+        }
+        size_t n = reader->chunks[index].raw_len - within;
+        if ((off_t)n > len) {
+            n = len;
+        }
+        if (write_all(out_fd, reader->cache + within, n) != 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Shared by the threads of mtz_inflate_each
+typedef struct {
+    mtz_reader_t *reader;
+    mtz_chunk_fn fn;
+    void *ctx;
+    uint64_t next_chunk;    // claimed with an atomic increment
+    int failed;
+} inflate_job_t;
+
+static void *inflate_worker(void *arg) {
+    inflate_job_t *job = arg;
+    mtz_reader_t *reader = job->reader;
+    char *comp = alloc_comp_buf(reader);
+    char *raw = malloc(reader->chunk_size);
+    if (comp == NULL || raw == NULL) {
+        perror("Failed to allocate decompression buffers");
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+        uint64_t index = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+        if (index >= reader->num_chunks) {
+            break;
+        }
+        if (inflate_chunk(reader, index, comp, raw) != 0
+            || job->fn(job->ctx, index, raw, reader->chunks[index].raw_len, index * reader->chunk_size) != 0) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(comp);
+    free(raw);
+    return NULL;
+}
+
+int mtz_inflate_each(mtz_reader_t *reader, int num_threads, mtz_chunk_fn fn, void *ctx) {
+    inflate_job_t job = {reader, fn, ctx, 0, 0};
+    if ((uint64_t)num_threads > reader->num_chunks) {
+        num_threads = reader->num_chunks > 0 ? reader->num_chunks : 1;
+    }
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    if (threads == NULL) {
+        perror("Failed to allocate decompression threads");
+        return -1;
+    }
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, inflate_worker, &job) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {     // no threads available, do it all on this one
+        inflate_worker(&job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    return job.failed ? -1 : 0;
+}
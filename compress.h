@@ -0,0 +1,132 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Compressed archives ("-z") hold the same tar stream as a plain archive, cut into
+ * fixed-size chunks that are each deflated independently with zlib:
+ *
+ *   mtz_file_header_t | chunk 0 | chunk 1 | ... | mtz_chunk_t table | mtz_trailer_t
+ *
+ * Because no chunk depends on another, chunks are compressed and decompressed on a
+ * thread pool, and a reader can jump to any offset of the tar stream by inflating
+ * only the chunk(s) that cover it.
+ */
+#define MTZ_MAGIC "MTZ1"
+#define MTZ_END_MAGIC "MTZEND"
+
+// Bytes of tar stream per chunk
+#define MTZ_CHUNK_SIZE (4 << 20)
+
+// Chunks in flight per compression thread
+#define MTZ_SLOTS_PER_THREAD 2
+
+typedef struct {
+    char magic[8];
+    uint32_t chunk_size;
+    uint32_t reserved;
+} mtz_file_header_t;
+
+// Where one chunk's compressed bytes are, and how much tar stream it holds
+typedef struct {
+    uint64_t comp_offset;
+    uint32_t comp_len;
+    uint32_t raw_len;
+} mtz_chunk_t;
+
+typedef struct {
+    uint64_t table_offset;  // file offset of the chunk table
+    uint64_t num_chunks;
+    uint64_t raw_size;      // length of the uncompressed tar stream
+    char magic[8];
+} mtz_trailer_t;
+
+// Open compressed archive, with a one-chunk cache for small reads such as headers
+typedef struct {
+    int fd;
+    uint32_t chunk_size;
+    uint64_t num_chunks;
+    uint64_t raw_size;
+    mtz_chunk_t *chunks;
+    int64_t cached_chunk;   // index of the chunk in 'cache', -1 if none
+    char *cache;
+    char *comp_buf;         // DIRECT_ALIGN aligned, with room for the blocks around a chunk
+    int cache_mode;         // CACHE_* mode for 'fd', see mtz_bypass_cache
+} mtz_reader_t;
+
+/*
+ * Read a tar stream from 'src_fd' until EOF and write it to 'dst_fd' as a compressed
+ * archive, deflating chunks on 'num_threads' threads. Chunks are written in order.
+ * Returns 0 on success, -1 on error
+ */
+int mtz_compress_stream(int src_fd, int dst_fd, int num_threads);
+
+/*
+ * Check whether 'fd' is a compressed archive and if so load its chunk table into 'reader'.
+ * A table whose chunks don't add up to the tar stream in the trailer is rejected as damaged.
+ * Returns 1 if it is compressed and 'reader' is ready, 0 if it is a plain archive, -1 on error
+ */
+int mtz_open(int fd, mtz_reader_t *reader);
+
+/*
+ * Same as mtz_open, but a chunk table that doesn't add up is loaded anyway, for verify to
+ * report with mtz_check_table. Reads through 'reader' fail where the table is wrong.
+ */
+int mtz_open_unchecked(int fd, mtz_reader_t *reader);
+
+/*
+ * Check that the chunk table of 'reader' describes its tar stream: every chunk but the last
+ * holds a whole chunk, the last one something, and together they hold the trailer's
+ * raw_size. What doesn't match is printed.
+ * Returns the number of problems found
+ */
+int mtz_check_table(const mtz_reader_t *reader);
+
+/*
+ * Read the chunks of 'reader' without filling the page cache: with O_DIRECT, in whole
+ * aligned blocks around each chunk, or if the file system doesn't support that, with
+ * normal reads whose pages are dropped once the chunk is inflated. Reads done after this
+ * are safe to make from several threads, as before.
+ * Returns the CACHE_* mode in use (see stream.h)
+ */
+int mtz_bypass_cache(mtz_reader_t *reader);
+
+// Free everything held by 'reader'. Does not close its fd
+void mtz_close(mtz_reader_t *reader);
+
+/*
+ * Same contract as pread, but 'offset' is a position in the uncompressed tar stream.
+ * Only the chunks overlapping the requested range are inflated.
+ * 'reader' is an mtz_reader_t, the signature matches archive_pread_fn
+ */
+ssize_t mtz_pread(void *reader, void *buf, size_t len, off_t offset);
+
+/*
+ * Write 'len' bytes of the tar stream starting at 'offset' to 'out_fd'
+ * Returns 0 on success, -1 on error
+ */
+int mtz_copy_range(mtz_reader_t *reader, off_t offset, off_t len, int out_fd);
+
+/*
+ * Called by mtz_inflate_each with the 'len' bytes of tar stream starting at 'offset' that
+ * chunk 'index' holds. 'raw' is only valid until it returns.
+ * Returns 0 on success, -1 on error
+ */
+typedef int (*mtz_chunk_fn)(void *ctx, uint64_t index, const char *raw, size_t len, off_t offset);
+
+/*
+ * Inflate every chunk once, using 'num_threads' threads that each take whole chunks, and
+ * hand each one to 'fn' on the thread that inflated it. Chunks are claimed in order but
+ * 'fn' may see them in any order. After the first failure no more chunks are claimed.
+ * Returns 0 on success, -1 on error (a damaged chunk, or 'fn' failing)
+ */
+int mtz_inflate_each(mtz_reader_t *reader, int num_threads, mtz_chunk_fn fn, void *ctx);
+
+/*
+ * Number of threads to use for compression work: the -j setting if one was given,
+ * otherwise one per online CPU
+ */
+int mtz_default_threads(void);
+
+#endif
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "minitar.h"
+
+// Chunk handed to a single copy_file_range/sendfile call
+#define KERNEL_COPY_CHUNK (1 << 30)
+
+// Bytes moved by each method over the whole run, updated atomically so workers can share it
+static unsigned long long copy_bytes[NUM_COPY_METHODS];
+
+// Set once the running kernel says it has no copy_file_range/sendfile at all, so we stop asking
+static int method_unavailable[NUM_COPY_METHODS];
+
+/*
+ * Errors that mean "this method can't handle these two files", as opposed to a real I/O error
+ */
+static int is_unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+static void count_bytes(copy_method_t method, off_t n) {
+    __atomic_fetch_add(&copy_bytes[method], (unsigned long long)n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy with copy_file_range or sendfile until 'size' bytes are done, EOF, or the method
+ * turns out to be unsupported
+ * Returns bytes copied, or -1 on a real error. '*unsupported' is set if the caller should fall back
+ */
+static off_t kernel_copy(copy_method_t method, int src_fd, off_t *src_offset, int dst_fd, off_t size, int *unsupported) {
+    off_t copied = 0;
+    *unsupported = 0;
+    while (copied < size) {
+        size_t chunk = size - copied > KERNEL_COPY_CHUNK ? KERNEL_COPY_CHUNK : size - copied;
+        ssize_t n;
+        if (method == COPY_FILE_RANGE) {
+            n = copy_file_range(src_fd, src_offset, dst_fd, NULL, chunk, 0);
+        } else {
+            n = sendfile(dst_fd, src_fd, src_offset, chunk);
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (is_unsupported(errno)) {
+                if (errno == ENOSYS) {
+                    method_unavailable[method] = 1;
+                }
+                *unsupported = 1;
+                break;
+            }
+            return -1;
+        }
+        if (n == 0) {   // EOF, source is shorter than its header said
+            break;
+        }
+        copied += n;
+    }
+    count_bytes(method, copied);
+    return copied;
+}
+
+/*
+ * Last resort, read into a large buffer and write it back out
+ * Returns bytes copied or -1 on error
+ */
+static off_t buffered_copy(int src_fd, off_t *src_offset, int dst_fd, off_t size) {
+    char *buffer = malloc(COPY_BUF_SIZE);
+    if (buffer == NULL) {
+        perror("Failed to allocate copy buffer");
+        return -1;
+    }
+    off_t copied = 0;
+    while (copied < size) {
+        size_t chunk = size - copied > COPY_BUF_SIZE ? COPY_BUF_SIZE : size - copied;
+        ssize_t n = src_offset != NULL ? pread(src_fd, buffer, chunk, *src_offset) : read(src_fd, buffer, chunk);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (write_all(dst_fd, buffer, n) != 0) {
+            free(buffer);
+            return -1;
+        }
+        if (src_offset != NULL) {
+            *src_offset += n;
+        }
+        copied += n;
+    }
+    free(buffer);
+    count_bytes(COPY_BUFFERED, copied);
+    return copied;
+}
+
+/*
+ * Shared by copy_fd_data and copy_fd_data_at. With 'src_offset' NULL the source's file
+ * position is used and advanced, otherwise '*src_offset' is and the file position is left alone.
+ */
+static off_t copy_data(int src_fd, off_t *src_offset, int dst_fd, off_t size) {
+    off_t copied = 0;
+    for (copy_method_t method = COPY_FILE_RANGE; method < COPY_BUFFERED; method++) {
+        if (method_unavailable[method]) {
+            continue;
+        }
+        int unsupported;
+        off_t n = kernel_copy(method, src_fd, src_offset, dst_fd, size - copied, &unsupported);
+        if (n == -1) {
+            return -1;
+        }
+        copied += n;
+        if (!unsupported) {  // finished, or hit EOF
+            return copied;
+        }
+    }
+    off_t n = buffered_copy(src_fd, src_offset, dst_fd, size - copied);
+    if (n == -1) {
+        return -1;
+    }
+    return copied + n;
+}
+
+off_t copy_fd_data(int src_fd, int dst_fd, off_t size) {
+    return copy_data(src_fd, NULL, dst_fd, size);
+}
+
+off_t copy_fd_data_at(int src_fd, off_t src_offset, int dst_fd, off_t size) {
+    return copy_data(src_fd, &src_offset, dst_fd, size);
+}
+
+int move_fd_data(int fd, off_t src_offset, off_t dst_offset, off_t len) {
+    off_t gap = src_offset - dst_offset;
+    char *buffer = NULL;
+    while (len > 0) {
+        // A piece no longer than the gap doesn't overlap its destination, as copy_file_range requires.
+        // Small gaps would mean many small calls, those go through the buffer
+        if (gap >= COPY_BUF_SIZE && !method_unavailable[COPY_FILE_RANGE]) {
+            off_t in = src_offset;
+            off_t out = dst_offset;
+            size_t chunk = len < gap ? len : gap;
+            ssize_t n = copy_file_range(fd, &in, fd, &out, chunk > KERNEL_COPY_CHUNK ? KERNEL_COPY_CHUNK : chunk, 0);
+            if (n > 0) {
+                count_bytes(COPY_FILE_RANGE, n);
+                src_offset += n;
+                dst_offset += n;
+                len -= n;
+                continue;
+            }
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && !is_unsupported(errno)) {
+                free(buffer);
+                return -1;
+            }
+            if (n == -1 && errno == ENOSYS) {
+                method_unavailable[COPY_FILE_RANGE] = 1;
+            }
+            gap = 0;    // unsupported for this file, or EOF which the buffered path reports
+        }
+        if (buffer == NULL && (buffer = malloc(COPY_BUF_SIZE)) == NULL) {
+            perror("Failed to allocate copy buffer");
+            return -1;
+        }
+        // Read the whole piece before writing it, so the destination may overlap what was read
+        size_t chunk = len > COPY_BUF_SIZE ? COPY_BUF_SIZE : len;
+        ssize_t n = pread(fd, buffer, chunk, src_offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;    // the range to move runs past the end of the file
+            }
+            free(buffer);
+            return -1;
+        }
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = pwrite(fd, buffer + written, n - written, dst_offset + written);
+            if (w == -1 && errno != EINTR) {
+                free(buffer);
+                return -1;
+            }
+            written += w > 0 ? w : 0;
+        }
+        count_bytes(COPY_BUFFERED, n);
+        src_offset += n;
+        dst_offset += n;
+        len -= n;
+    }
+    free(buffer);
+    return 0;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int copy_member_body(int src_fd, int dst_fd, off_t size) {
+    off_t copied = copy_fd_data(src_fd, dst_fd, size);
+    if (copied == -1) {
+        return -1;
+    }
+    if (copied < size && write_zeros(dst_fd, size - copied) != 0) {    // file shrank since it was stat'ed
+        return -1;
+    }
+    return write_block_padding(dst_fd, size);
+}
+
+int write_zeros(int fd, off_t len) {
+    static const char zeros[BLOCK_SIZE * 8];
+    while (len > 0) {
+        size_t chunk = len > (off_t)sizeof(zeros) ? sizeof(zeros) : len;
+        if (write_all(fd, zeros, chunk) != 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+int write_block_padding(int fd, off_t size) {
+    size_t remainder = size % BLOCK_SIZE;
+    if (remainder == 0) {
+        return 0;
+    }
+    return write_zeros(fd, BLOCK_SIZE - remainder);
+}
+
+const char *copy_method_name(copy_method_t method) {
+    switch (method) {
+    case COPY_FILE_RANGE:
+        return "copy_file_range";
+    case COPY_SENDFILE:
+        return "sendfile";
+    case COPY_BUFFERED:
+        return "buffered";
+    default:
+        return "unknown";
+    }
+}
+
+void copy_engine_report(FILE *out) {
+    for (copy_method_t method = COPY_FILE_RANGE; method < NUM_COPY_METHODS; method++) {
+        unsigned long long bytes = __atomic_load_n(&copy_bytes[method], __ATOMIC_RELAXED);
+        if (bytes > 0) {
+            fprintf(out, "copy path: %s, %llu bytes\n", copy_method_name(method), bytes);
+        }
+    }
+}
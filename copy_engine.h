@@ -0,0 +1,74 @@
+#ifndef _COPY_ENGINE_H
+#define _COPY_ENGINE_H
+#include <stdio.h>
+#include <sys/types.h>
+
+// Buffer size used by the userspace fallback loop
+#define COPY_BUF_SIZE (1 << 20)
+
+// Ways a member body can get from one file descriptor to another, fastest first
+typedef enum {
+    COPY_FILE_RANGE = 0,    // copy_file_range, may share extents or copy entirely inside the kernel
+    COPY_SENDFILE,          // sendfile, kernel copy through the page cache
+    COPY_BUFFERED,          // plain read/write through a large userspace buffer
+    NUM_COPY_METHODS
+} copy_method_t;
+
+/*
+ * Copy up to 'size' bytes from the current offset of 'src_fd' to the current
+ * offset of 'dst_fd', trying copy_file_range first, then sendfile, then a
+ * buffered loop. Falls through to the next method whenever the kernel reports
+ * one is unsupported for this pair of files.
+ * Returns the number of bytes copied (less than 'size' only if 'src_fd' hit EOF)
+ * or -1 if an error occurred
+ */
+off_t copy_fd_data(int src_fd, int dst_fd, off_t size);
+
+/*
+ * Same as copy_fd_data, but reads from 'src_offset' of 'src_fd' without moving its
+ * file position, so several threads can copy out of the same source at once
+ */
+off_t copy_fd_data_at(int src_fd, off_t src_offset, int dst_fd, off_t size);
+
+/*
+ * Move 'len' bytes at 'src_offset' of 'fd' down to 'dst_offset' (below 'src_offset') in the
+ * same file, to close a gap. Pieces that can't overlap their destination go through
+ * copy_file_range; when the gap is small, or the file system can't, through a buffer.
+ * Returns 0 on success, -1 on error (including the range running past the end of the file)
+ */
+int move_fd_data(int fd, off_t src_offset, off_t dst_offset, off_t len);
+
+/*
+ * Copy the body of an archive member, 'size' bytes from 'src_fd' to 'dst_fd',
+ * followed by the zero padding that completes its last block. If the source
+ * turns out to be shorter than 'size' the missing bytes are written as zeros,
+ * so the archive always matches the size recorded in the member's header.
+ * Returns 0 on success, -1 on error
+ */
+int copy_member_body(int src_fd, int dst_fd, off_t size);
+
+/*
+ * Write all 'len' bytes of 'buf' to 'fd', retrying short writes
+ * Returns 0 on success, -1 on error
+ */
+int write_all(int fd, const void *buf, size_t len);
+
+/*
+ * Write 'len' zero bytes to 'fd'
+ * Returns 0 on success, -1 on error
+ */
+int write_zeros(int fd, off_t len);
+
+/*
+ * Write zero bytes to 'fd' until a body of 'size' bytes fills a whole number of blocks
+ * Returns 0 on success, -1 on error
+ */
+int write_block_padding(int fd, off_t size);
+
+// Name of a copy method, as printed by copy_engine_report
+const char *copy_method_name(copy_method_t method);
+
+// Print how many bytes went through each copy method so far
+void copy_engine_report(FILE *out);
+
+#endif
@@ -3,50 +3,131 @@
 
 #include "file_list.h"
 
+// Initial number of hash slots, and the fill level (in percent) at which the table doubles
+#define TABLE_INIT_CAP 64
+#define TABLE_MAX_LOAD 70
+
 void file_list_init(file_list_t *list) {
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
+    list->table = NULL;
+    list->table_cap = 0;
+    list->table_used = 0;
+    list->arena = NULL;
 }
 
-int file_list_add(file_list_t *list, const char *file_name) {
-    if (list->head == NULL) {
-        list->head = malloc(sizeof(node_t));
-        if (list->head == NULL) {
-            return 1;
+/*
+ * FNV-1a, cheap and good enough to spread file names over the table
+ */
+static unsigned hash_name(const char *name) {
+    unsigned hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Hand out 'len' bytes from the arena, starting a new chunk when the current one is full
+ * Returns NULL if out of memory
+ */
+static void *arena_alloc(file_list_t *list, size_t len) {
+    len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);   // keep nodes pointer-aligned
+    arena_chunk_t *chunk = list->arena;
+    if (chunk == NULL || chunk->cap - chunk->used < len) {
+        size_t cap = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arena_chunk_t) + cap);
+        if (chunk == NULL) {
+            return NULL;
         }
-        strncpy(list->head->name, file_name, MAX_NAME_LEN);
-        list->head->next = NULL;
-        list->size = 1;
-        return 0;
+        chunk->next = list->arena;
+        chunk->used = 0;
+        chunk->cap = cap;
+        list->arena = chunk;
     }
+    void *p = chunk->data + chunk->used;
+    chunk->used += len;
+    return p;
+}
 
-    node_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
+/*
+ * Find the slot where 'file_name' is, or where it would go if it isn't in the table
+ */
+static node_t **table_slot(node_t **table, int cap, const char *file_name, unsigned hash) {
+    int i = hash & (cap - 1);
+    while (table[i] != NULL) {
+        if (table[i]->hash == hash && strcmp(table[i]->name, file_name) == 0) {
+            break;
+        }
+        i = (i + 1) & (cap - 1);    // linear probing
+    }
+    return &table[i];
+}
+
+/*
+ * Double the hash table (or create it), re-inserting every name it held
+ * Returns 0 on success, 1 if out of memory
+ */
+static int table_grow(file_list_t *list) {
+    int cap = list->table_cap ? list->table_cap * 2 : TABLE_INIT_CAP;
+    node_t **table = calloc(cap, sizeof(node_t *));
+    if (table == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < list->table_cap; i++) {
+        if (list->table[i] != NULL) {
+            *table_slot(table, cap, list->table[i]->name, list->table[i]->hash) = list->table[i];
+        }
+    }
+    free(list->table);
+    list->table = table;
+    list->table_cap = cap;
+    return 0;
+}
+
+int file_list_add(file_list_t *list, const char *file_name) {
+    if ((list->table_used + 1) * 100 > list->table_cap * TABLE_MAX_LOAD && table_grow(list) != 0) {
+        return 1;
     }
-    current->next = malloc(sizeof(node_t));
-    if (current->next == NULL) {
+    size_t len = strlen(file_name);
+    node_t *node = arena_alloc(list, sizeof(node_t));
+    char *name = arena_alloc(list, len + 1);
+    if (node == NULL || name == NULL) {
         return 1;
     }
-    strncpy(current->next->name, file_name, MAX_NAME_LEN);
-    current->next->next = NULL;
+    memcpy(name, file_name, len + 1);
+    node->name = name;
+    node->hash = hash_name(name);
+    node->next = NULL;
+
+    if (list->tail == NULL) {
+        list->head = node;
+    } else {
+        list->tail->next = node;
+    }
+    list->tail = node;
     list->size++;
+
+    // Duplicates stay in the list, but the index only needs to know about a name once
+    node_t **slot = table_slot(list->table, list->table_cap, name, node->hash);
+    if (*slot == NULL) {
+        *slot = node;
+        list->table_used++;
+    }
     return 0;
 }
 
 int file_list_contains(const file_list_t *list, const char *file_name) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->name, file_name) == 0) {
-            return 1;
-        }
-        current = current->next;
+    if (list->table == NULL) {
+        return 0;
     }
-    return 0;
+    return *table_slot(list->table, list->table_cap, file_name, hash_name(file_name)) != NULL;
 }
 
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
-    // This approach is not particularly efficient
+    // One hash lookup in l2 per element of l1
     node_t *current = l1->head;
     while (current != NULL) {
         if (!file_list_contains(l2, current->name)) {
@@ -58,12 +139,12 @@ int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
 }
 
 void file_list_clear(file_list_t *list) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        node_t *to_free = current;
-        current = current->next;
+    arena_chunk_t *chunk = list->arena;
+    while (chunk != NULL) {     // nodes and names all live in the arena, so this frees everything
+        arena_chunk_t *to_free = chunk;
+        chunk = chunk->next;
         free(to_free);
     }
-    list->head = NULL;
-    list->size = 0;
+    free(list->table);
+    file_list_init(list);
 }
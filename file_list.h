@@ -1,18 +1,34 @@
 #ifndef _FILE_LIST_H
 #define _FILE_LIST_H
+#include <stddef.h>
 
-#define MAX_NAME_LEN 32
+// Size of each block of memory the list's arena hands out names and nodes from
+#define ARENA_CHUNK_SIZE (64 * 1024)
 
 //  Definition of each node in the linked list
 typedef struct node {
-    char name[MAX_NAME_LEN];
+    char *name;         // null-terminated, any length, lives in the list's arena
+    unsigned hash;      // hash of 'name', kept so the index can grow without rehashing strings
     struct node *next;
 } node_t;
 
+// One block of the bump allocator, chained so file_list_clear can free them all at once
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} arena_chunk_t;
+
 // Linked list definition
 typedef struct {
     node_t *head;
+    node_t *tail;       // last node, so adding doesn't have to walk the list
     int size;
+    node_t **table;     // open-addressed hash index over the distinct names in the list
+    int table_cap;      // number of slots in 'table', always a power of two
+    int table_used;     // number of occupied slots
+    arena_chunk_t *arena;
 } file_list_t;
 
 // Initialize a new, empty list
@@ -33,4 +49,4 @@ int file_list_contains(const file_list_t *list, const char *file_name);
 // Returns 1 if l1 is a subset of l2, 0 otherwise
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+// Read size for content_hash_fd
+#define HASH_BUF_SIZE (1 << 20)
+
+// XXH64 primes
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));   // little-endian hosts only, like the rest of minitar's on-disk formats
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+void content_hash_init(content_hash_t *state) {
+    memset(state, 0, sizeof(content_hash_t));
+    state->v[0] = PRIME1 + PRIME2;
+    state->v[1] = PRIME2;
+    state->v[2] = 0;
+    state->v[3] = -PRIME1;
+}
+
+static void consume_stripe(content_hash_t *state, const unsigned char *p) {
+    for (int i = 0; i < 4; i++) {
+        state->v[i] = round64(state->v[i], read64(p + 8 * i));
+    }
+}
+
+void content_hash_update(content_hash_t *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    state->total_len += len;
+
+    if (state->buf_len > 0) {   // top up a partial stripe left from last time
+        size_t n = 32 - state->buf_len < len ? 32 - state->buf_len : len;
+        memcpy(state->buf + state->buf_len, p, n);
+        state->buf_len += n;
+        p += n;
+        len -= n;
+        if (state->buf_len < 32) {
+            return;
+        }
+        consume_stripe(state, state->buf);
+        state->buf_len = 0;
+    }
+    while (len >= 32) {
+        consume_stripe(state, p);
+        p += 32;
+        len -= 32;
+    }
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+uint64_t content_hash_digest(content_hash_t *state) {
+    uint64_t h;
+    if (state->total_len >= 32) {
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge_round(h, state->v[i]);
+        }
+    } else {
+        h = state->v[2] + PRIME5;   // lane 2 starts at the seed, 0
+    }
+    h += state->total_len;
+
+    const unsigned char *p = state->buf;
+    size_t len = state->buf_len;
+    while (len >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+int content_hash_fd(int fd, off_t offset, off_t size, uint64_t *out) {
+    char *buffer = malloc(HASH_BUF_SIZE);
+    if (buffer == NULL) {
+        perror("Failed to allocate hash buffer");
+        return -1;
+    }
+    content_hash_t state;
+    content_hash_init(&state);
+    while (size > 0) {
+        size_t chunk = size > HASH_BUF_SIZE ? HASH_BUF_SIZE : size;
+        ssize_t n = pread(fd, buffer, chunk, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {   // error, or the file is shorter than expected
+            free(buffer);
+            return -1;
+        }
+        content_hash_update(&state, buffer, n);
+        offset += n;
+        size -= n;
+    }
+    free(buffer);
+    *out = content_hash_digest(&state);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef _HASH_H
+#define _HASH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Streaming state for the 64-bit content hash (XXH64), used to compare file contents
+typedef struct {
+    uint64_t total_len;
+    uint64_t v[4];          // four independent lanes, so 32-byte stripes are mixed in parallel
+    unsigned char buf[32];  // input that didn't fill a whole stripe yet
+    size_t buf_len;
+} content_hash_t;
+
+// Start a new hash
+void content_hash_init(content_hash_t *state);
+
+// Feed 'len' more bytes into the hash
+void content_hash_update(content_hash_t *state, const void *data, size_t len);
+
+// Finish the hash and return its value. 'state' must be re-initialized before reuse
+uint64_t content_hash_digest(content_hash_t *state);
+
+/*
+ * Hash 'size' bytes of 'fd' starting at 'offset', read with pread so the file
+ * position is left alone and several threads can hash from the same descriptor
+ * Returns 0 on success (hash in '*out'), -1 on error or if the file is shorter than 'size'
+ */
+int content_hash_fd(int fd, off_t offset, off_t size, uint64_t *out);
+
+#endif
@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "links.h"
+#include "minitar.h"
+
+// Initial number of slots of a map, and the fill level (in percent) at which it doubles
+#define LINK_MAP_INIT_CAP 64
+#define LINK_MAP_MAX_LOAD 70
+// Bytes of each file compared at a time before --dedupe links two of them
+#define COMPARE_BUF_SIZE (256 * 1024)
+
+void link_table_init(link_table_t *links) {
+    memset(links, 0, sizeof(link_table_t));
+}
+
+static void link_map_free(link_map_t *map) {
+    for (uint32_t i = 0; i < map->cap; i++) {
+        free(map->slots[i].target);
+    }
+    free(map->slots);
+    memset(map, 0, sizeof(link_map_t));
+}
+
+void link_table_free(link_table_t *links) {
+    link_map_free(&links->inodes);
+    link_map_free(&links->contents);
+}
+
+/*
+ * Mixes the two keys into a slot number. Inode numbers and content hashes are far from
+ * uniform in their low bits (inodes are often sequential), so the bits are stirred first
+ */
+static uint32_t slot_hash(uint64_t key1, uint64_t key2) {
+    uint64_t h = key1 * 0x9e3779b97f4a7c15ull ^ key2;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+/*
+ * Find the slot holding 'key1', 'key2', or the empty slot where it would go
+ */
+static link_slot_t *map_slot(link_slot_t *slots, uint32_t cap, uint64_t key1, uint64_t key2) {
+    uint32_t i = slot_hash(key1, key2) & (cap - 1);
+    while (slots[i].target != NULL && (slots[i].key1 != key1 || slots[i].key2 != key2)) {
+        i = (i + 1) & (cap - 1);    // linear probing
+    }
+    return &slots[i];
+}
+
+// Returns the member remembered under 'key1', 'key2', or NULL
+static const char *map_find(const link_map_t *map, uint64_t key1, uint64_t key2) {
+    return map->cap > 0 ? map_slot(map->slots, map->cap, key1, key2)->target : NULL;
+}
+
+/*
+ * Remember 'target' under 'key1', 'key2'
+ * Returns 0 on success, -1 if out of memory
+ */
+static int map_add(link_map_t *map, uint64_t key1, uint64_t key2, const char *target) {
+    if ((map->used + 1) * 100 > (uint64_t)map->cap * LINK_MAP_MAX_LOAD) {
+        uint32_t cap = map->cap ? map->cap * 2 : LINK_MAP_INIT_CAP;
+        link_slot_t *slots = calloc(cap, sizeof(link_slot_t));
+        if (slots == NULL) {
+            perror("Failed to allocate link table");
+            return -1;
+        }
+        for (uint32_t i = 0; i < map->cap; i++) {
+            if (map->slots[i].target != NULL) {
+                *map_slot(slots, cap, map->slots[i].key1, map->slots[i].key2) = map->slots[i];
+            }
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->cap = cap;
+    }
+    link_slot_t *slot = map_slot(map->slots, map->cap, key1, key2);
+    if (slot->target != NULL) {     // already there, the first member keeps it
+        return 0;
+    }
+    slot->target = strdup(target);
+    if (slot->target == NULL) {
+        perror("Failed to allocate link table");
+        return -1;
+    }
+    slot->key1 = key1;
+    slot->key2 = key2;
+    map->used++;
+    return 0;
+}
+
+/*
+ * Reads up to 'len' bytes at 'offset' of 'fd', fewer only at the end of the file
+ * Returns the number of bytes read, -1 on error
+ */
+static ssize_t read_at(int fd, char *buf, size_t len, off_t offset) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = pread(fd, buf + total, len - total, offset + total);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/*
+ * Compares the files 'a' and 'b' byte by byte over 'size' bytes. Matching hashes alone
+ * aren't proof, XXH64 collisions can be made on purpose
+ * Returns 1 if they hold the same bytes, 0 if not or if either can't be read, -1 if out of memory
+ */
+static int same_contents(const char *a, const char *b, off_t size) {
+    char *bufs = malloc(2 * COMPARE_BUF_SIZE);
+    if (bufs == NULL) {
+        perror("Failed to allocate buffer to compare files for --dedupe");
+        return -1;
+    }
+    int fd_a = open(a, O_RDONLY);
+    int fd_b = fd_a != -1 ? open(b, O_RDONLY) : -1;
+    int same = fd_b != -1;
+    for (off_t offset = 0; same && offset < size; offset += COMPARE_BUF_SIZE) {
+        size_t len = size - offset < COMPARE_BUF_SIZE ? size - offset : COMPARE_BUF_SIZE;
+        same = read_at(fd_a, bufs, len, offset) == (ssize_t)len
+               && read_at(fd_b, bufs + COMPARE_BUF_SIZE, len, offset) == (ssize_t)len
+               && memcmp(bufs, bufs + COMPARE_BUF_SIZE, len) == 0;
+    }
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    free(bufs);
+    return same;
+}
+
+int link_wants_hash(const struct stat *stat_buf) {
+    // Empty files gain nothing, a link header is as big as their own
+    return minitar_opts.dedupe && S_ISREG(stat_buf->st_mode) && stat_buf->st_size > 0;
+}
+
+int link_content_hash(int fd, const struct stat *stat_buf, uint64_t *hash) {
+    *hash = 0;
+    if (!link_wants_hash(stat_buf)) {
+        return 0;
+    }
+    if (content_hash_fd(fd, 0, stat_buf->st_size, hash) != 0) {
+        perror("Failed to hash file contents for --dedupe");
+        return -1;
+    }
+    return 0;
+}
+
+int link_member_header(link_table_t *links, member_header_t *mh, const char *name, const struct stat *stat_buf,
+                       uint64_t hash) {
+    if (!S_ISREG(stat_buf->st_mode)) {
+        return 0;
+    }
+    int shared_inode = stat_buf->st_nlink > 1;
+    int hashed = link_wants_hash(stat_buf);
+    const char *target = shared_inode ? map_find(&links->inodes, stat_buf->st_dev, stat_buf->st_ino) : NULL;
+    if (target == NULL && hashed) {
+        target = map_find(&links->contents, stat_buf->st_size, hash);
+        int same = target != NULL ? same_contents(target, name, stat_buf->st_size) : 0;
+        if (same == -1) {
+            return -1;
+        }
+        if (target != NULL && !same) {  // a collision, or the earlier file changed since: store this one in full
+            target = NULL;
+            hashed = 0;     // and leave the earlier one as the member for these contents
+        }
+    }
+    if (target != NULL) {
+        // Further links to this inode go straight to the same member, without hashing
+        if (shared_inode && map_add(&links->inodes, stat_buf->st_dev, stat_buf->st_ino, target) != 0) {
+            return -1;
+        }
+        return fill_link_member_header(mh, name, stat_buf, target) == 0 ? 1 : -1;
+    }
+    if (shared_inode && map_add(&links->inodes, stat_buf->st_dev, stat_buf->st_ino, name) != 0) {
+        return -1;
+    }
+    if (hashed && map_add(&links->contents, stat_buf->st_size, hash, name) != 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef _LINKS_H
+#define _LINKS_H
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "minitar.h"
+
+/*
+ * Hard links and duplicate contents during create, append and update. A file whose inode
+ * (st_dev, st_ino) was already written in this run, or with --dedupe a file whose size and
+ * 64-bit content hash match one already written and whose bytes then compare equal to it,
+ * is stored as a LNKTYPE member naming the earlier member instead of a second copy of its
+ * data. Member names are the paths the files were read from, so both can be reopened. Extract recreates it with link().
+ * Decisions are made in archive order by whichever thread writes the archive, so serial,
+ * -j and io_uring create still produce the same bytes.
+ */
+
+// A remembered member: either an inode or a (size, content hash) pair, and the member it went into
+typedef struct {
+    uint64_t key1;
+    uint64_t key2;
+    char *target;       // member name, NULL for an empty slot
+} link_slot_t;
+
+// Open-addressed hash table of link_slot_t
+typedef struct {
+    link_slot_t *slots;
+    uint32_t cap;       // always a power of two
+    uint32_t used;
+} link_map_t;
+
+// Everything written so far in one run that later members may link to
+typedef struct {
+    link_map_t inodes;      // files with more than one link, by (st_dev, st_ino)
+    link_map_t contents;    // with --dedupe, regular files by (size, content hash)
+} link_table_t;
+
+void link_table_init(link_table_t *links);
+
+void link_table_free(link_table_t *links);
+
+// Returns 1 if --dedupe wants the contents of the file described by 'stat_buf' hashed, 0 otherwise
+int link_wants_hash(const struct stat *stat_buf);
+
+/*
+ * With --dedupe, hash the contents of the file open at 'fd' for link_member_header,
+ * reading with pread so the file position is left alone. Otherwise '*hash' is set to 0
+ * Returns 0 on success, -1 on error
+ */
+int link_content_hash(int fd, const struct stat *stat_buf, uint64_t *hash);
+
+/*
+ * Decide how the file 'name' described by 'stat_buf' goes into the archive. If it is another
+ * link to an inode written earlier in this run, or (with --dedupe) has the same size,
+ * content 'hash' and bytes as a file written earlier, 'mh' is filled with a hard link
+ * header naming that member. Otherwise the file is remembered so later ones can link to it.
+ * Returns 1 if 'mh' was filled (free it with member_header_free), 0 if the file has to
+ * be stored in full, -1 on error
+ */
+int link_member_header(link_table_t *links, member_header_t *mh, const char *name, const struct stat *stat_buf,
+                       uint64_t hash);
+
+#endif
@@ -1,18 +1,130 @@
-﻿#include <fcntl.h>
+﻿#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#include "archive_index.h"
+#include "archive_io.h"
+#include "compress.h"
+#include "copy_engine.h"
+#include "hash.h"
+#include "links.h"
 #include "minitar.h"
+#include "parallel.h"
+#include "sparse.h"
+#include "stats.h"
+#include "stream.h"
+#include "uring.h"
+#include "walk.h"
 
-#define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 512
+#define LOOKUP_BUF_LEN 4096
+
+minitar_options_t minitar_opts = {
+    .num_threads = 1,
+    .num_threads_given = 0,
+    .verbose = 0,
+    .use_index = 0,
+    .compress = 0,
+    .hash_contents = 0,
+    .numeric_owner = 0,
+    .stats = 0,
+    .io_uring = 0,
+    .sparse = 0,
+    .dedupe = 0,
+    .occurrence = 0,
+    .sync = 0,
+    .sync_batch = 0,
+    .direct_io = 0,
+};
+
+// A uid or gid whose name has already been looked up
+typedef struct {
+    unsigned id;
+    char name[32];      // same width as the uname/gname header fields
+} owner_name_t;
+
+/*
+ * Per-run cache of id -> name lookups. Archives tend to be owned by a handful of users,
+ * and each getpwuid_r/getgrgid_r can be a round trip to LDAP or SSSD, so each id is
+ * only looked up once. The lock is held over a lookup so that threads building headers
+ * at the same time don't all miss on the same id.
+ */
+typedef struct {
+    owner_name_t *entries;
+    int count;
+    int cap;
+    pthread_mutex_t lock;
+} owner_cache_t;
+
+static owner_cache_t user_cache = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+static owner_cache_t group_cache = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Sums the 512 bytes of 'block' as unsigned values and counts in '*high_bytes' how
+ * many of them have the top bit set, i.e. would be negative as signed char.
+ * With SSE2 this is 32 sum-of-absolute-differences against zero, one per 16 bytes;
+ * other targets use the plain loop.
+ */
+static unsigned sum_block(const unsigned char *block, unsigned *high_bytes) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    unsigned high = 0;
+    for (int i = 0; i < BLOCK_SIZE; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, zero));   // two partial sums, one per 8 bytes
+        high += __builtin_popcount(_mm_movemask_epi8(bytes));  // top bit of each byte
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    *high_bytes = high;
+    return lanes[0] + lanes[1];
+#else
+    unsigned sum = 0;
+    unsigned high = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        sum += block[i];
+        high += block[i] >> 7;
+    }
+    *high_bytes = high;
+    return sum;
+#endif
+}
+
+unsigned header_checksum(const tar_header *header, int *signed_sum) {
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned high;
+    unsigned sum = sum_block(bytes, &high);
+    // Count the chksum field as all blanks, whatever it holds right now
+    size_t field = offsetof(tar_header, chksum);
+    for (size_t i = field; i < field + 8; i++) {
+        sum -= bytes[i];
+        high -= bytes[i] >> 7;
+    }
+    sum += 8 * ' ';
+    if (signed_sum != NULL) {
+        *signed_sum = (int)sum - 256 * (int)high;   // each byte >= 0x80 counts 256 less when signed
+    }
+    return sum;
+}
 
 /*
  * Helper function to compute the checksum of a tar header block
@@ -22,384 +134,2185 @@
 void compute_checksum(tar_header *header) {
     // Have to initially set header's checksum to "all blanks"
     memset(header->chksum, ' ', 8);
-    unsigned sum = 0;
-    char *bytes = (char *)header;
-    for (int i = 0; i < sizeof(tar_header); i++) {
-        sum += bytes[i];
-    }
-    snprintf(header->chksum, 8, "%07o", sum);
+    snprintf(header->chksum, 8, "%07o", header_checksum(header, NULL));
 }
 
-/*
- * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
- * Returns 0 on success or -1 if an error occurs
- */
 int fill_tar_header(tar_header *header, const char *file_name) {
-    memset(header, 0, sizeof(tar_header));
     char err_msg[MAX_MSG_LEN];
     struct stat stat_buf;
     // stat is a system call to inspect file metadata
     if (stat(file_name, &stat_buf) != 0) {
+        memset(header, 0, sizeof(tar_header));
         snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
         perror(err_msg);
         return -1;
     }
+    return fill_tar_header_from_stat(header, file_name, &stat_buf);
+}
 
-    strncpy(header->name, file_name, 100); // Name of the file, null-terminated string
-    snprintf(header->mode, 8, "%07o", stat_buf.st_mode & 07777); // Permissions for file, 0-padded octal
-
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid); // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid); // Look up name corresponding to owner ID
-    if (pwd == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
-        perror(err_msg);
-        return -1;
+/*
+ * Copies the name of user ('is_group' == 0) or group 'id' into 'name' (32 bytes),
+ * from the cache if it has been looked up before
+ * Returns 0 on success, -1 if the id has no name
+ */
+static int lookup_owner_name(unsigned id, int is_group, char *name) {
+    owner_cache_t *cache = is_group ? &group_cache : &user_cache;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < cache->count; i++) {    // only ever a few entries, a scan is fine
+        if (cache->entries[i].id == id) {
+            memcpy(name, cache->entries[i].name, 32);
+            stats_count(STAT_OWNER_HITS, 1);
+            pthread_mutex_unlock(&cache->lock);
+            return 0;
+        }
     }
-    strncpy(header->uname, pwd->pw_name, 32); // Owner  name of the file, null-terminated string
+    stats_count(STAT_OWNER_MISSES, 1);
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid); // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid); // Look up name corresponding to group ID
-    if (grp == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
-        perror(err_msg);
+    // The reentrant lookups are used so that worker threads can build headers concurrently
+    char lookup_buf[LOOKUP_BUF_LEN];
+    const char *found = NULL;
+    if (is_group) {
+        struct group grp_buf;
+        struct group *grp = NULL;
+        getgrgid_r(id, &grp_buf, lookup_buf, LOOKUP_BUF_LEN, &grp); // Look up name corresponding to group ID
+        found = grp != NULL ? grp->gr_name : NULL;
+    } else {
+        struct passwd pwd_buf;
+        struct passwd *pwd = NULL;
+        getpwuid_r(id, &pwd_buf, lookup_buf, LOOKUP_BUF_LEN, &pwd); // Look up name corresponding to owner ID
+        found = pwd != NULL ? pwd->pw_name : NULL;
+    }
+    if (found == NULL) {
+        pthread_mutex_unlock(&cache->lock);
         return -1;
     }
-    strncpy(header->gname, grp->gr_name, 32); // Group name of the file, null-terminated string
+    strncpy(name, found, 32);
 
-    snprintf(header->size, 12, "%011o", (unsigned)stat_buf.st_size); // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o", (unsigned)stat_buf.st_mtime); // Modification time, 0-padded octal
-    header->typeflag = REGTYPE; // File type, always regular file in this project
-    strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
-    memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o", major(stat_buf.st_dev)); // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o", minor(stat_buf.st_dev)); // Minor device number, 0-padded octal
-
-    compute_checksum(header);
+    if (cache->count == cache->cap) {   // not being able to remember it is no reason to fail
+        int cap = cache->cap ? cache->cap * 2 : 8;
+        owner_name_t *entries = realloc(cache->entries, cap * sizeof(owner_name_t));
+        if (entries != NULL) {
+            cache->entries = entries;
+            cache->cap = cap;
+        }
+    }
+    if (cache->count < cache->cap) {
+        cache->entries[cache->count].id = id;
+        memcpy(cache->entries[cache->count].name, name, 32);
+        cache->count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
     return 0;
 }
 
 /*
- * Removes 'nbytes' bytes from the file identified by 'file_name'
- * Returns 0 upon success, -1 upon error
- * Note: This function uses lower-level I/O syscalls (not stdio), which we'll learn about later
+ * Stores 'value' in the numeric header field 'field' of 'len' bytes: 0-padded octal if it
+ * fits in len - 1 digits, otherwise base-256 (first byte 0x80, the value big-endian in the
+ * rest) like GNU tar does. Negative values are stored as 0, only an extended header can hold them
  */
-int remove_trailing_bytes(const char *file_name, size_t nbytes) {
-    char err_msg[MAX_MSG_LEN];
-    // Note: ftruncate does not work with O_APPEND
-    int fd = open(file_name, O_WRONLY);
-    if (fd == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file_name);
-        perror(err_msg);
-        return -1;
-    }
-    //  Seek to end of file - nbytes
-    off_t current_pos = lseek(fd, -1 * nbytes, SEEK_END);
-    if (current_pos == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to seek in file %s", file_name);
-        perror(err_msg);
-        close(fd);
-        return -1;
+static void put_numeric(char *field, size_t len, int64_t value) {
+    if (value < 0) {
+        value = 0;
     }
-    // Remove all contents of file past current position
-    if (ftruncate(fd, current_pos) == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
-        perror(err_msg);
-        close(fd);
-        return -1;
+    if (((uint64_t)value >> (3 * (len - 1))) == 0) {     // fits, so len - 1 octal digits hold all of it
+        uint64_t digits = value;
+        for (size_t i = len - 1; i > 0; i--) {
+            field[i - 1] = '0' + (digits & 7);
+            digits >>= 3;
+        }
+        field[len - 1] = '\0';
+        return;
     }
-    if (close(fd) == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", file_name);
-        perror(err_msg);
-        return -1;
+    memset(field, 0, len);
+    field[0] = (char)0x80;
+    for (size_t i = len - 1; i > 0 && value > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
     }
-    return 0;
 }
 
-
-int create_archive(const char *archive_name, const file_list_t *files) {
-    node_t *current = files->head;
-    FILE *file;
-    FILE *destination = fopen(archive_name, "w");
-    if (destination == NULL) {
-        perror("Failed to open destination file in create_archive\n");
-        return -1;
+/*
+ * Stores 'file_name' in the name field, or if it is longer than 100 bytes splits it at a
+ * '/' across the prefix and name fields, as ustar allows ("prefix/name")
+ * Returns 0 if the name fit, 1 if it was cut short
+ */
+static int put_name(tar_header *header, const char *file_name) {
+    size_t len = strlen(file_name);
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, file_name, len);
+        return 0;
+    }
+    // The earliest split point leaves the most room for the name part
+    for (const char *slash = strchr(file_name, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        size_t prefix_len = slash - file_name;
+        size_t rest_len = len - prefix_len - 1;
+        if (prefix_len > sizeof(header->prefix)) {
+            break;
+        }
+        if (rest_len > 0 && rest_len <= sizeof(header->name)) {
+            memcpy(header->prefix, file_name, prefix_len);
+            memcpy(header->name, slash + 1, rest_len);
+            return 0;
+        }
     }
+    memcpy(header->name, file_name, sizeof(header->name));
+    return 1;
+}
 
-    char buffer[512]; 
-    tar_header hed;
+int fill_tar_header_from_stat(tar_header *header, const char *file_name, const struct stat *stat_buf) {
+    memset(header, 0, sizeof(tar_header));
+    char err_msg[MAX_MSG_LEN];
 
-    while (current != NULL) { //this loop goes through every file
-        memset(buffer, 0, 512*sizeof(buffer[0]));
-        file = fopen(current->name, "r");   // open the current file
-        if (file == NULL) {
-            perror("Failed to open file from current->name in create_archive\n");
-            return -1;
-        }
+    put_name(header, file_name); // Name of the file, split across prefix and name if it's long
+    snprintf(header->mode, 8, "%07o", stat_buf->st_mode & 07777); // Permissions for file, 0-padded octal
 
-        if (fill_tar_header(&hed, current->name) != 0) {    //make the header for the current file
-            perror("Failed to fill the tar header in function create_archive\n");
+    put_numeric(header->uid, 8, stat_buf->st_uid); // Owner ID of the file, 0-padded octal
+    put_numeric(header->gid, 8, stat_buf->st_gid); // Group ID of the file, 0-padded octal
+    if (!minitar_opts.numeric_owner) {  // with --numeric-owner the name fields stay empty
+        if (lookup_owner_name(stat_buf->st_uid, 0, header->uname) != 0) { // Owner name of the file, null-terminated string
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
+            perror(err_msg);
             return -1;
         }
-        if (fwrite(&hed, sizeof(char), 512, destination) != 512) {       //write the header for the current file in archive
-            perror("Failed to write the header into archive in function create_archive\n");
+        if (lookup_owner_name(stat_buf->st_gid, 1, header->gname) != 0) { // Group name of the file, null-terminated string
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
+            perror(err_msg);
             return -1;
         }
+    }
+
+    int is_dir = S_ISDIR(stat_buf->st_mode);
+    put_numeric(header->size, 12, is_dir ? 0 : stat_buf->st_size); // File size, 0-padded octal (base-256 from 8 GiB), directories have no data
+    put_numeric(header->mtime, 12, stat_buf->st_mtime); // Modification time, 0-padded octal
+    header->typeflag = is_dir ? DIRTYPE : REGTYPE; // File type, only directories and regular files are archived
+    strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
+    memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
+    snprintf(header->devmajor, 8, "%07o", major(stat_buf->st_dev)); // Major device number, 0-padded octal
+    snprintf(header->devminor, 8, "%07o", minor(stat_buf->st_dev)); // Minor device number, 0-padded octal
 
+    compute_checksum(header);
+    return 0;
+}
 
-        while (fread(buffer, sizeof(char), 512, file) > 0) {     // loop through contents of file and add them to archive                                    
-                   
-            if (fwrite(buffer, sizeof(char), 512, destination) != 512) {
-                perror("Failed to write the buffer into archive in function create_archive\n");
-                return -1;
-            }
-            memset(buffer, 0, 512*sizeof(buffer[0]));   //buffer block is set to all 0's each iteration
-        }
-        if (ferror(file)) {
-            perror("Failure in reading the file in create archive");
+/*
+ * Appends the PAX record "<len> <key>=<value>\n" to '*records', growing it as needed.
+ * The length counts the whole record, its own digits included
+ * Returns 0 on success, -1 if out of memory
+ */
+static int add_pax_record(char **records, size_t *len, size_t *cap, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;  // ' ', '=' and '\n'
+    size_t record_len = body + 1;
+    while (record_len < body + snprintf(NULL, 0, "%zu", record_len)) {
+        record_len++;
+    }
+    if (*len + record_len + 1 > *cap) {
+        size_t new_cap = (*len + record_len + 1) * 2;
+        char *bigger = realloc(*records, new_cap);
+        if (bigger == NULL) {
             return -1;
         }
+        *records = bigger;
+        *cap = new_cap;
+    }
+    *len += snprintf(*records + *len, *cap - *len, "%zu %s=%s\n", record_len, key, value);
+    return 0;
+}
 
-        fclose(file);           //close the current file
+/*
+ * Name the ustar header of a sparse member gets, "DIR/GNUSparseFile.0/BASE" like GNU tar's
+ * default (with 0 for the process id, so archives stay reproducible). Readers that don't
+ * know the format extract the raw member data under that name instead of clobbering the file.
+ * Returns a new string, or NULL if out of memory
+ */
+static char *sparse_member_name(const char *file_name) {
+    const char *base = strrchr(file_name, '/');
+    int dir_len = base != NULL ? (int)(base - file_name) : 0;
+    base = base != NULL ? base + 1 : file_name;
+    size_t len = strlen(file_name) + sizeof("/GNUSparseFile.0/");
+    char *name = malloc(len);
+    if (name == NULL) {
+        perror("Failed to allocate sparse member name");
+        return NULL;
+    }
+    if (dir_len > 0) {
+        snprintf(name, len, "%.*s/GNUSparseFile.0/%s", dir_len, file_name, base);
+    } else {
+        snprintf(name, len, "GNUSparseFile.0/%s", base);
+    }
+    return name;
+}
 
-        current = current->next;//go to next file
+/*
+ * Builds the header blocks of fill_member_header, of fill_sparse_member_header if 'sparse'
+ * isn't NULL, or of fill_link_member_header if 'link_target' isn't NULL
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int build_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf,
+                               const sparse_map_t *sparse, const char *link_target) {
+    mh->pax = NULL;
+    mh->pax_len = 0;
+    const char *header_file_name = file_name;
+    char *sparse_name = NULL;
+    struct stat stored_stat = *stat_buf;
+    if (sparse != NULL) {   // the header describes the stored map and extents, the records the real file
+        sparse_name = sparse_member_name(file_name);
+        if (sparse_name == NULL) {
+            return -1;
+        }
+        header_file_name = sparse_name;
+        stored_stat.st_size = sparse_member_size(sparse);
+    }
+    if (link_target != NULL) {  // the data is all in the member it links to
+        stored_stat.st_size = 0;
+    }
+    if (fill_tar_header_from_stat(&mh->header, header_file_name, &stored_stat) != 0) {
+        free(sparse_name);
+        return -1;
+    }
+    if (link_target != NULL) {
+        mh->header.typeflag = LNKTYPE;
+        memcpy(mh->header.linkname, link_target, strnlen(link_target, sizeof(mh->header.linkname)));
+        compute_checksum(&mh->header);
     }
 
-    //next lines of code add footer
-    memset(buffer, 0, 512*sizeof(buffer[0]));
-    if (fwrite(buffer, sizeof(char), 512, destination) != 512) {
-        perror("Failed to write the footer at the end of archive in function create_archive\n");
+    // Records for whatever the ustar header couldn't hold
+    char *records = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char value[32];
+    int ret = 0;
+    char stored_name[USTAR_NAME_MAX + 1];
+    header_name(&mh->header, stored_name);
+    if (strcmp(stored_name, header_file_name) != 0) {
+        ret |= add_pax_record(&records, &len, &cap, "path", header_file_name);
+    }
+    if (link_target != NULL && strlen(link_target) > sizeof(mh->header.linkname)) {
+        ret |= add_pax_record(&records, &len, &cap, "linkpath", link_target);
+    }
+    if (!S_ISDIR(stored_stat.st_mode) && stored_stat.st_size > USTAR_MAX_OCTAL_11) {
+        snprintf(value, sizeof(value), "%lld", (long long)stored_stat.st_size);
+        ret |= add_pax_record(&records, &len, &cap, "size", value);
+    }
+    if (sparse != NULL) {
+        ret |= add_pax_record(&records, &len, &cap, "GNU.sparse.major", "1");
+        ret |= add_pax_record(&records, &len, &cap, "GNU.sparse.minor", "0");
+        ret |= add_pax_record(&records, &len, &cap, "GNU.sparse.name", file_name);
+        snprintf(value, sizeof(value), "%lld", (long long)sparse->real_size);
+        ret |= add_pax_record(&records, &len, &cap, "GNU.sparse.realsize", value);
+    }
+    free(sparse_name);
+    if (stat_buf->st_mtime < 0 || stat_buf->st_mtime > USTAR_MAX_OCTAL_11) {
+        snprintf(value, sizeof(value), "%lld", (long long)stat_buf->st_mtime);
+        ret |= add_pax_record(&records, &len, &cap, "mtime", value);
+    }
+    if (stat_buf->st_uid > USTAR_MAX_OCTAL_7) {
+        snprintf(value, sizeof(value), "%u", (unsigned)stat_buf->st_uid);
+        ret |= add_pax_record(&records, &len, &cap, "uid", value);
+    }
+    if (stat_buf->st_gid > USTAR_MAX_OCTAL_7) {
+        snprintf(value, sizeof(value), "%u", (unsigned)stat_buf->st_gid);
+        ret |= add_pax_record(&records, &len, &cap, "gid", value);
+    }
+    if (ret != 0) {
+        perror("Failed to allocate extended header");
+        free(records);
         return -1;
     }
-    if (fwrite(buffer, sizeof(char), 512, destination) != 512) {
-        perror("Failed to write the footer at the end of archive in function create_archive\n");
+    if (len == 0) {     // the common case, plain ustar is enough
+        return 0;
+    }
+
+    size_t padded = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    mh->pax = calloc(1, BLOCK_SIZE + padded);
+    if (mh->pax == NULL) {
+        perror("Failed to allocate extended header");
+        free(records);
         return -1;
     }
-    fclose(destination);
+    mh->pax_len = BLOCK_SIZE + padded;
+
+    // The extended header is a member of its own, named after the file it describes
+    tar_header *xhdr = (tar_header *)mh->pax;
+    size_t base_end = strlen(file_name);
+    if (base_end > 1 && file_name[base_end - 1] == '/') {
+        base_end--;
+    }
+    const char *base = file_name + base_end;
+    while (base > file_name && base[-1] != '/') {
+        base--;
+    }
+    snprintf(xhdr->name, sizeof(xhdr->name), "PaxHeaders/%.*s", (int)(file_name + base_end - base), base);
+    snprintf(xhdr->mode, 8, "%07o", 0644);
+    memcpy(xhdr->uid, mh->header.uid, 8);
+    memcpy(xhdr->gid, mh->header.gid, 8);
+    put_numeric(xhdr->size, 12, len);
+    memcpy(xhdr->mtime, mh->header.mtime, 12);
+    xhdr->typeflag = XHDTYPE;
+    strncpy(xhdr->magic, MAGIC, 6);
+    memcpy(xhdr->version, "00", 2);
+    compute_checksum(xhdr);
+    memcpy(mh->pax + BLOCK_SIZE, records, len);
+    free(records);
     return 0;
 }
 
+int fill_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf) {
+    return build_member_header(mh, file_name, stat_buf, NULL, NULL);
+}
+
+int fill_sparse_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf,
+                              const sparse_map_t *sparse) {
+    return build_member_header(mh, file_name, stat_buf, sparse, NULL);
+}
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
-    if (remove_trailing_bytes(archive_name, 1024) != 0) {   // remove the footer of the archive
-        perror("Failed to remove trailing bytes\n");
+int fill_link_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf,
+                            const char *target) {
+    return build_member_header(mh, file_name, stat_buf, NULL, target);
+}
+
+int fill_member_header_fd(member_header_t *mh, const char *file_name, int fd, const struct stat *stat_buf,
+                          sparse_map_t *sparse) {
+    sparse_map_init(sparse);
+    int has_holes = minitar_opts.sparse ? sparse_map_build(fd, stat_buf, sparse) : 0;
+    if (has_holes == -1) {
         return -1;
     }
-    node_t *current = files->head;
-    FILE *file;
-    FILE *destination = fopen(archive_name, "r+");     // open archive in "r+" so it doesn't overwrite
-    if (destination == NULL) {
-        perror("Failed to open destination file in append\n");
+    if (has_holes && fill_sparse_member_header(mh, file_name, stat_buf, sparse) != 0) {
+        sparse_map_free(sparse);
         return -1;
     }
-    tar_header hed;
-    char buffer[512]; 
-    //int elements_read = 0;
-    memset(buffer, 0, 512*sizeof(buffer[0]));   //make buffer a block of zeros
-    fseek(destination, 0, SEEK_END);            //go to the end of the current archive
+    return has_holes ? 0 : fill_member_header(mh, file_name, stat_buf);
+}
 
-    while (current != NULL) {   // loop through files until there's no more files to append
-        memset(buffer, 0, 512*sizeof(buffer[0]));
-        file = fopen(current->name, "r");
-        if (file == NULL) {
-            perror("Failed to open file from current->name in function append\n");
-            return -1;
-        }
-        
-        if (fill_tar_header(&hed, current->name) != 0) {    //fill the header
-            return -1;
-        }
-        if (fwrite(&hed, sizeof(char), 512, destination) != 512) {       //write header to the archive
-            perror("Failed to write the header into archive in function append\n");
-            return -1;
-        }       
+void member_header_free(member_header_t *mh) {
+    free(mh->pax);
+    mh->pax = NULL;
+    mh->pax_len = 0;
+}
 
-        while (fread(buffer, sizeof(char), 512, file) > 0) {     // loop through file contents and write them as blocks to archive
-            if (fwrite(buffer, sizeof(char), 512, destination) != 512) {
-                perror("Failed to write the buffer into archive in function append\n");
-                return -1;
-            }
-        }
-        if (ferror(file)) {
-            perror("failure in reading the file in function append");
-            return -1;
+int write_member_header(int fd, const member_header_t *mh) {
+    if (mh->pax != NULL && write_all(fd, mh->pax, mh->pax_len) != 0) {
+        return -1;
+    }
+    return write_all(fd, &mh->header, BLOCK_SIZE);
+}
+
+
+/*
+ * Writes every member of 'files' and the footer to the archive open at 'destination',
+ * reading the member files on a worker pool when -j asked for more than one thread
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_archive(int destination, const file_list_t *files) {
+    archive_sink_t sink;
+    archive_sink_fd(&sink, destination);
+    archive_writer_t writer;
+    archive_writer_init(&writer, &sink);
+    // io_uring batches take precedence over -j, they get their queue depth from a single thread
+    // (1 means it isn't available and nothing was written). Both share the writer's link decisions.
+    int status = minitar_opts.io_uring ? write_members_uring(destination, files, &writer.links) : 1;
+    if (status == 1 && minitar_opts.num_threads > 1) {    // hand off to the worker pool, output is the same as the serial path
+        status = write_members_parallel(destination, files, minitar_opts.num_threads, &writer.links);
+    } else if (status == 1) {
+        status = 0;
+        node_t *current = files->head;
+        while (current != NULL && status == 0) { //this loop goes through every file
+            status = archive_writer_add_file(&writer, current->name);
+            current = current->next;//go to next file
         }
-        fclose(file);           // close the current file
+    }
+    if (status == 0) {
+        status = archive_writer_finish(&writer);     //add footer
+    }
+    archive_writer_free(&writer);
+    return status == 0 ? 0 : -1;
+}
 
-        current = current->next;// go to next file
+// Arguments for the thread that compresses the tar stream coming out of a pipe
+typedef struct {
+    int src_fd;
+    int dst_fd;
+    int status;
+} compress_job_t;
+
+static void *compress_thread(void *arg) {
+    compress_job_t *job = arg;
+    job->status = mtz_compress_stream(job->src_fd, job->dst_fd, mtz_default_threads());
+    return NULL;
+}
+
+/*
+ * Same as write_archive, but the tar stream goes through a pipe to a compressor thread
+ * that deflates it in chunks on a thread pool and writes the result to 'destination'
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_compressed_archive(int destination, const file_list_t *files) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("Failed to create pipe in create_archive\n");
+        return -1;
     }
-    //next lines of code add footer
-    memset(buffer, 0, 512*sizeof(buffer[0]));
-    if (fwrite(buffer, sizeof(char), 512, destination) != 512) {
-        perror("Failed to write the footer at the end of archive in function append\n");
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, 1 << 20);  // fewer wakeups, best effort
+
+    compress_job_t job = {pipe_fds[0], destination, 0};
+    pthread_t compressor;
+    if (pthread_create(&compressor, NULL, compress_thread, &job) != 0) {
+        perror("Failed to start compressor in create_archive\n");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    int ret = write_archive(pipe_fds[1], files);
+    close(pipe_fds[1]);     // EOF for the compressor
+    pthread_join(compressor, NULL);
+    close(pipe_fds[0]);
+    return ret == 0 && job.status == 0 ? 0 : -1;
+}
+
+
+/*
+ * Takes over stdout for an archive written there: the archive goes to a duplicate of the
+ * descriptor, and stdout itself is pointed at stderr so no message ends up in the tar stream
+ * Returns the descriptor to write the archive to, or -1 upon error
+ */
+static int open_stdout_archive(void) {
+    if (isatty(STDOUT_FILENO)) {
+        printf("Error: refusing to write an archive to a terminal\n");
         return -1;
     }
-    if (fwrite(buffer, sizeof(char), 512, destination) != 512) {
-        perror("Failed to write the footer at the end of archive in function append\n");
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        perror("Failed to redirect stdout in create_archive\n");
+        if (fd != -1) {
+            close(fd);
+        }
         return -1;
     }
-    fclose(destination);
-    return 0;
+    if (minitar_opts.use_index) {
+        printf("Error: --index needs an archive file, not stdout\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
-    if (remove_trailing_bytes(archive_name, 1024) != 0) {   // remove the footer of the archive
-        perror("Failed to remove trailing bytes\n");
+int create_archive(const char *archive_name, const file_list_t *files) {
+    int to_stdout = strcmp(archive_name, STDIO_ARCHIVE) == 0;
+    int stdout_fd = to_stdout ? open_stdout_archive() : -1;
+    if (to_stdout && stdout_fd == -1) {
+        return -1;
+    }
+    // Directories are walked before the archive is touched, so a bad path doesn't clobber it
+    file_list_t members;
+    file_list_init(&members);
+    uint64_t start = stats_phase_begin();
+    if (expand_paths(files, &members, minitar_opts.num_threads) != 0) {
+        file_list_clear(&members);
+        if (to_stdout) {
+            close(stdout_fd);
+        }
+        return -1;
+    }
+    stats_phase_end(PHASE_SCAN, start);
+    int archive_fd = to_stdout ? stdout_fd : open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    // On stdout the tar stream is double-buffered, so reading member files overlaps with the reader draining the pipe.
+    // --direct goes through the same buffers, which are what O_DIRECT writes out to the archive file.
+    stream_writer_t writer;
+    int destination = archive_fd;
+    if (archive_fd != -1 && to_stdout) {
+        destination = stream_writer_start(&writer, archive_fd);
+    } else if (archive_fd != -1 && minitar_opts.direct_io) {
+        destination = stream_writer_start_direct(&writer, archive_fd);
+    }
+    if (destination == -1) {
+        perror("Failed to open destination file in create_archive\n");
+        file_list_clear(&members);
+        if (archive_fd != -1) {
+            close(archive_fd);
+        }
         return -1;
-    } 
+    }
+    int ret;
+    if (minitar_opts.compress) {
+        ret = write_compressed_archive(destination, &members);
+    } else {
+        ret = write_archive(destination, &members);
+    }
+    file_list_clear(&members);
+    if (destination != archive_fd && stream_writer_finish(&writer) != 0) {
+        ret = -1;
+    }
+    if (to_stdout) {
+        if (close(stdout_fd) != 0 && ret == 0) {
+            perror("Failed to close stdout in function create_archive\n");
+            ret = -1;
+        }
+        return ret;
+    }
+    if (close(archive_fd) != 0 && ret == 0) {
+        perror("Failed to close archive in function create_archive\n");
+        ret = -1;
+    }
+    if (ret != 0 || !minitar_opts.use_index) {
+        return ret;
+    }
+
+    // The headers we just wrote are still in the page cache, so scanning them is cheap
+    start = stats_phase_begin();
+    archive_index_t index;
+    archive_index_init(&index);
+    if (archive_index_scan(archive_name, &index) != 0 || archive_index_write(archive_name, &index) != 0) {
+        perror("Failed to write index in create_archive\n");
+        ret = -1;
+    }
+    archive_index_free(&index);
+    stats_phase_end(PHASE_FOOTER, start);
+    return ret;
+}
+
 
-    FILE *file = fopen(archive_name, "r+");  // then open the archive
-    if (file == NULL) {
-        perror("Failed to open archive file in file_list\n");
+/*
+ * Returns 1 if 'archive_name' is a compressed (-z) archive, 0 if it is a plain one, -1 on error
+ */
+static int archive_is_compressed(const char *archive_name) {
+    int fd = open(archive_name, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open archive\n");
         return -1;
     }
+    mtz_reader_t reader;
+    int status = mtz_open(fd, &reader);
+    mtz_close(&reader);
+    close(fd);
+    return status;
+}
 
-    char buffer[512]; 
-    char file_size_o[12];   //octal
-    int file_size_d = 0;    //decimal
-    int num_blocks = 0;     //number of blocks in the body of the file, header not included
 
-    memset(file_size_o, 0, 12*sizeof(file_size_o[0]));  //fill octal number placeholder with 0's
-    tar_header hed;
+/*
+ * Sink for append. The first two blocks written after each commit are held back instead of
+ * going over the end-of-archive marker at 'start', see commit_append; everything else goes
+ * straight to the archive after them. Until both are held, member data has to come through
+ * here as well, see append_sink_fd.
+ */
+typedef struct {
+    int fd;
+    off_t start;                    // where the archive ends until the next commit
+    char first[2 * BLOCK_SIZE];     // the blocks that will replace the marker at 'start'
+    size_t held;                    // bytes of 'first' written so far
+} append_sink_t;
 
-    while (fread(&hed, sizeof(char), 512, file) > 0) {  // loop through all files, first by reading each header
-        if (file_list_add(files, (hed.name)) != 0) {    // get name from header and add to file list
-            perror("Failed to add file to files list\n");
+static int append_write(void *ctx, const void *buf, size_t len) {
+    append_sink_t *append = ctx;
+    if (append->held < sizeof(append->first)) {
+        size_t n = sizeof(append->first) - append->held < len ? sizeof(append->first) - append->held : len;
+        memcpy(append->first + append->held, buf, n);
+        append->held += n;
+        if (lseek(append->fd, n, SEEK_CUR) == -1) {
+            perror("Failed to seek in archive in append\n");
             return -1;
         }
-        
-        strcpy(file_size_o, hed.size);                  //get current size of file in octal number
-        sscanf(file_size_o, "%011o", &file_size_d);     //converts octal  to decimal 
-        memset(file_size_o, 0, 12*sizeof(file_size_o[0]));  //need to set file_size_o to 0 again, otherwise code fails
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return len > 0 ? write_all(append->fd, buf, len) : 0;
+}
 
-        num_blocks = file_size_d / 512; //gets number of blocks for current file
-        if (file_size_d % 512 > 0) {    //if there are between 1 and 511 bytes left, count it as another block
-            num_blocks++;               // NOTE: using ceiling made code break previously
-        }
-        fseek(file, 512*num_blocks, SEEK_CUR);  //skip to the next header in the archive, using calculations described above
+// Descriptor the writer may copy member data into, -1 while the copy engine would write over the marker
+static int append_sink_fd(const append_sink_t *append) {
+    return append->held < sizeof(append->first) ? -1 : append->fd;
+}
+
+/*
+ * Makes the members written since the last commit part of the archive: a footer goes after
+ * them, with --sync it all goes to disk, and only then do the held back blocks replace the
+ * old end-of-archive marker. Up to that write the archive still ends where it did, so a
+ * crash at any point leaves either the old archive or the new one whole.
+ * With 'more' set, the next members are written over the footer just added.
+ * Returns 0 on success, -1 on error
+ */
+static int commit_append(archive_writer_t *writer, append_sink_t *append, int more) {
+    off_t footer = lseek(append->fd, 0, SEEK_CUR);
+    if (footer == -1 || archive_writer_finish(writer) != 0) {
+        return -1;
     }
-    if (ferror(file)) {
-        perror("failure in reading the header in file list");
+    uint64_t start = stats_phase_begin();
+    // One flush covers every member of the batch, and the marker block of the commit before it
+    if (minitar_opts.sync && fdatasync(append->fd) != 0) {
+        perror("Failed to sync archive in append\n");
         return -1;
     }
-    // next lines of code add footer to archive
-    memset(buffer, 0, 512*sizeof(buffer[0]));
-    if (fwrite(buffer, sizeof(char), 512, file) != 512) {
-        perror("Failed to write the footer at the end of archive in function list archive\n");
+    if (pwrite(append->fd, append->first, sizeof(append->first), append->start) != (ssize_t)sizeof(append->first)) {
+        perror("Failed to write first header in append\n");
         return -1;
     }
-    if (fwrite(buffer, sizeof(char), 512, file) != 512) {
-        perror("Failed to write the footer at the end of archive in function list archive\n");
+    if (!more && minitar_opts.sync && fdatasync(append->fd) != 0) {
+        perror("Failed to sync archive in append\n");
+        return -1;
+    }
+    stats_phase_end(PHASE_FOOTER, start);
+    append->start = footer;
+    append->held = 0;
+    if (more && lseek(append->fd, footer, SEEK_SET) == -1) {
+        perror("Failed to seek in archive in append\n");
         return -1;
     }
-    fclose(file);
-
     return 0;
 }
 
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    int compressed = archive_is_compressed(archive_name);
+    if (compressed != 0) {
+        if (compressed == 1) {
+            printf("Error: cannot append to compressed archive %s\n", archive_name);
+        }
+        return -1;
+    }
 
-int extract_files_from_archive(const char *archive_name) {
-    if (remove_trailing_bytes(archive_name, 1024) != 0) {   // remove the footer of the archive
-        perror("Failed to remove trailing bytes\n");
-        return -1;
-    } 
-    
-    FILE *file;
-    FILE *archive_file = fopen(archive_name, "r+");     // open archive in "r+" mode, since we removed footer before opening it, we need to add footer again
-    if (archive_file == NULL) {
-        perror("Failed to open archive file in file extract function\n");
+    file_list_t members;
+    file_list_init(&members);
+    uint64_t start = stats_phase_begin();
+    if (expand_paths(files, &members, minitar_opts.num_threads) != 0) {
+        file_list_clear(&members);
         return -1;
     }
 
-    int blocks_to_read = 0;
-    int file_size_d = 0;    //decimal
-    char file_size_o[12];   //octal
-    char buffer[512];       // buffer will hold a block of 512 bytes
-    char mini_buf[1];       // mini_buf will hold only one byte. This will be used to store the remaining bytes
-    int n = 0;              // n will keep track of number of bytes to get to the next block of 512
-    int remainder_bytes = 0;// keep count of the trailing bytes of a file, will be smaller than 512
-    memset(buffer, 0, 512);
+    // The new members go where the last one ends, found from the sidecar or by walking the headers.
+    // That is not always the last 1024 bytes: GNU tar pads archives out to whole records.
+    archive_index_t index;
+    int have_sidecar = 0;
+    int status = archive_index_open(archive_name, &index, minitar_opts.use_index);
+    if (status == 0) {
+        have_sidecar = 1;
+    } else if (status == 1) {
+        status = archive_index_scan(archive_name, &index);
+    }
+    stats_phase_end(PHASE_SCAN, start);
+    if (status != 0) {
+        archive_index_free(&index);
+        file_list_clear(&members);
+        return -1;
+    }
 
-    tar_header hed;
+    int destination = open(archive_name, O_WRONLY);     // no O_TRUNC so it doesn't overwrite
+    if (destination == -1) {
+        perror("Failed to open destination file in append\n");
+        archive_index_free(&index);
+        file_list_clear(&members);
+        return -1;
+    }
+    int ret = 0;
+    off_t old_size = lseek(destination, 0, SEEK_END);
+    if (old_size == -1 || lseek(destination, index.end_offset, SEEK_SET) == -1) {
+        perror("Failed to seek to end of archive in append\n");
+        old_size = -1;
+        ret = -1;
+    }
 
-    while (fread(&hed, sizeof(char), 512, archive_file) > 0) {
-        file = fopen((hed.name), "w");  //make a new file with the name we get from the header block in the archive
-        if (file == NULL) {
-            perror("Failed to open file from hed.name in file extract function\n");
-            return -1;
+    // Members are written after the old end-of-archive marker, which stays in place until a commit
+    append_sink_t append = {.fd = destination, .start = index.end_offset, .held = 0};
+    archive_sink_t sink = {append_write, &append, destination};
+    archive_writer_t writer;    // links only go to members added by this append
+    archive_writer_init(&writer, &sink);
+    int batch = 0;
+    node_t *current = members.head;
+    while (ret == 0 && current != NULL) {   // loop through files until there's no more files to append
+        writer.sink.fd = append_sink_fd(&append);
+        if (archive_writer_add_file(&writer, current->name) != 0) {
+            ret = -1;
+        } else if (++batch == minitar_opts.sync_batch && current->next != NULL) {   // group commit
+            ret = commit_append(&writer, &append, 1);
+            batch = 0;
+        }
+        current = current->next;// go to next file
+    }
+    if (ret == 0) {
+        ret = commit_append(&writer, &append, 0);
+    } else if (old_size != -1) {
+        // The failed batch never touched the marker, only what it wrote after it has to go
+        off_t old_end = append.start + 2 * BLOCK_SIZE;
+        if (ftruncate(destination, old_end > old_size ? old_end : old_size) != 0) {
+            perror("Failed to restore end of archive in append\n");
         }
+    }
+    archive_writer_free(&writer);
+    file_list_clear(&members);
 
-        strcpy(file_size_o, (hed.size));
-        sscanf(file_size_o, "%011o", &file_size_d);     //convert octal to decimal
-        memset(file_size_o, 0, 12);  //fill file_size_o with 0's, otherwise code fails
-
-        blocks_to_read = file_size_d / 512; //gets number of blocks for current file
-        if (file_size_d % 512 > 0) {        //if there are between 1 and 511 bytes left, count it as another block
-            blocks_to_read++;
-        }
-        remainder_bytes = file_size_d % 512;   
-        n = 512 - remainder_bytes;        
-
-        while (blocks_to_read != 0) {   //loop through contents of the file in the archive, block by block
-            if (blocks_to_read == 1) {  // if this will be the last block in the file
-                while (remainder_bytes != 0) {  //read and write one byte at a time until finished writing all the remainder bytes
-                    if (fread(mini_buf, sizeof(char), 1, archive_file) > 0) {
-                        if (fwrite(mini_buf, sizeof(char), 1, file) != 1) {
-                            perror("Failed to write one of the remainder bytes in function extract\n");
-                            return -1;
-                        }
-                    }
-                    if (ferror(archive_file)) {
-                        perror("failure in reading the last block of the file from archive in function extract (Part 2)\n");
-                        return -1;
-                    }
-                    remainder_bytes--;
-                    memset(mini_buf, 0, 1);
-                }
-                fseek(archive_file, n, SEEK_CUR);   // after finishing writing all the bytes, skip to the next header 
-                fclose(file);                                           // (skips 0's between current file and next header)
-                
-                break;  // logic of the while loop on line 344 is that if (blocks_to_read != 1), then read and write a block of 512 bytes
-                        // so this break statement breaks the loop so a 512 block does not get read and written in an unopened file 
-                        // before the blocks_to_read counter becomes 0
-            }
-            
-            if (fread(buffer, sizeof(char), 512, archive_file) > 0) { // read from archive
-                if (fwrite(buffer, sizeof(char), 512, file) != 512) { // write to file
-                    perror("Failed to write the buffer into file in function extract file\n");
-                    return -1;
-                } 
-            }
-            if (ferror(archive_file)) {
-                perror("failure in reading the file in function extract (Part 3)\n");
-                return -1;
-            }
-                  
-            memset(buffer, 0, 512);       // reset the buffer with 0's
-            blocks_to_read--;
+    start = stats_phase_begin();
+    if (close(destination) != 0 && ret == 0) {
+        perror("Failed to close archive in function append\n");
+        ret = -1;
+    }
+
+    // Bring the index up to date with the members we just added
+    if (ret == 0 && have_sidecar
+        && (archive_index_scan(archive_name, &index) != 0 || archive_index_write(archive_name, &index) != 0)) {
+        perror("Failed to update index in append\n");
+        ret = -1;
+    }
+    archive_index_free(&index);
+    stats_phase_end(PHASE_FOOTER, start);
+    return ret;
+}
+
+
+int is_zero_block(const void *block) {
+    const unsigned long *words = block;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(unsigned long); i++) {
+        if (words[i] != 0) {
+            return 0;
         }
-        
-        n = 0;                  // set all variables to 0 just to be safe 
-        remainder_bytes = 0;
-        file_size_d = 0;
-        blocks_to_read = 0;
     }
-    if (ferror(file)) {
-        perror("failure in reading the header in function extract (Part 1)\n");
+    return 1;
+}
+
+off_t parse_octal(const char *field, size_t len) {
+    off_t value = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {    // some writers pad with leading spaces
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+int64_t parse_numeric(const char *field, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)field;
+    if ((bytes[0] & 0x80) == 0) {
+        return parse_octal(field, len);
+    }
+    if (bytes[0] & 0x40) {  // negative base-256, only ever seen for pre-1970 mtimes
         return -1;
     }
+    uint64_t value = bytes[0] & 0x3f;
+    for (size_t i = 1; i < len; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value > INT64_MAX ? -1 : (int64_t)value;
+}
+
+void header_name(const tar_header *hed, char name[USTAR_NAME_MAX + 1]) {
+    size_t len = 0;
+    // Only POSIX ustar headers have a prefix, GNU tar keeps other things in that space
+    if (memcmp(hed->magic, MAGIC, sizeof(hed->magic)) == 0 && hed->prefix[0] != '\0') {
+        len = strnlen(hed->prefix, sizeof(hed->prefix));
+        memcpy(name, hed->prefix, len);
+        name[len++] = '/';
+    }
+    size_t name_len = strnlen(hed->name, sizeof(hed->name));
+    memcpy(name + len, hed->name, name_len);
+    name[len + name_len] = '\0';
+}
+
+ssize_t fd_pread(void *ctx, void *buf, size_t len, off_t offset) {
+    return pread(*(int *)ctx, buf, len, offset);
+}
 
-    //the following code just adds the footer back to the archive
-    memset(buffer, 0, 512);
-    if (fwrite(buffer, sizeof(char), 512, archive_file) != 512) {
-        perror("Failed to write the footer at the end of archive in function extract\n");
+int read_header_at(int fd, off_t offset, tar_header *hed) {
+    return read_header_from(fd_pread, &fd, offset, hed);
+}
+
+int read_header_from(archive_pread_fn read_fn, void *ctx, off_t offset, tar_header *hed) {
+    ssize_t n = read_fn(ctx, hed, BLOCK_SIZE, offset);
+    if (n == -1) {
+        perror("Failed to read header from archive");
         return -1;
     }
-    if (fwrite(buffer, sizeof(char), 512, archive_file) != 512) {
-        perror("Failed to write the footer at the end of archive in function extract\n");
+    if (n == 0) {
+        return 0;
+    }
+    if (n != BLOCK_SIZE) {
+        printf("Error: archive ends in the middle of a header\n");
         return -1;
     }
-    fclose(archive_file);
-    return 0;
-}
\ No newline at end of file
+    return is_zero_block(hed) ? 0 : 1;
+}
+
+off_t next_header_offset(off_t offset, off_t file_size) {
+    return offset + BLOCK_SIZE + (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+void archive_member_init(archive_member_t *member) {
+    memset(member, 0, sizeof(archive_member_t));
+}
+
+void archive_member_free(archive_member_t *member) {
+    free(member->name);
+    free(member->linkname);
+    member->name = NULL;
+    member->linkname = NULL;
+}
+
+// What the PAX records in front of a member said, for the keys minitar uses
+typedef struct {
+    char *name;             // path, or a long GNU name
+    char *linkname;         // linkpath, or a long GNU link target
+    char *sparse_name;      // GNU.sparse.name, the real name of a sparse member
+    off_t size;             // -1 if not given
+    int64_t mtime;
+    int has_mtime;
+    off_t sparse_realsize;  // GNU.sparse.realsize, -1 if not given
+    int sparse_major;       // GNU.sparse.major, 0 if not given
+} pax_values_t;
+
+static void pax_values_free(pax_values_t *values) {
+    free(values->name);
+    free(values->linkname);
+    free(values->sparse_name);
+}
+
+/*
+ * Replaces the string '*field' with a copy of the 'len' bytes at 'value'
+ * Returns 0 on success, -1 if out of memory
+ */
+static int set_pax_string(char **field, const char *value, size_t len) {
+    free(*field);
+    *field = strndup(value, len);
+    return *field != NULL ? 0 : -1;
+}
+
+/*
+ * Applies the PAX records in 'data' ("<len> <key>=<value>\n" each) that minitar uses
+ * to 'values': path, linkpath, size, mtime and the GNU.sparse keys of format 1.0. Other keys are ignored
+ * Returns 0 on success, -1 if the records are malformed or out of memory
+ */
+static int parse_pax_records(const char *data, size_t len, pax_values_t *values) {
+    size_t pos = 0;
+    while (pos < len) {
+        char *end;
+        long record_len = strtol(data + pos, &end, 10);
+        if (end == data + pos || *end != ' ' || record_len <= 0 || pos + record_len > len
+            || data[pos + record_len - 1] != '\n') {
+            return -1;
+        }
+        const char *key = end + 1;
+        const char *eq = memchr(key, '=', data + pos + record_len - key);
+        if (eq == NULL) {
+            return -1;
+        }
+        const char *value = eq + 1;
+        size_t value_len = data + pos + record_len - 1 - value;
+        size_t key_len = eq - key;
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            if (set_pax_string(&values->name, value, value_len) != 0) {
+                return -1;
+            }
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            if (set_pax_string(&values->linkname, value, value_len) != 0) {
+                return -1;
+            }
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            values->size = strtoll(value, NULL, 10);
+        } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+            values->mtime = strtoll(value, NULL, 10);  // whole seconds, any fraction is dropped
+            values->has_mtime = 1;
+        } else if (key_len == 15 && memcmp(key, "GNU.sparse.name", 15) == 0) {
+            if (set_pax_string(&values->sparse_name, value, value_len) != 0) {
+                return -1;
+            }
+        } else if (key_len == 19 && memcmp(key, "GNU.sparse.realsize", 19) == 0) {
+            values->sparse_realsize = strtoll(value, NULL, 10);
+        } else if (key_len == 16 && memcmp(key, "GNU.sparse.major", 16) == 0) {
+            values->sparse_major = atoi(value);
+        }
+        pos += record_len;
+    }
+    return 0;
+}
+
+/*
+ * Reads 'len' bytes at 'offset' through 'read_fn' into a new null-terminated buffer
+ * Returns the buffer, or NULL on error
+ */
+static char *read_extended_data(archive_pread_fn read_fn, void *ctx, off_t offset, size_t len) {
+    char *data = malloc(len + 1);
+    if (data == NULL) {
+        perror("Failed to allocate extended header");
+        return NULL;
+    }
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read_fn(ctx, data + got, len - got, offset + got);
+        if (n <= 0) {
+            printf("Error: archive ends in the middle of an extended header\n");
+            free(data);
+            return NULL;
+        }
+        got += n;
+    }
+    data[len] = '\0';
+    return data;
+}
+
+int read_member_from(archive_pread_fn read_fn, void *ctx, off_t offset, archive_member_t *member) {
+    archive_member_free(member);
+    member->header_offset = offset;
+    member->checksum_ok = 1;
+    pax_values_t pax = {NULL, NULL, NULL, -1, 0, 0, -1, 0};
+    while (1) {
+        int status = read_header_from(read_fn, ctx, offset, &member->header);
+        if (status != 1) {
+            if (status == 0 && offset != member->header_offset) {
+                printf("Error: archive ends after an extended header\n");
+                status = -1;
+            }
+            pax_values_free(&pax);
+            return status;
+        }
+        int signed_sum;
+        unsigned sum = header_checksum(&member->header, &signed_sum);
+        off_t stored = parse_octal(member->header.chksum, sizeof(member->header.chksum));
+        if (stored != sum && stored != signed_sum) {
+            member->checksum_ok = 0;
+        }
+        off_t size = parse_numeric(member->header.size, sizeof(member->header.size));
+        char type = member->header.typeflag;
+        if (type != XHDTYPE && type != XGLTYPE && type != GNU_LONGNAME_TYPE && type != GNU_LONGLINK_TYPE) {
+            break;  // the member's own header
+        }
+        if (size < 0 || size > MAX_EXTENDED_HEADER) {
+            printf("Error: extended header at offset %lld is too big\n", (long long)offset);
+            pax_values_free(&pax);
+            return -1;
+        }
+        if (type != XGLTYPE) {  // global defaults aren't used
+            char *data = read_extended_data(read_fn, ctx, offset + BLOCK_SIZE, size);
+            if (data == NULL) {
+                pax_values_free(&pax);
+                return -1;
+            }
+            if (type == GNU_LONGNAME_TYPE) {
+                free(pax.name);
+                pax.name = data;   // null-terminated name, possibly followed by padding
+            } else if (type == GNU_LONGLINK_TYPE) {
+                free(pax.linkname);
+                pax.linkname = data;
+            } else {
+                int bad = parse_pax_records(data, size, &pax);
+                free(data);
+                if (bad) {
+                    printf("Error: malformed extended header at offset %lld\n", (long long)offset);
+                    pax_values_free(&pax);
+                    return -1;
+                }
+            }
+        }
+        offset = next_header_offset(offset, size);
+    }
+
+    member->typeflag = member->header.typeflag;
+    member->size = pax.size >= 0 ? pax.size : parse_numeric(member->header.size, sizeof(member->header.size));
+    member->mtime = pax.has_mtime ? pax.mtime : parse_numeric(member->header.mtime, sizeof(member->header.mtime));
+    if (member->size < 0) {
+        printf("Error: bad size in header at offset %lld\n", (long long)offset);
+        pax_values_free(&pax);
+        return -1;
+    }
+    // Only the 1.0 sparse format is understood, older ones are left as they are stored
+    member->sparse = pax.sparse_major == 1 && pax.sparse_realsize >= 0 && pax.sparse_name != NULL;
+    member->real_size = member->sparse ? pax.sparse_realsize : member->size;
+    if (member->sparse) {   // the header's own name is the GNUSparseFile placeholder
+        free(pax.name);
+        pax.name = pax.sparse_name;
+        pax.sparse_name = NULL;
+    }
+    free(pax.sparse_name);
+    if (member->typeflag == LNKTYPE && pax.linkname == NULL) {
+        pax.linkname = strndup(member->header.linkname, sizeof(member->header.linkname));
+        if (pax.linkname == NULL) {
+            perror("Failed to allocate member link target");
+            free(pax.name);
+            return -1;
+        }
+    }
+    if (member->typeflag == LNKTYPE) {
+        member->linkname = pax.linkname;
+    } else {
+        free(pax.linkname);
+    }
+    member->data_offset = offset + BLOCK_SIZE;
+    member->next_offset = next_header_offset(offset, member->size);
+    stats_count(STAT_BLOCKS, (member->data_offset - member->header_offset) / BLOCK_SIZE);
+    if (pax.name != NULL) {
+        member->name = pax.name;
+    } else {
+        char name[USTAR_NAME_MAX + 1];
+        header_name(&member->header, name);
+        member->name = strdup(name);
+        if (member->name == NULL) {
+            perror("Failed to allocate member name");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+
+// Returns 1 if 'pattern' has glob characters, 0 if it can only match a member name exactly
+static int is_glob(const char *pattern) {
+    return strpbrk(pattern, "*?[") != NULL;
+}
+
+// Returns 1 if any of 'patterns' is a glob, 0 if they are all plain names
+static int has_globs(const file_list_t *patterns) {
+    for (node_t *current = patterns->head; current != NULL; current = current->next) {
+        if (is_glob(current->name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Decides whether the member 'name' is one of those picked on the command line: named
+ * exactly, or matched by a glob pattern. Like in GNU tar a '*' also matches across '/'
+ * Returns 1 if it is, 0 otherwise
+ */
+static int member_selected(const file_list_t *patterns, const char *name) {
+    if (file_list_contains(patterns, name)) {
+        return 1;
+    }
+    for (node_t *current = patterns->head; current != NULL; current = current->next) {
+        if (is_glob(current->name) && fnmatch(current->name, name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Makes sure each of 'patterns' picks at least one member of 'index', naming those that don't
+ * Returns 0 if they all do, -1 otherwise
+ */
+static int check_patterns(const file_list_t *patterns, const archive_index_t *index) {
+    int ret = 0;
+    for (node_t *current = patterns->head; current != NULL; current = current->next) {
+        int found = archive_index_find(index, current->name) != NULL;
+        for (uint32_t i = 0; !found && is_glob(current->name) && i < index->num_entries; i++) {
+            found = fnmatch(current->name, archive_index_name(index, &index->entries[i]), 0) == 0;
+        }
+        if (!found) {
+            printf("Error: %s is not present in archive\n", current->name);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+
+/*
+ * Adds the member names recorded in 'index' to 'files', in the order they appear in the archive;
+ * only those 'patterns' picks, unless it is NULL
+ * Returns 0 upon success, -1 upon error
+ */
+static int list_from_index(const archive_index_t *index, const file_list_t *patterns, file_list_t *files) {
+    const index_entry_t **order = malloc(sizeof(index_entry_t *) * (index->num_entries + 1));
+    if (order == NULL) {
+        perror("Failed to allocate member list\n");
+        return -1;
+    }
+    archive_index_archive_order(index, order);
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        if (patterns != NULL && !member_selected(patterns, archive_index_name(index, order[i]))) {
+            continue;
+        }
+        if (file_list_add(files, archive_index_name(index, order[i])) != 0) {
+            perror("Failed to add file to files list\n");
+            free(order);
+            return -1;
+        }
+    }
+    free(order);
+    return 0;
+}
+
+
+/*
+ * Get an index of every member in 'archive_name': the sidecar if there is one,
+ * otherwise a header-only scan of the archive kept in memory. The scan reads through
+ * 'read_fn' if it isn't NULL, such as a reader that keeps the archive out of the page cache.
+ * Returns 0 upon success, -1 upon error
+ */
+static int load_member_index_from(const char *archive_name, archive_pread_fn read_fn, void *ctx,
+                                  archive_index_t *index) {
+    uint64_t start = stats_phase_begin();
+    int status = archive_index_open(archive_name, index, minitar_opts.use_index);
+    if (status == -1) {
+        return -1;
+    }
+    if (status == 1 && (read_fn != NULL ? archive_index_scan_from(read_fn, ctx, index)
+                                        : archive_index_scan(archive_name, index)) != 0) {
+        archive_index_free(index);
+        return -1;
+    }
+    stats_phase_end(PHASE_SCAN, start);
+    return 0;
+}
+
+static int load_member_index(const char *archive_name, archive_index_t *index) {
+    return load_member_index_from(archive_name, NULL, NULL, index);
+}
+
+
+/*
+ * load_member_index for list and extract of the members 'patterns' picks. With --occurrence
+ * only the first version of each name is indexed, from a header scan that stops as soon as
+ * every name has turned up when they are all plain names. The sidecar is no use there, it
+ * can't tell where that point is.
+ * Returns 0 upon success, -1 upon error
+ */
+static int load_selected_index(const char *archive_name, const file_list_t *patterns, archive_index_t *index) {
+    if (!minitar_opts.occurrence) {
+        return load_member_index(archive_name, index);
+    }
+    uint64_t start = stats_phase_begin();
+    archive_index_init(index);
+    if (archive_index_scan_first(archive_name, has_globs(patterns) ? NULL : patterns, index) != 0) {
+        archive_index_free(index);
+        return -1;
+    }
+    stats_phase_end(PHASE_SCAN, start);
+    return 0;
+}
+
+
+/*
+ * Decides whether 'file_name' still matches 'entry', the latest version of it in the archive
+ * open at 'archive_fd'. Sizes must match, then either the mtimes or (with hash_contents)
+ * hashes of the file and of the member body. For a hard link the size and body are those
+ * of 'data', the member it links to; otherwise 'data' is 'entry'.
+ * Returns 1 if unchanged, 0 if changed, -1 upon error
+ */
+static int member_unchanged(const char *file_name, const index_entry_t *entry, const index_entry_t *data,
+                            int archive_fd) {
+    char err_msg[MAX_MSG_LEN];
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in update", file_name);
+        perror(err_msg);
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s in update", file_name);
+        perror(err_msg);
+        close(fd);
+        return -1;
+    }
+    int unchanged = (uint64_t)stat_buf.st_size == data->real_size;
+    if (unchanged && !minitar_opts.hash_contents) {
+        unchanged = stat_buf.st_mtime == entry->mtime;
+    } else if (unchanged) {
+        uint64_t file_hash;
+        uint64_t member_hash;
+        if (content_hash_fd(fd, 0, stat_buf.st_size, &file_hash) != 0
+            || (data->flags & INDEX_SPARSE
+                    ? sparse_hash(fd_pread, &archive_fd, data->data_offset, data->size, data->real_size, &member_hash)
+                    : content_hash_fd(archive_fd, data->data_offset, data->size, &member_hash)) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to hash file %s in update", file_name);
+            perror(err_msg);
+            close(fd);
+            return -1;
+        }
+        unchanged = file_hash == member_hash;
+    }
+    close(fd);
+    return unchanged;
+}
+
+
+int update_archive(const char *archive_name, const file_list_t *files) {
+    int compressed = archive_is_compressed(archive_name);
+    if (compressed != 0) {
+        if (compressed == 1) {
+            printf("Error: cannot update compressed archive %s\n", archive_name);
+        }
+        return -1;
+    }
+    archive_index_t index;
+    if (load_member_index(archive_name, &index) != 0) {  // sidecar, or one scan of the headers
+        return -1;
+    }
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {
+        perror("Failed to open archive in update\n");
+        archive_index_free(&index);
+        return -1;
+    }
+
+    file_list_t changed;
+    file_list_init(&changed);
+    long skipped = 0;
+    unsigned long long bytes_saved = 0;
+    int ret = 0;
+    for (node_t *current = files->head; current != NULL && ret == 0; current = current->next) {
+        const index_entry_t *entry = archive_index_find(&index, current->name);   // binary search for the latest version
+        if (entry == NULL) {
+            printf("Error: One or more of the specified files is not already present in archive");
+            ret = -1;
+            break;
+        }
+        uint64_t start = stats_phase_begin();
+        const index_entry_t *data = archive_index_resolve(&index, entry);   // a link with no target counts as changed
+        int unchanged = data != NULL ? member_unchanged(current->name, entry, data, archive_fd) : 0;
+        stats_phase_end(PHASE_HEADER, start);
+        if (unchanged == -1) {
+            ret = -1;
+        } else if (unchanged) {
+            skipped++;
+            bytes_saved += next_header_offset(0, entry->size);  // header plus padded body we didn't append
+        } else if (file_list_add(&changed, current->name) != 0) {
+            perror("Failed to add file to files list\n");
+            ret = -1;
+        }
+    }
+    close(archive_fd);
+    archive_index_free(&index);
+
+    if (ret == 0 && changed.size > 0 && append_files_to_archive(archive_name, &changed) != 0) {
+        perror("problem appending files in update\n");
+        ret = -1;
+    }
+    if (ret == 0) {
+        printf("Updated %d file(s), skipped %ld unchanged (%llu bytes saved)\n", changed.size, skipped, bytes_saved);
+    }
+    file_list_clear(&changed);
+    return ret;
+}
+
+
+// A stretch of an archive, from 'start' up to but not including 'end'
+typedef struct {
+    off_t start;
+    off_t end;
+} byte_range_t;
+
+/*
+ * Cuts the members of 'index' whose 'keep' flag (one per entry) is clear out of the plain
+ * archive 'archive_name' in place, moving whatever follows them down and cutting off the end.
+ * A removed member takes everything up to the next member's headers with it (such as a
+ * global PAX header); what comes before the first member and after the last one stays.
+ * Stretches aligned to the file system's blocks are dropped with FALLOC_FL_COLLAPSE_RANGE,
+ * which moves no data at all, the rest by moving the members after them down through the
+ * copy engine. If this fails halfway the archive is left damaged.
+ * Returns the number of bytes reclaimed, or -1 upon error
+ */
+static off_t remove_members(const char *archive_name, const archive_index_t *index, const char *keep) {
+    const index_entry_t **order = malloc(sizeof(index_entry_t *) * (index->num_entries + 1));
+    byte_range_t *cuts = malloc(sizeof(byte_range_t) * (index->num_entries + 1));
+    if (order == NULL || cuts == NULL) {
+        perror("Failed to allocate member list\n");
+        free(order);
+        free(cuts);
+        return -1;
+    }
+    archive_index_archive_order(index, order);
+    uint32_t num_cuts = 0;
+    off_t reclaimed = 0;
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        if (keep[order[i] - index->entries]) {
+            continue;
+        }
+        off_t start = order[i]->header_offset;
+        off_t end = i + 1 < index->num_entries ? order[i + 1]->header_offset
+                                               : next_header_offset(order[i]->data_offset - BLOCK_SIZE, order[i]->size);
+        if (num_cuts > 0 && cuts[num_cuts - 1].end == start) {  // removed members next to each other go in one cut
+            cuts[num_cuts - 1].end = end;
+        } else {
+            cuts[num_cuts].start = start;
+            cuts[num_cuts].end = end;
+            num_cuts++;
+        }
+        reclaimed += end - start;
+    }
+    free(order);
+
+    char err_msg[MAX_MSG_LEN];
+    int fd = open(archive_name, O_RDWR);
+    struct stat stat_buf;
+    if (fd == -1 || fstat(fd, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+        perror(err_msg);
+        if (fd != -1) {
+            close(fd);
+        }
+        free(cuts);
+        return -1;
+    }
+    if (num_cuts > 0 && cuts[num_cuts - 1].end > stat_buf.st_size) {
+        printf("Error: archive %s is truncated\n", archive_name);
+        close(fd);
+        free(cuts);
+        return -1;
+    }
+
+    // Collapse from the back, so the cuts still to be made keep their offsets
+    uint64_t start = stats_phase_begin();
+    off_t block = stat_buf.st_blksize > 0 ? stat_buf.st_blksize : BLOCK_SIZE;
+    uint32_t remaining = num_cuts;
+    while (remaining > 0 && cuts[remaining - 1].start % block == 0
+           && (cuts[remaining - 1].end - cuts[remaining - 1].start) % block == 0) {
+        byte_range_t *cut = &cuts[remaining - 1];
+        if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, cut->start, cut->end - cut->start) != 0) {
+            if (errno == EOPNOTSUPP || errno == EINVAL) {   // not on this file system, or the cut reaches the end
+                break;
+            }
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to remove members from archive %s", archive_name);
+            perror(err_msg);
+            close(fd);
+            free(cuts);
+            return -1;
+        }
+        remaining--;
+    }
+
+    // Whatever couldn't be collapsed: move each stretch of kept members down over the cuts before it
+    int ret = 0;
+    if (remaining > 0) {
+        off_t file_end = lseek(fd, 0, SEEK_END);
+        off_t dst = cuts[0].start;
+        for (uint32_t i = 0; i < remaining && ret == 0; i++) {
+            off_t src = cuts[i].end;
+            off_t len = (i + 1 < remaining ? cuts[i + 1].start : file_end) - src;
+            ret = file_end == -1 ? -1 : move_fd_data(fd, src, dst, len);
+            dst += len;
+        }
+        if (ret == 0 && ftruncate(fd, dst) != 0) {
+            ret = -1;
+        }
+        if (ret != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to remove members from archive %s, it may be damaged", archive_name);
+            perror(err_msg);
+        }
+    }
+    if (close(fd) != 0 && ret == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
+        perror(err_msg);
+        ret = -1;
+    }
+    stats_phase_end(PHASE_DATA, start);
+    free(cuts);
+    return ret == 0 ? reclaimed : -1;
+}
+
+
+/*
+ * Shared by delete_archive_members and compact_archive: with 'names', drops every version
+ * of the members it picks; without, every version but the latest of each name
+ * Returns 0 upon success, -1 upon error
+ */
+static int prune_archive(const char *archive_name, const file_list_t *names) {
+    int compressed = archive_is_compressed(archive_name);
+    if (compressed != 0) {
+        if (compressed == 1) {
+            printf("Error: cannot remove members from compressed archive %s\n", archive_name);
+        }
+        return -1;
+    }
+    uint64_t start = stats_phase_begin();
+    archive_index_t index;
+    int status = archive_index_open(archive_name, &index, minitar_opts.use_index);
+    if (status == -1) {
+        return -1;
+    }
+    int have_sidecar = status == 0;
+    if (status == 1 && archive_index_scan(archive_name, &index) != 0) {
+        archive_index_free(&index);
+        return -1;
+    }
+    stats_phase_end(PHASE_SCAN, start);
+    if (names != NULL && check_patterns(names, &index) != 0) {
+        archive_index_free(&index);
+        return -1;
+    }
+
+    char *keep = calloc(index.num_entries + 1, 1);
+    const index_entry_t **live = malloc(sizeof(index_entry_t *) * (index.num_entries + 1));
+    if (keep == NULL || live == NULL) {
+        perror("Failed to allocate member list\n");
+        free(keep);
+        free(live);
+        archive_index_free(&index);
+        return -1;
+    }
+    uint32_t num_removed = 0;
+    if (names != NULL) {
+        for (uint32_t i = 0; i < index.num_entries; i++) {
+            keep[i] = !member_selected(names, archive_index_name(&index, &index.entries[i]));
+            num_removed += !keep[i];
+        }
+    } else {
+        uint32_t num_latest = archive_index_latest(&index, live);
+        for (uint32_t i = 0; i < num_latest; i++) {
+            keep[live[i] - index.entries] = 1;
+        }
+        // A link stands for the version of its target written before it, which may since have been
+        // superseded; that version stays too. Data members are never links, so one pass is enough
+        for (uint32_t i = 0; i < num_latest; i++) {
+            const index_entry_t *data = archive_index_resolve(&index, live[i]);
+            if (data != NULL) {
+                keep[data - index.entries] = 1;
+            }
+        }
+        for (uint32_t i = 0; i < index.num_entries; i++) {
+            num_removed += !keep[i];
+        }
+    }
+    free(live);
+
+    // A link that stays needs the member it resolves to, deleting that one is refused
+    int ret = 0;
+    for (uint32_t i = 0; i < index.num_entries && ret == 0; i++) {
+        const index_entry_t *entry = &index.entries[i];
+        const index_entry_t *data = keep[i] && (entry->flags & INDEX_HARDLINK) ? archive_index_resolve(&index, entry) : NULL;
+        if (data != NULL && !keep[data - index.entries]) {
+            printf("Error: %s links to %s, delete it too\n", archive_index_name(&index, entry),
+                   archive_index_link_target(&index, entry));
+            ret = -1;
+        }
+    }
+    off_t reclaimed = 0;
+    if (ret == 0 && num_removed > 0) {
+        reclaimed = remove_members(archive_name, &index, keep);
+        ret = reclaimed == -1 ? -1 : 0;
+    }
+    free(keep);
+    archive_index_free(&index);
+
+    // Every offset after the first cut moved, the sidecar is rebuilt from scratch
+    if (ret == 0 && num_removed > 0 && have_sidecar) {
+        archive_index_init(&index);
+        if (archive_index_scan(archive_name, &index) != 0 || archive_index_write(archive_name, &index) != 0) {
+            perror("Failed to update index after removing members\n");
+            ret = -1;
+        }
+        archive_index_free(&index);
+    }
+    if (ret == 0) {
+        stats_count(STAT_FILES, num_removed);
+        printf("Removed %u member(s), reclaimed %lld bytes\n", num_removed, (long long)reclaimed);
+    }
+    return ret;
+}
+
+
+int delete_archive_members(const char *archive_name, const file_list_t *names) {
+    return prune_archive(archive_name, names);
+}
+
+
+int compact_archive(const char *archive_name) {
+    return prune_archive(archive_name, NULL);
+}
+
+
+/*
+ * Sets up 'reader' on the archive coming in on 'fd', normally stdin. Compressed archives
+ * keep their chunk table at the end, so they can't be read front to back and are turned away
+ * Returns 0 upon success, -1 upon error
+ */
+static int open_stream_archive(stream_reader_t *reader, int fd) {
+    if (stream_reader_init(reader, fd) != 0) {
+        return -1;
+    }
+    char magic[sizeof(MTZ_MAGIC)];
+    if (stream_pread(reader, magic, sizeof(magic), 0) == sizeof(magic)
+        && memcmp(magic, MTZ_MAGIC, sizeof(MTZ_MAGIC)) == 0) {
+        printf("Error: compressed archives can't be read from stdin\n");
+        stream_reader_free(reader);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Lists the archive coming in on stdin with one pass over its headers, skipping the bodies.
+ * Only the members 'patterns' picks are listed, unless it is NULL; see load_selected_index
+ * for --occurrence
+ * Returns 0 upon success, -1 upon error
+ */
+static int list_stream(const file_list_t *patterns, file_list_t *files) {
+    stream_reader_t reader;
+    if (open_stream_archive(&reader, STDIN_FILENO) != 0) {
+        return -1;
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    uint64_t start = stats_phase_begin();
+    int status;
+    if (patterns != NULL && minitar_opts.occurrence) {
+        status = archive_index_scan_first_from(stream_pread, &reader, has_globs(patterns) ? NULL : patterns, &index);
+    } else {
+        status = archive_index_scan_from(stream_pread, &reader, &index);
+    }
+    stats_phase_end(PHASE_SCAN, start);
+    if (status == 0 && patterns != NULL) {
+        status = check_patterns(patterns, &index);
+    }
+    if (status == 0) {
+        status = list_from_index(&index, patterns, files);
+    }
+    if (status == 0) {
+        status = stream_drain(&reader);
+    }
+    stats_count(STAT_FILES, index.num_entries);
+    archive_index_free(&index);
+    stream_reader_free(&reader);
+    return status;
+}
+
+
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+    if (strcmp(archive_name, STDIO_ARCHIVE) == 0) {
+        return list_stream(NULL, files);
+    }
+    // The archive is only ever read, either through its sidecar index or a scan of its headers
+    archive_index_t index;
+    if (load_member_index(archive_name, &index) != 0) {
+        return -1;
+    }
+    int status = list_from_index(&index, NULL, files);
+    stats_count(STAT_FILES, index.num_entries);
+    archive_index_free(&index);
+    return status;
+}
+
+
+int list_archive_members(const char *archive_name, const file_list_t *patterns, file_list_t *files) {
+    if (strcmp(archive_name, STDIO_ARCHIVE) == 0) {
+        return list_stream(patterns, files);
+    }
+    archive_index_t index;
+    if (load_selected_index(archive_name, patterns, &index) != 0) {
+        return -1;
+    }
+    int status = check_patterns(patterns, &index);
+    if (status == 0) {
+        status = list_from_index(&index, patterns, files);
+    }
+    stats_count(STAT_FILES, index.num_entries);
+    archive_index_free(&index);
+    return status;
+}
+
+
+int make_dirs(const char *path) {
+    char err_msg[MAX_MSG_LEN];
+    char *dir = strdup(path);
+    if (dir == NULL) {
+        perror("Failed to allocate memory in function extract");
+        return -1;
+    }
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to create directory %s in function extract", dir);
+            perror(err_msg);
+            free(dir);
+            return -1;
+        }
+        *slash = '/';
+    }
+    free(dir);
+    return 0;
+}
+
+/*
+ * Creates the file 'name' and writes the member data of 'entry' into it, or just the
+ * directory if 'name' ends in '/'.
+ * With the archive mapped, 'data' points at the body and it goes out in a single write.
+ * Otherwise 'data' is NULL and the body in the tar stream is either read on from the
+ * archive on stdin behind 'stream', inflated from the compressed archive 'mtz', or read
+ * from the archive 'file' (by the copy engine, unless it bypasses the page cache).
+ * A sparse member only has its extents written, the holes stay holes.
+ * Reads from 'file' are positional, so workers can share it.
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_member(const char *name, const char *data, const archive_file_t *file, mtz_reader_t *mtz,
+                          stream_reader_t *stream, const index_entry_t *entry) {
+    off_t offset = entry->data_offset;
+    off_t size = entry->size;
+    char err_msg[MAX_MSG_LEN];
+    size_t name_len = strlen(name);
+    if (name_len > 0 && name[name_len - 1] == '/') {   // directory member, there's no data to write
+        stats_count(STAT_FILES, 1);
+        return make_dirs(name);
+    }
+    uint64_t start = stats_phase_begin();
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);   //make a new file with the name we get from the header block
+    if (fd == -1 && errno == ENOENT && make_dirs(name) == 0) {
+        // Parent directory is missing: its member may come later, or another worker has it, or the archive has none
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to create file %s in function extract", name);
+        perror(err_msg);
+        return -1;
+    }
+    int ret = 0;
+    if (entry->flags & INDEX_SPARSE) {
+        if (stream != NULL) {
+            ret = sparse_extract(stream_pread, stream, offset, size, entry->real_size, fd);
+        } else if (mtz != NULL) {
+            ret = sparse_extract(mtz_pread, mtz, offset, size, entry->real_size, fd);
+        } else {
+            ret = sparse_extract(archive_file_pread, (void *)file, offset, size, entry->real_size, fd);
+        }
+    } else if (data != NULL) {
+        ret = write_all(fd, data, size);
+    } else if (stream != NULL) {
+        ret = stream_copy(stream, offset, size, fd);
+    } else if (mtz != NULL) {
+        ret = mtz_copy_range(mtz, offset, size, fd);
+    } else {
+        ret = archive_file_copy(file, offset, size, fd);
+    }
+    if (ret != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write file %s in function extract", name);
+        perror(err_msg);
+    }
+    if (close(fd) != 0 && ret == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s in function extract", name);
+        perror(err_msg);
+        ret = -1;
+    }
+    stats_phase_end(PHASE_DATA, start);
+    stats_count(STAT_FILES, 1);
+    stats_count(STAT_DATA_BYTES, size);
+    stats_count(STAT_BLOCKS, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    return ret;
+}
+
+
+/*
+ * Makes 'name' a hard link to 'target', a file already extracted. Whatever is at 'name'
+ * is replaced, like a regular member overwrites it. Where the file system won't link
+ * them (too many links to the target, or no hard links at all) 'name' gets a copy instead.
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_link(const char *name, const char *target) {
+    char err_msg[MAX_MSG_LEN];
+    stats_count(STAT_FILES, 1);
+    if (strcmp(name, target) == 0) {    // a link to itself, nothing to do
+        return 0;
+    }
+    if (unlink(name) != 0 && errno != ENOENT) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to replace %s with a link in function extract", name);
+        perror(err_msg);
+        return -1;
+    }
+    int status = link(target, name);
+    if (status != 0 && errno == ENOENT && make_dirs(name) == 0) {  // the link's directory may have no member
+        status = link(target, name);
+    }
+    if (status == 0 || (errno != EMLINK && errno != EPERM)) {
+        if (status != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to link %s to %s in function extract", name, target);
+            perror(err_msg);
+        }
+        return status;
+    }
+
+    int src_fd = open(target, O_RDONLY);
+    int dst_fd = src_fd != -1 ? open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    struct stat stat_buf;
+    status = dst_fd != -1 && fstat(src_fd, &stat_buf) == 0
+             && copy_fd_data(src_fd, dst_fd, stat_buf.st_size) == stat_buf.st_size ? 0 : -1;
+    if (status != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to copy %s to %s in function extract", target, name);
+        perror(err_msg);
+    }
+    if (dst_fd != -1 && close(dst_fd) != 0 && status == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s in function extract", name);
+        perror(err_msg);
+        status = -1;
+    }
+    if (src_fd != -1) {
+        close(src_fd);
+    }
+    return status;
+}
+
+/*
+ * Writes the hard link member 'entry' once the regular members are in place. It stands for
+ * the version of its target that came before it (archive_index_resolve). If that version is
+ * the one on disk under the target's name ('target_on_disk' says whether that name was
+ * extracted at all), 'entry' becomes a link to it. Otherwise it gets that version's data,
+ * read from 'mtz' or else 'file', and further links to the same version are linked to
+ * it through 'stand_in' (a slot per index entry, NULL to begin with).
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_link_member(const archive_index_t *index, const index_entry_t *entry, int target_on_disk,
+                               const char **stand_in, const archive_file_t *file, mtz_reader_t *mtz) {
+    const char *name = archive_index_name(index, entry);
+    const char *target = archive_index_link_target(index, entry);
+    const index_entry_t *data = archive_index_resolve(index, entry);
+    if (data == NULL) {
+        printf("Error: %s links to %s, which is not present in archive\n", name, target);
+        return -1;
+    }
+    if (target_on_disk && data == archive_index_find(index, target)) {
+        return extract_link(name, target);
+    }
+    // The target was superseded after the link was made (or isn't being extracted)
+    const char **first = &stand_in[data - index->entries];
+    if (*first != NULL) {
+        return extract_link(name, *first);
+    }
+    *first = name;
+    return extract_member(name, NULL, file, mtz, NULL, data);
+}
+
+
+// Everything an extraction worker needs to write one of the surviving members
+typedef struct {
+    const char *archive_name;
+    const archive_file_t *file;
+    const char *map;            // whole archive mapped read-only, or NULL
+    off_t archive_size;
+    const archive_index_t *index;
+    const index_entry_t **live; // latest version of each member, in archive order
+} extract_job_t;
+
+/*
+ * Writes member number 'i' of the job's 'live' list. Called by run_jobs_parallel workers
+ * and by the serial loop alike
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_job(void *arg, long i) {
+    const extract_job_t *job = arg;
+    const index_entry_t *entry = job->live[i];
+    off_t body = entry->data_offset;
+    off_t file_size = entry->size;
+    if (body + file_size > job->archive_size) {
+        printf("Error: archive %s is truncated\n", job->archive_name);
+        return -1;
+    }
+    return extract_member(archive_index_name(job->index, entry), job->map != NULL ? job->map + body : NULL,
+                          job->file, NULL, NULL, entry);
+}
+
+// What the threads inflating a compressed archive need to put each chunk into the members it holds
+typedef struct {
+    const archive_index_t *index;
+    const index_entry_t **live; // latest version of each member, in archive order so by data offset
+    uint32_t num_live;
+} chunk_job_t;
+
+/*
+ * Writes the part of 'entry' that the chunk holding the 'len' bytes of tar stream at 'offset'
+ * covers, at its place in the file. The chunk the member's data starts in ('first') creates
+ * the file and gives it its size, other chunks may write to it before or after that.
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_chunk_part(const char *name, const index_entry_t *entry, const char *raw, size_t len,
+                              off_t offset, int first) {
+    char err_msg[MAX_MSG_LEN];
+    size_t name_len = strlen(name);
+    if (name_len > 0 && name[name_len - 1] == '/') {   // directory member, there's no data to write
+        stats_count(STAT_FILES, 1);
+        return make_dirs(name);
+    }
+    off_t from = entry->data_offset > offset ? entry->data_offset : offset;
+    off_t to = entry->data_offset + entry->size < offset + (off_t)len ? entry->data_offset + entry->size
+                                                                       : offset + (off_t)len;
+    // Truncating on open is only safe when no other chunk writes to the file
+    int flags = O_WRONLY | O_CREAT | (first && to == entry->data_offset + entry->size ? O_TRUNC : 0);
+    int fd = open(name, flags, 0666);
+    if (fd == -1 && errno == ENOENT && make_dirs(name) == 0) {
+        fd = open(name, flags, 0666);
+    }
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to create file %s in function extract", name);
+        perror(err_msg);
+        return -1;
+    }
+    int ret = first && !(flags & O_TRUNC) && ftruncate(fd, entry->size) != 0 ? -1 : 0;
+    while (ret == 0 && from < to) {
+        ssize_t n = pwrite(fd, raw + (from - offset), to - from, from - entry->data_offset);
+        if (n == -1 && errno != EINTR) {
+            ret = -1;
+        } else if (n > 0) {
+            from += n;
+        }
+    }
+    if (ret != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write file %s in function extract", name);
+        perror(err_msg);
+    }
+    if (close(fd) != 0 && ret == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s in function extract", name);
+        perror(err_msg);
+        ret = -1;
+    }
+    if (first) {
+        stats_count(STAT_FILES, 1);
+        stats_count(STAT_DATA_BYTES, entry->size);
+        stats_count(STAT_BLOCKS, (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+    return ret;
+}
+
+/*
+ * Puts the chunk holding the 'len' bytes of tar stream at 'offset' into the members it
+ * covers. Called by the mtz_inflate_each threads. Sparse members are left out, their
+ * data has to go through the map first.
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_chunk(void *arg, uint64_t chunk, const char *raw, size_t len, off_t offset) {
+    (void)chunk;
+    const chunk_job_t *job = arg;
+    uint64_t start = stats_phase_begin();
+    // First member whose data ends past the chunk's start, or that starts in it with no data at all
+    uint32_t low = 0;
+    uint32_t high = job->num_live;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const index_entry_t *entry = job->live[mid];
+        if (entry->data_offset + entry->size > offset || entry->data_offset >= offset) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    int ret = 0;
+    for (uint32_t i = low; i < job->num_live && job->live[i]->data_offset < offset + (off_t)len && ret == 0; i++) {
+        if (!(job->live[i]->flags & INDEX_SPARSE)) {
+            ret = extract_chunk_part(archive_index_name(job->index, job->live[i]), job->live[i], raw, len, offset,
+                                     job->live[i]->data_offset >= offset);
+        }
+    }
+    stats_phase_end(PHASE_DATA, start);
+    return ret;
+}
+
+/*
+ * Writes the 'num_live' members of 'live' out of the compressed archive behind 'mtz'. Each
+ * chunk is inflated once, on the -j threads, straight into the files of the members it
+ * covers, without a plain copy of the archive anywhere. Sparse members are written after
+ * that from 'mtz', through their maps.
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_chunks(const char *archive_name, mtz_reader_t *mtz, const archive_index_t *index,
+                          const index_entry_t **live, uint32_t num_live) {
+    for (uint32_t i = 0; i < num_live; i++) {
+        if ((uint64_t)(live[i]->data_offset + live[i]->size) > mtz->raw_size) {
+            printf("Error: archive %s is truncated\n", archive_name);
+            return -1;
+        }
+    }
+    chunk_job_t job = {index, live, num_live};
+    int ret = mtz_inflate_each(mtz, mtz_default_threads(), extract_chunk, &job);
+    for (uint32_t i = 0; i < num_live && ret == 0; i++) {
+        if (live[i]->flags & INDEX_SPARSE) {
+            ret = extract_member(archive_index_name(index, live[i]), NULL, NULL, mtz, NULL, live[i]);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Writes the latest version of every member in 'index' out of the plain tar stream in 'file',
+ * on a pool of -j worker threads if more than one was asked for, or out of the compressed
+ * archive behind 'mtz' if that isn't NULL. Hard links are made afterwards, so their
+ * targets are in place whatever order the workers finish in
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_live_members(const char *archive_name, const archive_file_t *file, mtz_reader_t *mtz,
+                                const archive_index_t *index) {
+    const index_entry_t **live = malloc(sizeof(index_entry_t *) * (index->num_entries + 1));
+    const index_entry_t **links = malloc(sizeof(index_entry_t *) * (index->num_entries + 1));
+    if (live == NULL || links == NULL) {
+        perror("Failed to allocate member list in file extract function\n");
+        free(live);
+        free(links);
+        return -1;
+    }
+    uint32_t num_latest = archive_index_latest(index, live);
+    uint32_t num_live = 0;
+    uint32_t num_links = 0;
+    for (uint32_t i = 0; i < num_latest; i++) {     // keeps both lists in archive order
+        if (live[i]->flags & INDEX_HARDLINK) {
+            links[num_links++] = live[i];
+        } else {
+            live[num_live++] = live[i];
+        }
+    }
+
+    struct stat stat_buf;
+    if (fstat(file->fd, &stat_buf) != 0) {
+        perror("Failed to stat archive file in file extract function\n");
+        free(live);
+        free(links);
+        return -1;
+    }
+    off_t archive_size = stat_buf.st_size;
+
+    // Map the whole archive so every member can be written straight from the page cache.
+    // If that isn't possible (e.g. the archive is empty) the copy engine reads the bodies instead.
+    // An archive kept out of the page cache is read member by member, io_uring writes from the map.
+    char *map = NULL;
+    if (archive_size > 0 && mtz == NULL && file->cache == CACHE_KEEP) {
+        map = mmap(NULL, archive_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            madvise(map, archive_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    extract_job_t job = {archive_name, file, map, archive_size, index, live};
+    int ret = 1;
+    if (mtz != NULL) {
+        ret = extract_chunks(archive_name, mtz, index, live, num_live);
+    } else if (minitar_opts.io_uring && map != NULL) {    // batches of members from a single thread, even with -j
+        ret = extract_members_uring(archive_name, file->fd, map, archive_size, index, live, num_live);
+    }
+    if (ret != 1) {
+        // done through io_uring, or failed there
+    } else if (minitar_opts.num_threads > 1) {
+        // Every name in 'live' is distinct, so workers never race on the same output file
+        ret = run_jobs_parallel(minitar_opts.num_threads, num_live, extract_job, &job);
+    } else {
+        // Write out the surviving members in archive order, so reads stay sequential
+        ret = 0;
+        for (uint32_t i = 0; i < num_live && ret == 0; i++) {
+            ret = extract_job(&job, i);
+        }
+    }
+
+    if (map != NULL) {
+        munmap(map, archive_size);
+    }
+    const char **stand_in = num_links > 0 ? calloc(index->num_entries, sizeof(char *)) : NULL;
+    if (num_links > 0 && stand_in == NULL) {
+        perror("Failed to allocate link list in file extract function\n");
+        ret = -1;
+    }
+    for (uint32_t i = 0; i < num_links && ret == 0; i++) {
+        ret = extract_link_member(index, links[i], 1, stand_in, file, mtz);
+    }
+    free(stand_in);
+    free(live);
+    free(links);
+    return ret;
+}
+
+
+/*
+ * Extracts the archive coming in on 'archive_fd' (stdin) in a single forward pass. Members are written as their headers go by, so a later version
+ * of a name overwrites an earlier one. With 'names' only the members it picks are written,
+ * and each name or pattern has to pick one. With --occurrence as well, later versions are
+ * passed over, and once every plain name has turned up the rest of the stream is only
+ * drained. Hard links are made as they go by, to the version of the target on disk then;
+ * a picked link must have its target picked too, since the target's data can't be read
+ * again.
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_stream(int archive_fd, const file_list_t *names) {
+    stream_reader_t reader;
+    if (open_stream_archive(&reader, archive_fd) != 0) {
+        return -1;
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    archive_reader_t members;
+    archive_reader_init(&members, stream_pread, &reader);
+    file_list_t seen;       // with --occurrence, names already taken from the stream
+    file_list_init(&seen);
+    file_list_t on_disk;    // names extracted so far
+    file_list_init(&on_disk);
+    file_list_t linked;     // names that share their file with another one through a link made here
+    file_list_init(&linked);
+    int first_only = names != NULL && minitar_opts.occurrence;
+    int stop_names = first_only && !has_globs(names) ? names->table_used : -1;
+    int found = 0;
+    const archive_member_t *member;
+    int ret = 0;
+    int status = 0;
+    while (ret == 0 && found != stop_names && (status = archive_reader_next(&members, &member)) == 1) {
+        if (first_only && file_list_contains(&seen, member->name)) {
+            continue;
+        }
+        if ((first_only && file_list_add(&seen, member->name) != 0) || archive_index_add(&index, member) != 0) {
+            perror("Failed to add member to archive index");
+            ret = -1;
+        } else if (names == NULL || member_selected(names, member->name)) {
+            found += names != NULL && file_list_contains(names, member->name);
+            if (member->linkname == NULL) {
+                index_entry_t entry = index.entries[index.num_entries - 1];     // adding more may move the array
+                // A new version must not be written through a link to the old one, which keeps the old data
+                if (file_list_contains(&linked, member->name) && unlink(member->name) != 0 && errno != ENOENT) {
+                    perror("Failed to replace linked file in file extract function\n");
+                    ret = -1;
+                } else {
+                    ret = extract_member(member->name, NULL, NULL, NULL, &reader, &entry);
+                }
+            } else if (file_list_contains(&on_disk, member->linkname)) {
+                // Links are made as they go by, when the target on disk is the version they stand for
+                ret = extract_link(member->name, member->linkname);
+                if (ret == 0 && (file_list_add(&linked, member->name) != 0
+                                 || file_list_add(&linked, member->linkname) != 0)) {
+                    perror("Failed to add member to link list");
+                    ret = -1;
+                }
+            } else if (names != NULL && !member_selected(names, member->linkname)) {
+                printf("Error: %s links to %s, name it too to extract it from stdin\n", member->name, member->linkname);
+                ret = -1;
+            } else {
+                printf("Error: %s links to %s, which is not present in archive\n", member->name, member->linkname);
+                ret = -1;
+            }
+            if (ret == 0 && file_list_add(&on_disk, member->name) != 0) {
+                perror("Failed to add member to extracted list");
+                ret = -1;
+            }
+        }
+    }
+    archive_reader_free(&members);
+    file_list_clear(&seen);
+    file_list_clear(&on_disk);
+    file_list_clear(&linked);
+    if (ret == 0 && status != 0) {
+        ret = -1;
+    }
+    archive_index_sort(&index);
+    if (ret == 0 && names != NULL) {
+        ret = check_patterns(names, &index);
+    }
+    if (ret == 0) {
+        ret = stream_drain(&reader);
+    }
+    archive_index_free(&index);
+    stream_reader_free(&reader);
+    return ret;
+}
+
+
+int extract_files_from_archive(const char *archive_name) {
+    if (strcmp(archive_name, STDIO_ARCHIVE) == 0) {   // -j and io_uring need the whole archive, a stream is read in order
+        return extract_stream(STDIN_FILENO, NULL);
+    }
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {
+        perror("Failed to open archive file in file extract function\n");
+        return -1;
+    }
+    mtz_reader_t mtz;
+    int compressed = mtz_open(archive_fd, &mtz);
+    if (compressed == -1) {
+        close(archive_fd);
+        return -1;
+    }
+
+    // First pass over the headers only: work out where the final version of each name lives,
+    // so superseded versions are never written just to be overwritten again.
+    // A compressed archive only has the chunks holding headers inflated for this.
+    // With --direct both passes read the archive around the page cache: a compressed one a
+    // chunk at a time, a plain one through the stream reader's aligned window for the headers
+    // and in aligned blocks per member after that.
+    archive_file_t file = {archive_fd, CACHE_KEEP};
+    archive_index_t index;
+    archive_index_init(&index);
+    int ret;
+    if (compressed && minitar_opts.direct_io) {
+        mtz_bypass_cache(&mtz);
+        ret = load_member_index_from(archive_name, mtz_pread, &mtz, &index);
+    } else if (minitar_opts.direct_io) {
+        stream_reader_t headers;
+        ret = stream_reader_init(&headers, archive_fd);
+        if (ret == 0) {
+            file.cache = stream_reader_bypass_cache(&headers);
+            ret = load_member_index_from(archive_name, stream_pread, &headers, &index);
+        }
+        stream_reader_free(&headers);
+    } else {
+        ret = load_member_index(archive_name, &index);
+    }
+
+    // Second pass: write the surviving members
+    if (ret == 0) {
+        ret = extract_live_members(archive_name, &file, compressed ? &mtz : NULL, &index);
+    }
+    if (file.cache == CACHE_DROP) {     // large folios across member edges outlive the drop after each read
+        posix_fadvise(archive_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    archive_index_free(&index);
+    mtz_close(&mtz);
+    close(archive_fd);
+    return ret;
+}
+
+
+int extract_archive_members(const char *archive_name, const file_list_t *names) {
+    if (strcmp(archive_name, STDIO_ARCHIVE) == 0) {
+        return extract_stream(STDIN_FILENO, names);
+    }
+    archive_index_t index;
+    if (load_selected_index(archive_name, names, &index) != 0) {
+        return -1;
+    }
+    const index_entry_t **picked = malloc(sizeof(index_entry_t *) * (index.num_entries + 1));
+    if (picked == NULL) {
+        perror("Failed to allocate member list in extract_archive_members\n");
+        archive_index_free(&index);
+        return -1;
+    }
+    // Latest version of every member the names and patterns pick, in archive order so reads go forward
+    uint32_t num_latest = archive_index_latest(&index, picked);
+    uint32_t num_picked = 0;
+    for (uint32_t i = 0; i < num_latest; i++) {
+        if (member_selected(names, archive_index_name(&index, picked[i]))) {
+            picked[num_picked++] = picked[i];
+        }
+    }
+    if (check_patterns(names, &index) != 0) {
+        free(picked);
+        archive_index_free(&index);
+        return -1;
+    }
+
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {
+        perror("Failed to open archive file in extract_archive_members\n");
+        free(picked);
+        archive_index_free(&index);
+        return -1;
+    }
+    // A compressed archive only has the chunks covering the requested members inflated
+    mtz_reader_t mtz;
+    int compressed = mtz_open(archive_fd, &mtz);
+    archive_file_t file = {archive_fd, CACHE_KEEP};
+    int ret = compressed == -1 ? -1 : 0;
+    for (uint32_t i = 0; i < num_picked && ret == 0; i++) {
+        if (!(picked[i]->flags & INDEX_HARDLINK)) {     // links are left for the second loop, their target may come later
+            ret = extract_member(archive_index_name(&index, picked[i]), NULL, &file,
+                                 compressed == 1 ? &mtz : NULL, NULL, picked[i]);
+        }
+    }
+    // Links whose target was extracted too become links, the others get the target's data
+    const char **stand_in = ret == 0 ? calloc(index.num_entries + 1, sizeof(char *)) : NULL;
+    if (ret == 0 && stand_in == NULL) {
+        perror("Failed to allocate link list in extract_archive_members\n");
+        ret = -1;
+    }
+    for (uint32_t i = 0; i < num_picked && ret == 0; i++) {
+        if (picked[i]->flags & INDEX_HARDLINK) {
+            int target_on_disk = member_selected(names, archive_index_link_target(&index, picked[i]));
+            ret = extract_link_member(&index, picked[i], target_on_disk, stand_in, &file,
+                                      compressed == 1 ? &mtz : NULL);
+        }
+    }
+    free(stand_in);
+    if (compressed == 1) {
+        mtz_close(&mtz);
+    }
+    close(archive_fd);
+    free(picked);
+    archive_index_free(&index);
+    return ret;
+}
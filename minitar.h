@@ -1,5 +1,9 @@
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
 #include "file_list.h"
 
 #define BLOCK_SIZE 512
@@ -22,7 +26,7 @@ typedef struct {
     char chksum[8];
     // File type (use constants defined below)
     char typeflag;
-    // Unused for this project
+    // Name of the member a hard link (LNKTYPE) points to, null-terminated unless it fills the field
     char linkname[100];
     // Indicates which tar standard we are using
     char magic[6];
@@ -45,9 +49,232 @@ typedef struct {
 #define MAGIC "ustar"
 
 // Constants to represent different file types
-// We'll only use regular files in this project
 #define REGTYPE '0'
+#define LNKTYPE '1'             // hard link to an earlier member, no data of its own
 #define DIRTYPE '5'
+// Extended headers, whose data describes the member that follows them
+#define XHDTYPE 'x'             // PAX records for the next member
+#define XGLTYPE 'g'             // PAX records for all following members
+#define GNU_LONGNAME_TYPE 'L'   // GNU tar: full name of the next member
+#define GNU_LONGLINK_TYPE 'K'   // GNU tar: full link target of the next member
+
+// Longest name the ustar name and prefix fields can hold together ("prefix/name")
+#define USTAR_NAME_MAX 256
+// Biggest value that fits in the 11 octal digits of the size and mtime fields (8 GiB - 1)
+#define USTAR_MAX_OCTAL_11 077777777777LL
+// Biggest value that fits in the 7 octal digits of the uid and gid fields
+#define USTAR_MAX_OCTAL_7 07777777
+// Extended headers bigger than this are treated as corrupt rather than loaded
+#define MAX_EXTENDED_HEADER (1 << 20)
+
+// The header blocks of one member as written to an archive
+typedef struct {
+    tar_header header;  // the ustar header
+    char *pax;          // PAX extended header block and its records, padded to whole blocks, or NULL if not needed
+    size_t pax_len;
+} member_header_t;
+
+// Data extent of a sparse file
+typedef struct {
+    off_t offset;
+    off_t length;
+} sparse_extent_t;
+
+// Where the data of a file with holes is, see sparse.h
+typedef struct {
+    sparse_extent_t *extents;   // in file order, none of them empty except a final one at 'real_size'
+    int count;
+    int cap;
+    off_t real_size;            // size of the file, holes included
+    off_t data_size;            // bytes in the extents
+} sparse_map_t;
+
+// A member found by walking an archive, with any extended headers in front of it applied
+typedef struct {
+    tar_header header;      // the member's own ustar header
+    char *name;             // full name, however long, see archive_member_free
+    char *linkname;         // full link target of a LNKTYPE member, NULL for any other type
+    char typeflag;
+    off_t size;             // length of the member's data, 64-bit even past the 8 GiB ustar limit
+    off_t real_size;        // size of the file it unpacks to, the same as 'size' unless it's sparse
+    int sparse;             // data starts with a GNU 1.0 sparse map, see sparse.h
+    int64_t mtime;
+    off_t header_offset;    // first header block of the member, extended headers included
+    off_t data_offset;      // where the member's data starts
+    off_t next_offset;      // where the next member's headers start
+    int checksum_ok;        // 0 if any of the member's header blocks has a bad checksum
+} archive_member_t;
+
+// Run-time options shared by the archive operations, filled in from the command line
+typedef struct {
+    // Number of threads reading member files during create, or writing them during extract (1 = serial)
+    int num_threads;
+    // Set once -j is given, so that even -j 1 overrides a default such as one thread per CPU
+    int num_threads_given;
+    // Print extra information about the operation (such as the copy path used) to stderr
+    int verbose;
+    // Write a sidecar index (ARCHIVE.idx) on create and append, see archive_index.h
+    int use_index;
+    // Compress the archive in independent chunks, see compress.h
+    int compress;
+    // During update, decide whether a file changed by hashing its contents; during verify, compare contents with the disk
+    int hash_contents;
+    // Store only numeric owner and group ids, without looking up their names
+    int numeric_owner;
+    // Report time per phase and counters about the run to stderr: STATS_OFF, STATS_TEXT or STATS_JSON (stats.h)
+    int stats;
+    // Batch the opens, stats, reads and writes of create and extract through io_uring, see uring.h
+    int io_uring;
+    // Store files with holes as sparse members, only their data extents, see sparse.h
+    int sparse;
+    // Store files with the same contents as an earlier member as hard links to it, see links.h
+    int dedupe;
+    // List and extract only the first version of each picked member, and stop reading once all names were found
+    int occurrence;
+    // Flush appended members to disk before they become part of the archive, one fdatasync per batch
+    int sync;
+    // With sync, commit the members of an append in batches of this many (0 = all of them at once)
+    int sync_batch;
+    // Read and write archive files around the page cache during create and extract, see stream.h
+    int direct_io;
+} minitar_options_t;
+
+extern minitar_options_t minitar_opts;
+
+/*
+ * Populates a tar header block pointed to by 'header' with metadata about
+ * the file identified by 'file_name'. A directory gets a DIRTYPE header with
+ * no data (its member name should end in '/'), anything else a REGTYPE header.
+ * Names over 100 bytes are split across the prefix and name fields where possible,
+ * sizes from 8 GiB on are stored in base-256. Whatever still doesn't fit is cut
+ * short, fill_member_header adds the extended header that keeps it whole.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fill_tar_header(tar_header *header, const char *file_name);
+
+/*
+ * Same as fill_tar_header, but uses metadata the caller already has in 'stat_buf'
+ * instead of calling stat on 'file_name' again.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fill_tar_header_from_stat(tar_header *header, const char *file_name, const struct stat *stat_buf);
+
+/*
+ * Creates every directory along 'path' that ends in a '/', like mkdir -p. So "a/b/" makes
+ * "a" and "a/b", and "a/b/file" makes the directories "file" goes in.
+ * Directories that already exist are fine; workers may race to create the same one.
+ * Returns 0 upon success, -1 upon error
+ */
+int make_dirs(const char *path);
+
+/*
+ * Checksum of a header block as POSIX defines it: the sum of its bytes as unsigned
+ * values, with the 8 bytes of the chksum field counted as spaces. If 'signed_sum' is
+ * not NULL it receives the sum with the bytes taken as signed char instead, which
+ * some old tar implementations wrote; readers should accept either.
+ */
+unsigned header_checksum(const tar_header *header, int *signed_sum);
+
+// Returns 1 if the 512-byte block at 'block' is all zeros, which marks the end of the archive
+int is_zero_block(const void *block);
+
+// Converts a 0-padded octal header field of 'len' bytes to a number
+off_t parse_octal(const char *field, size_t len);
+
+/*
+ * Converts a numeric header field of 'len' bytes to a number. Besides octal this
+ * understands the base-256 form (top bit of the first byte set) that GNU tar and
+ * minitar use for values too big for the octal digits. Negative values come back as -1
+ */
+int64_t parse_numeric(const char *field, size_t len);
+
+/*
+ * Copies a member name out of its header, joining the ustar prefix and name fields.
+ * Neither field is null-terminated when it is full. Names only an extended header
+ * holds in full come out truncated, see read_member_from
+ */
+void header_name(const tar_header *hed, char name[USTAR_NAME_MAX + 1]);
+
+/*
+ * Builds the header blocks for the file 'file_name' described by 'stat_buf': the ustar
+ * header as fill_tar_header_from_stat makes it, plus a PAX extended header in front of it
+ * carrying whatever ustar can't hold: names that don't fit prefix + name, sizes of 8 GiB
+ * and up, mtimes outside 0..8^11-1 and large uids or gids.
+ * Returns 0 on success or -1 if an error occurs. Free with member_header_free
+ */
+int fill_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf);
+
+/*
+ * Same as fill_member_header, for a file with holes stored as a sparse member (see
+ * sparse.h): the ustar header describes the map and extents described by 'sparse',
+ * PAX records give the real name and size of the file.
+ * Returns 0 on success or -1 if an error occurs. Free with member_header_free
+ */
+int fill_sparse_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf,
+                              const sparse_map_t *sparse);
+
+/*
+ * Same as fill_member_header, for a hard link (LNKTYPE) to the earlier member 'target':
+ * no data, the target goes in linkname, or a PAX linkpath record if it's longer than 100 bytes.
+ * Returns 0 on success or -1 if an error occurs. Free with member_header_free
+ */
+int fill_link_member_header(member_header_t *mh, const char *file_name, const struct stat *stat_buf,
+                            const char *target);
+
+/*
+ * Header blocks for 'file_name', open at 'fd'. With --sparse a file with holes gets a
+ * sparse member and its map goes in 'sparse' for sparse_write_body, otherwise this is
+ * fill_member_header and 'sparse' is left empty (count 0). Free it with sparse_map_free.
+ * Returns 0 on success or -1 if an error occurs. Free 'mh' with member_header_free
+ */
+int fill_member_header_fd(member_header_t *mh, const char *file_name, int fd, const struct stat *stat_buf,
+                          sparse_map_t *sparse);
+
+// Free the extended header of 'mh', if it has one
+void member_header_free(member_header_t *mh);
+
+/*
+ * Writes all header blocks of 'mh' to 'fd', the extended header first
+ * Returns 0 on success, -1 on error
+ */
+int write_member_header(int fd, const member_header_t *mh);
+
+/*
+ * Reads 'len' bytes at 'offset' of an archive's tar stream into 'buf', with the same
+ * contract as pread. Lets the header walkers run over plain and compressed archives alike.
+ */
+typedef ssize_t (*archive_pread_fn)(void *ctx, void *buf, size_t len, off_t offset);
+
+// archive_pread_fn for a plain archive, 'ctx' points at its file descriptor
+ssize_t fd_pread(void *ctx, void *buf, size_t len, off_t offset);
+
+/*
+ * Reads the header block at 'offset' of an archive into 'hed' through 'read_fn',
+ * so the archive's file position is never touched.
+ * Returns 1 if a member header was read, 0 at the end-of-archive marker (or the physical
+ * end of a footerless archive), -1 on error
+ */
+int read_header_from(archive_pread_fn read_fn, void *ctx, off_t offset, tar_header *hed);
+
+// read_header_from for the plain archive open at 'fd'
+int read_header_at(int fd, off_t offset, tar_header *hed);
+
+// Initialize 'member' for read_member_from
+void archive_member_init(archive_member_t *member);
+
+// Free the name and link target held by 'member'
+void archive_member_free(archive_member_t *member);
+
+/*
+ * Reads the member whose first header block is at 'offset' through 'read_fn', applying
+ * the PAX ('x') and GNU long name ('L') and long link ('K') headers in front of it: path,
+ * linkpath, size and mtime records override the ustar fields. Global PAX headers are skipped. 'member' must have been initialized; its previous name is freed.
+ * Returns 1 if a member was read, 0 at the end of the archive, -1 on error
+ */
+int read_member_from(archive_pread_fn read_fn, void *ctx, off_t offset, archive_member_t *member);
+
+// Offset of the header that follows the member whose header is at 'offset'
+off_t next_header_offset(off_t offset, off_t file_size);
 
 /*
  * Create a new archive file with the name 'archive_name'.
@@ -56,6 +283,11 @@ typedef struct {
  * You may also assume that all the elements of 'files' exist.
  * If an archive of the specified name already exists, you should overwrite it
  * with the result of this operation.
+ * Directories in 'files' are archived recursively, see expand_paths in walk.h.
+ * An 'archive_name' of "-" writes the archive to stdout instead (see stream.h), which
+ * must not be a terminal; stdout messages go to stderr meanwhile, and --index is refused.
+ * With --direct the archive file is written with O_DIRECT from the same double buffers,
+ * keeping it out of the page cache.
  * This function should return 0 upon success or -1 if an error occurred
  */
 int create_archive(const char *archive_name, const file_list_t *files);
@@ -64,27 +296,105 @@ int create_archive(const char *archive_name, const file_list_t *files);
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
  * You can assume in this project that at least one new file to append is specified.
  * You may also assume that all files to be appended exist.
+ * Directories are appended recursively, like in create_archive.
+ * The old end-of-archive marker is only overwritten once the new members and their footer
+ * are in place, so an interrupted append leaves the archive as it was. With --sync they are
+ * also flushed to disk first, in batches of --sync=N members if given.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int append_files_to_archive(const char *archive_name, const file_list_t *files);
 
+/*
+ * Append each file specified in 'files' that changed since it was last added to the
+ * archive 'archive_name'. A file is unchanged when its size and modification time
+ * match the most recent member of the same name; with hash_contents set, when its
+ * size and a hash of its contents match that member instead. Prints how many files
+ * were skipped and how many archive bytes that saved.
+ * Every file must already be present in the archive.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int update_archive(const char *archive_name, const file_list_t *files);
+
+/*
+ * Remove every version of the members 'names' picks (member names or glob patterns, as in
+ * list_archive_members) from the archive 'archive_name' in place: the members after them
+ * are moved down inside the file and the end is cut off, see compact_archive. A member
+ * that stays may not be a hard link to one being removed. Prints how many members were
+ * removed and how many bytes that reclaimed. A sidecar index is rebuilt.
+ * This function should return 0 upon success or -1 if an error occurred,
+ * including when one of the names or patterns matches nothing in the archive.
+ */
+int delete_archive_members(const char *archive_name, const file_list_t *names);
+
+/*
+ * Remove the superseded versions of every member from the archive 'archive_name', which
+ * update and append leave behind, keeping the latest one of each name, and the older version
+ * a kept hard link stands for (see archive_index_resolve). The archive isn't
+ * rewritten: stretches aligned to file system blocks are collapsed out of the file, and
+ * otherwise the members after a gap are moved down with copy_file_range, then the file is
+ * truncated. Prints how many members were removed and how many bytes that reclaimed.
+ * Compressed archives can't be compacted.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int compact_archive(const char *archive_name);
+
 /*
  * Add the name of each file contained in the archive identified by 'archive_name'
  * to the 'files' list.
  * NOTE: This function is most obviously relevant to implementing minitar's list
  * operation, but think about how you can reuse it for the update operation.
+ * The archive is opened read-only and never modified, the walk stops at the
+ * first all-zero block (the end-of-archive marker).
+ * An 'archive_name' of "-" lists an uncompressed archive read from stdin.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int get_archive_file_list(const char *archive_name, file_list_t *files);
 
+/*
+ * Same as get_archive_file_list, but only for the members 'patterns' picks: each entry is
+ * either a member name or a glob pattern (fnmatch, where '*' also matches '/'). Matching
+ * happens on the header scan, which never reads member bodies; with the occurrence option
+ * it stops as soon as every name has been found, when there are no patterns.
+ * This function should return 0 upon success or -1 if an error occurred,
+ * including when one of the names or patterns matches nothing in the archive.
+ */
+int list_archive_members(const char *archive_name, const file_list_t *patterns, file_list_t *files);
+
 /*
  * Write each file contained within the archive identified by 'archive_name'
  * as a new file to the current working directory.
  * If there are multiple versions of the same file present in the archive,
  * then only the most recently added version should be present as a new file
  * at the end of the extraction process.
+ * A first pass over the headers finds the latest version of every name, so each
+ * file is written exactly once. With -j, members are written by a pool of worker threads;
+ * since every name is written once the result doesn't depend on which thread finishes first.
+ * Hard links are made once every file is in place. A link stands for the version of its
+ * target that came before it; if the target was replaced after that, the link gets that
+ * version's data instead of being linked to the new one.
+ * Like get_archive_file_list, this only reads the archive.
+ * An 'archive_name' of "-" reads an uncompressed archive from stdin in a single serial
+ * pass instead, writing every version of a name in turn so the last one wins. With --direct
+ * an uncompressed archive file is read the same way, with O_DIRECT, so it doesn't fill the
+ * page cache.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Write only the members 'names' picks from the archive identified by 'archive_name'
+ * to the current working directory, taking the most recently added version of each.
+ * Entries of 'names' are member names or glob patterns, as in list_archive_members.
+ * Members are found through the sidecar index (see archive_index.h) rather than by
+ * scanning every header; without a sidecar one is built in memory for this call.
+ * With the occurrence option the first version is taken instead, and the scan stops
+ * once every name has been found.
+ * A hard link is linked to its target if that is being extracted too, in the version the
+ * link stands for, otherwise it gets a copy of that version's data. From stdin ("-") there is no going back for that
+ * data, so a named link needs its target named as well.
+ * This function should return 0 upon success or -1 if an error occurred,
+ * including when one of the names or patterns matches nothing in the archive.
+ */
+int extract_archive_members(const char *archive_name, const file_list_t *names);
+
 #endif
@@ -1,18 +1,85 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "copy_engine.h"
 #include "file_list.h"
 #include "minitar.h"
+#include "stats.h"
+#include "stream.h"
+#include "verify.h"
+
+#define USAGE "Usage: %s -c|a|t|u|x|d|--delete|--compact [-j N] [-z] [-v] [--index] [--hash] [--numeric-owner] [--stats[=json]] [--io-uring] [--sparse] [--dedupe] [--occurrence] [--sync[=N]] [--direct] -f ARCHIVE [FILE...]\n"
+
 //   argv[0]  argv[1]     argv[2]    argv[3]        argv[4]       argv[5]           argv[n]
 //> ./minitar <operation> -f         <archive_name> <file_name_1> <file_name_2> ... <file_nam
+// Options such as "-j 4" go between the operation and -f, which shifts everything after them
 int main(int argc, char **argv) {
+    stats_start();
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf(USAGE, argv[0]);
         return 0;
     }
 
-    file_list_t files;
-    file_list_init(&files);
+    int arg = 2;
+    while (arg < argc && strcmp(argv[arg], "-f") != 0) {   // parse options up to -f
+        if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {   // number of worker threads
+            minitar_opts.num_threads = atoi(argv[++arg]);
+            minitar_opts.num_threads_given = 1;
+            if (minitar_opts.num_threads < 1) {
+                printf("Error: -j needs a thread count of at least 1\n");
+                return -1;
+            }
+        } else if (strcmp(argv[arg], "--index") == 0) {    // keep a sidecar index next to the archive
+            minitar_opts.use_index = 1;
+        } else if (strcmp(argv[arg], "-z") == 0) {  // compress in independent chunks
+            minitar_opts.compress = 1;
+        } else if (strcmp(argv[arg], "--hash") == 0) {     // update and verify compare file contents
+            minitar_opts.hash_contents = 1;
+        } else if (strcmp(argv[arg], "--numeric-owner") == 0) {   // don't look up owner and group names
+            minitar_opts.numeric_owner = 1;
+        } else if (strcmp(argv[arg], "--stats") == 0) {   // report where the time went, see stats.h
+            minitar_opts.stats = STATS_TEXT;
+        } else if (strcmp(argv[arg], "--stats=json") == 0) {  // same, as one JSON line for collecting metrics
+            minitar_opts.stats = STATS_JSON;
+        } else if (strcmp(argv[arg], "--io-uring") == 0) {  // batch file I/O of create and extract
+            minitar_opts.io_uring = 1;
+        } else if (strcmp(argv[arg], "--sparse") == 0) {    // store only the data extents of files with holes
+            minitar_opts.sparse = 1;
+        } else if (strcmp(argv[arg], "--dedupe") == 0) {    // store repeated contents once, as hard links
+            minitar_opts.dedupe = 1;
+        } else if (strcmp(argv[arg], "--occurrence") == 0) {    // take the first version of named members, stop once found
+            minitar_opts.occurrence = 1;
+        } else if (strcmp(argv[arg], "--sync") == 0) {  // append and update flush new members before committing them
+            minitar_opts.sync = 1;
+        } else if (strncmp(argv[arg], "--sync=", 7) == 0) {     // same, one flush per N members
+            minitar_opts.sync = 1;
+            minitar_opts.sync_batch = atoi(argv[arg] + 7);
+            if (minitar_opts.sync_batch < 1) {
+                printf("Error: --sync= needs a batch size of at least 1\n");
+                return -1;
+            }
+        } else if (strcmp(argv[arg], "--direct") == 0) {  // create and extract keep the archive out of the page cache
+            minitar_opts.direct_io = 1;
+        } else if (strcmp(argv[arg], "-v") == 0) {  // verbose, report how member data was copied
+            minitar_opts.verbose = 1;
+        } else {
+            printf(USAGE, argv[0]);
+            return -1;
+        }
+        arg++;
+    }
+    if (arg + 1 >= argc) {  // no -f, or nothing after it
+        printf(USAGE, argv[0]);
+        return -1;
+    }
+    const char *arch_name = argv[arg + 1];
+    if (strcmp(arch_name, STDIO_ARCHIVE) == 0 && strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-t") != 0
+        && strcmp(argv[1], "-x") != 0) {   // the others need to seek in the archive
+        printf("Error: only -c, -t and -x work on an archive on stdin or stdout\n");
+        return -1;
+    }
+    int first_file = arg + 2;   // index of <file_name_1>
 
     file_list_t files_in_argv;
     file_list_init(&files_in_argv);
@@ -20,16 +87,14 @@ int main(int argc, char **argv) {
     // TODO: Parse command-line arguments and invoke functions from 'minitar.h'
     // to execute archive operations
 
-    char arch_name[1000];
-    strcpy(arch_name,argv[3]);
-    if (strcmp(argv[1], "-t") != 0) { //if operation is not "-t" (list), then
-        for (int i = 4 ; i < argc; i++) { //loop through the arguments in command line and add them to files list
-            if (file_list_add(&files_in_argv, argv[i]) != 0) {
-                perror("Failed to add file to files list\n");
-                return -1;
-            }
+    for (int i = first_file ; i < argc; i++) { //loop through the arguments in command line and add them to files list
+        if (file_list_add(&files_in_argv, argv[i]) != 0) {
+            perror("Failed to add file to files list\n");
+            return -1;
         }
     }
+    file_list_t listed;     // member names found by list
+    file_list_init(&listed);
 
     if (strcmp(argv[1], "-c") == 0) {  //create
         if (create_archive(arch_name, &files_in_argv) != 0) {
@@ -44,44 +109,69 @@ int main(int argc, char **argv) {
     }
 
     if (strcmp(argv[1], "-t") == 0) {  //list
-        if (get_archive_file_list(arch_name, &files_in_argv) != 0) {
+        if (files_in_argv.size > 0) {   // only the members named or matched on the command line
+            if (list_archive_members(arch_name, &files_in_argv, &listed) != 0) {
+                return -1;
+            }
+        } else if (get_archive_file_list(arch_name, &listed) != 0) {
             return -1;
         }
     }
 
 
     if (strcmp(argv[1], "-u") == 0) {  //update
-        if (get_archive_file_list(arch_name, &files) != 0) {    //get the files in the archive
-            perror("problem getting file names in archive_file_list call\n");
+        // appends only the named files that changed since their latest version in the archive
+        if (update_archive(arch_name, &files_in_argv) != 0) {
             return -1;
         }
-        current = files_in_argv.head;   // make a pointer to the files read from the command line (argv)
-        while (current != NULL) {       // while there are files to read
-            if (file_list_contains(&files, current->name) != 1) {   // check if the file from command line is in archve
-                printf("Error: One or more of the specified files is not already present in archive");
-                file_list_clear(&files_in_argv);
-                file_list_clear(&files);
+    }
+
+    if (strcmp(argv[1], "-x") == 0) {  //extract
+        if (files_in_argv.size > 0) {   // only the members named on the command line
+            if (extract_archive_members(arch_name, &files_in_argv) != 0) {
                 return -1;
             }
-            current = current->next;    // go to next file if command line file is in archive
+        } else if (extract_files_from_archive(arch_name) != 0) {
+            return -1;
+        }
+    }
+
+    if (strcmp(argv[1], "--delete") == 0) {    //delete every version of the named members
+        if (files_in_argv.size == 0) {
+            printf("Error: --delete needs the names of the members to delete\n");
+            return -1;
         }
+        if (delete_archive_members(arch_name, &files_in_argv) != 0) {
+            return -1;
+        }
+    }
 
-        if (append_files_to_archive(arch_name, &files_in_argv) != 0) {  // append the files from the command line to the archive
-            perror("problem appening files in update\n");
-            return -1; //if it is, then append the current file to the end of the archive
+    if (strcmp(argv[1], "--compact") == 0) {   //drop superseded versions of members
+        if (compact_archive(arch_name) != 0) {
+            return -1;
         }
-        
     }
 
-    if (strcmp(argv[1], "-x") == 0) {  //extract
-        if (extract_files_from_archive(arch_name) != 0) {
+    if (strcmp(argv[1], "-d") == 0) {  //verify
+        // with --hash the member contents are also compared with the files on disk
+        if (verify_archive(arch_name, minitar_opts.hash_contents) != 0) {
             return -1;
         }
     }
 
+    if (minitar_opts.verbose) {
+        copy_engine_report(stderr);
+    }
+    if (minitar_opts.stats != STATS_OFF) {
+        const char *ops = "catuxd";
+        const char *op_names[] = {"create", "append", "list", "update", "extract", "verify"};
+        const char *op = argv[1][0] == '-' && argv[1][1] != '\0' ? strchr(ops, argv[1][1]) : NULL;
+        stats_report(stderr, op != NULL ? op_names[op - ops] : argv[1] + strspn(argv[1], "-"));
+    }
+
     //printing the names of the files in the archive
     if (strcmp(argv[1], "-t") == 0) {   //if operation is list
-        current = files_in_argv.head;   //then get pointer to the files from archive
+        current = listed.head;   //then get pointer to the files from archive
         while (current != NULL) {       //list the names of files 
             printf("\n%s", (current->name));
             current = current->next;
@@ -89,6 +179,6 @@ int main(int argc, char **argv) {
         printf("\n");
     }
     file_list_clear(&files_in_argv);
-    file_list_clear(&files);
+    file_list_clear(&listed);
     return 0;
 }
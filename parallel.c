@@ -0,0 +1,361 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "hash.h"
+#include "minitar.h"
+#include "parallel.h"
+#include "sparse.h"
+#include "stats.h"
+
+#define MAX_MSG_LEN 512
+
+// One pooled buffer, holding a finished member until the writer gets to it
+typedef struct {
+    member_header_t header;
+    char *data;         // PIPELINE_BUF_SIZE bytes, allocated once up front
+    off_t size;         // body length recorded in the header
+    size_t data_len;    // body length rounded up to a whole number of blocks
+    int large;          // body did not fit in 'data', writer has to stream it from disk
+    sparse_map_t sparse;    // data extents of a sparse member (always streamed by the writer), count 0 otherwise
+    struct stat stat_buf;   // what the header was built from, for the writer's hard link decision
+    uint64_t hash;      // content hash for --dedupe, see links.h
+    int status;         // 0 if the worker succeeded, -1 otherwise
+    int ready;          // set by the worker once the member is complete
+    long index;         // position in the file list this slot is currently reserved for
+} pipeline_slot_t;
+
+// State shared between the writer (calling thread) and the workers
+typedef struct {
+    const char **names;     // file names in archive order
+    link_table_t *links;    // only touched by the writer
+    long num_files;
+    long next_file;         // next file index a worker should pick up
+    int failed;             // set once anything goes wrong, makes everyone stop early
+    pipeline_slot_t *slots;
+    int num_slots;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_ready;  // a worker finished a member
+    pthread_cond_t slot_free;   // the writer released a slot
+} pipeline_t;
+
+/*
+ * Stat, build the header for and (if it fits) read the contents of 'name' into 'slot'.
+ * With --dedupe the contents are hashed too, so the writer only has to look the hash up
+ * Returns 0 on success, -1 on error
+ */
+static int read_member(pipeline_slot_t *slot, const char *name) {
+    char err_msg[MAX_MSG_LEN];
+    uint64_t start = stats_phase_begin();
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in write_members_parallel", name);
+        perror(err_msg);
+        return -1;
+    }
+    struct stat *stat_buf = &slot->stat_buf;
+    if (fstat(fd, stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", name);
+        perror(err_msg);
+        close(fd);
+        return -1;
+    }
+    if (fill_member_header_fd(&slot->header, name, fd, stat_buf, &slot->sparse) != 0) {
+        close(fd);
+        return -1;
+    }
+    stats_phase_end(PHASE_HEADER, start);
+    start = stats_phase_begin();
+
+    slot->size = S_ISDIR(stat_buf->st_mode) ? 0 : stat_buf->st_size;    // a directory is just its header
+    slot->data_len = 0;
+    slot->hash = 0;
+    slot->large = slot->size > PIPELINE_BUF_SIZE || slot->sparse.count > 0;
+    if (slot->large) {  // leave it to the writer, there's no point holding gigabytes in memory
+        int status = link_content_hash(fd, stat_buf, &slot->hash);
+        close(fd);
+        return status;
+    }
+
+    size_t size = slot->size;
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, slot->data + total, size - total);
+        if (n == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read file %s in write_members_parallel", name);
+            perror(err_msg);
+            close(fd);
+            return -1;
+        }
+        if (n == 0) {   // file shrank since fstat, the rest is zero filled like copy_member_body does
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+
+    // Zero fill the rest of the last block
+    slot->data_len = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    memset(slot->data + total, 0, slot->data_len - total);
+    if (link_wants_hash(stat_buf)) {    // the same hash link_content_hash gets from the file
+        content_hash_t state;
+        content_hash_init(&state);
+        content_hash_update(&state, slot->data, size);
+        slot->hash = content_hash_digest(&state);
+    }
+    stats_phase_end(PHASE_DATA, start);
+    return 0;
+}
+
+static void *pipeline_worker(void *arg) {
+    pipeline_t *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->failed && p->next_file < p->num_files) {
+        long index = p->next_file++;
+        pipeline_slot_t *slot = &p->slots[index % p->num_slots];
+        while (!p->failed && (slot->index != index || slot->ready)) {  // wait until the writer is done with the slot
+            pthread_cond_wait(&p->slot_free, &p->lock);
+        }
+        if (p->failed) {
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        int status = read_member(slot, p->names[index]);
+
+        pthread_mutex_lock(&p->lock);
+        slot->status = status;
+        slot->ready = 1;
+        pthread_cond_broadcast(&p->slot_ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * Copy the contents of a member that was too big for a pooled buffer into the archive
+ * with the copy engine, using the size the worker put in its header, or only the
+ * extents in 'sparse' if it's a sparse member
+ * Returns 0 on success, -1 on error
+ */
+static int stream_large_member(int destination, const char *name, off_t size, const sparse_map_t *sparse) {
+    char err_msg[MAX_MSG_LEN];
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in write_members_parallel", name);
+        perror(err_msg);
+        return -1;
+    }
+    int status = sparse->count > 0 ? sparse_write_body(fd, destination, sparse) : copy_member_body(fd, destination, size);
+    if (status != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to copy file %s into archive in write_members_parallel", name);
+        perror(err_msg);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Writer side of the pipeline: emit members strictly in list order as workers finish them
+ * Returns 0 on success, -1 on error
+ */
+static int write_members(pipeline_t *p, int destination) {
+    for (long index = 0; index < p->num_files; index++) {
+        pipeline_slot_t *slot = &p->slots[index % p->num_slots];
+
+        pthread_mutex_lock(&p->lock);
+        while (!slot->ready) {
+            pthread_cond_wait(&p->slot_ready, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        if (slot->status != 0) {
+            return -1;
+        }
+        uint64_t start = stats_phase_begin();
+        // A link replaces the header the worker built, its data (if it was read) is dropped
+        member_header_t link_header;
+        int linked = link_member_header(p->links, &link_header, p->names[index], &slot->stat_buf, slot->hash);
+        if (linked == -1) {
+            return -1;
+        }
+        if (linked) {
+            member_header_free(&slot->header);
+            slot->header = link_header;
+            sparse_map_free(&slot->sparse);
+            slot->size = 0;
+            slot->data_len = 0;
+            slot->large = 0;
+        }
+        off_t header_len = slot->header.pax_len + BLOCK_SIZE;
+        int status = write_member_header(destination, &slot->header);
+        member_header_free(&slot->header);
+        if (status != 0) {
+            perror("Failed to write the header into archive in function write_members_parallel");
+            return -1;
+        }
+        if (slot->sparse.count > 0) {
+            slot->size = sparse_member_size(&slot->sparse);    // what the header says is stored
+        }
+        if (slot->large) {
+            status = stream_large_member(destination, p->names[index], slot->size, &slot->sparse);
+            sparse_map_free(&slot->sparse);
+            if (status != 0) {
+                return -1;
+            }
+        } else if (write_all(destination, slot->data, slot->data_len) != 0) {
+            perror("Failed to write the buffer into archive in function write_members_parallel");
+            return -1;
+        }
+        stats_phase_end(PHASE_DATA, start);
+        stats_count(STAT_FILES, 1);
+        stats_count(STAT_DATA_BYTES, slot->size);
+        stats_count(STAT_BLOCKS, (header_len + slot->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+        // Hand the slot to whichever worker picks up the member num_slots places further on
+        pthread_mutex_lock(&p->lock);
+        slot->ready = 0;
+        slot->index = index + p->num_slots;
+        pthread_cond_broadcast(&p->slot_free);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return 0;
+}
+
+int write_members_parallel(int destination, const file_list_t *files, int num_threads, link_table_t *links) {
+    pipeline_t p;
+    memset(&p, 0, sizeof(pipeline_t));
+    p.links = links;
+    p.num_files = files->size;
+    p.num_slots = num_threads * PIPELINE_SLOTS_PER_THREAD;
+    if (p.num_slots > p.num_files) {
+        p.num_slots = p.num_files > 0 ? p.num_files : 1;
+    }
+    if (num_threads > p.num_files) {
+        num_threads = p.num_files > 0 ? p.num_files : 1;
+    }
+
+    p.names = malloc(sizeof(char *) * (p.num_files > 0 ? p.num_files : 1));
+    p.slots = calloc(p.num_slots, sizeof(pipeline_slot_t));
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    if (p.names == NULL || p.slots == NULL || threads == NULL) {
+        perror("Failed to allocate pipeline in write_members_parallel");
+        free(p.names);
+        free(p.slots);
+        free(threads);
+        return -1;
+    }
+
+    long i = 0;
+    for (node_t *current = files->head; current != NULL; current = current->next) {
+        p.names[i++] = current->name;
+    }
+    int ret = 0;
+    for (i = 0; i < p.num_slots; i++) {
+        p.slots[i].index = i;
+        p.slots[i].data = malloc(PIPELINE_BUF_SIZE);
+        if (p.slots[i].data == NULL) {
+            perror("Failed to allocate pipeline buffer in write_members_parallel");
+            ret = -1;
+        }
+    }
+
+    int started = 0;
+    if (ret == 0) {
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.slot_ready, NULL);
+        pthread_cond_init(&p.slot_free, NULL);
+        for (; started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, pipeline_worker, &p) != 0) {
+                perror("Failed to start worker thread in write_members_parallel");
+                ret = -1;
+                break;
+            }
+        }
+        // If not even one worker came up there's nobody to fill the slots
+        if (ret == 0 || started > 0) {
+            if (write_members(&p, destination) != 0) {
+                ret = -1;
+            }
+        }
+
+        // Wake up any workers still waiting for a slot so they can exit
+        pthread_mutex_lock(&p.lock);
+        p.failed = 1;
+        pthread_cond_broadcast(&p.slot_free);
+        pthread_mutex_unlock(&p.lock);
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        pthread_mutex_destroy(&p.lock);
+        pthread_cond_destroy(&p.slot_ready);
+        pthread_cond_destroy(&p.slot_free);
+    }
+
+    for (i = 0; i < p.num_slots; i++) {
+        free(p.slots[i].data);
+        member_header_free(&p.slots[i].header);     // members built but never written after an error
+        sparse_map_free(&p.slots[i].sparse);
+    }
+    free(p.slots);
+    free(p.names);
+    free(threads);
+    return ret;
+}
+
+// Shared by the threads of run_jobs_parallel
+typedef struct {
+    parallel_job_fn job;
+    void *ctx;
+    long num_jobs;
+    long next_job;      // claimed with an atomic increment
+    int failed;
+} job_pool_t;
+
+static void *job_worker(void *arg) {
+    job_pool_t *pool = arg;
+    while (!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED)) {
+        long index = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED);
+        if (index >= pool->num_jobs) {
+            break;
+        }
+        if (pool->job(pool->ctx, index) != 0) {
+            __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int run_jobs_parallel(int num_threads, long num_jobs, parallel_job_fn job, void *ctx) {
+    job_pool_t pool = {job, ctx, num_jobs, 0, 0};
+    if (num_threads > num_jobs) {
+        num_threads = num_jobs > 0 ? num_jobs : 1;
+    }
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    if (threads == NULL) {
+        perror("Failed to allocate worker threads");
+        return -1;
+    }
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, job_worker, &pool) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {     // couldn't get any threads, do the work here instead
+        job_worker(&pool);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    return pool.failed ? -1 : 0;
+}
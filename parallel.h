@@ -0,0 +1,35 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+#include "file_list.h"
+#include "links.h"
+
+// Members up to this many bytes are read into a pooled buffer by a worker thread.
+// Anything bigger is streamed by the writer thread itself when its turn comes.
+#define PIPELINE_BUF_SIZE (1 << 20)
+
+// Number of pooled buffers per worker thread, i.e. how far readers may run ahead of the writer
+#define PIPELINE_SLOTS_PER_THREAD 4
+
+/*
+ * Parallel member writer behind create_archive.
+ * 'num_threads' workers stat each file, build its header and read its contents
+ * into a pooled buffer, while the calling thread writes the finished members
+ * to 'destination' in the same order as 'files'. The output is byte for byte
+ * identical to what the serial path produces. Hard links are decided by the writer against
+ * 'links', in archive order. The footer is left to the caller.
+ * This function should return 0 upon success or -1 if an error occurred
+ */
+int write_members_parallel(int destination, const file_list_t *files, int num_threads, link_table_t *links);
+
+// Work function for run_jobs_parallel: handle job number 'index', return 0 on success or -1 on error
+typedef int (*parallel_job_fn)(void *ctx, long index);
+
+/*
+ * Run 'job' for every index from 0 to 'num_jobs' - 1 on 'num_threads' threads.
+ * Threads claim the next unclaimed index, so jobs start roughly in index order but
+ * finish in any order. After the first failure no new jobs are started.
+ * This function should return 0 if every job succeeded or -1 otherwise
+ */
+int run_jobs_parallel(int num_threads, long num_jobs, parallel_job_fn job, void *ctx);
+
+#endif
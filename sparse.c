@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "hash.h"
+#include "minitar.h"
+#include "sparse.h"
+
+void sparse_map_init(sparse_map_t *map) {
+    memset(map, 0, sizeof(sparse_map_t));
+}
+
+void sparse_map_free(sparse_map_t *map) {
+    free(map->extents);
+    sparse_map_init(map);
+}
+
+/*
+ * Appends the extent 'offset', 'length' to 'map'
+ * Returns 0 on success, -1 if out of memory
+ */
+static int add_extent(sparse_map_t *map, off_t offset, off_t length) {
+    if (map->count == map->cap) {
+        int cap = map->cap ? map->cap * 2 : 16;
+        sparse_extent_t *extents = realloc(map->extents, cap * sizeof(sparse_extent_t));
+        if (extents == NULL) {
+            perror("Failed to allocate sparse map");
+            return -1;
+        }
+        map->extents = extents;
+        map->cap = cap;
+    }
+    map->extents[map->count].offset = offset;
+    map->extents[map->count].length = length;
+    map->count++;
+    map->data_size += length;
+    return 0;
+}
+
+int sparse_map_build(int fd, const struct stat *stat_buf, sparse_map_t *map) {
+    sparse_map_init(map);
+    if (!S_ISREG(stat_buf->st_mode) || (off_t)stat_buf->st_blocks * 512 >= stat_buf->st_size) {
+        return 0;   // every byte has a block behind it, nothing to gain
+    }
+    map->real_size = stat_buf->st_size;
+    off_t pos = 0;
+    int ret = 1;
+    while (pos < map->real_size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) {     // only a hole left
+            break;
+        }
+        off_t hole = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {   // e.g. EINVAL: the file system doesn't report holes, store it whole
+            ret = 0;
+            break;
+        }
+        if (hole > map->real_size) {    // the file grew since fstat, stick to the size in the header
+            hole = map->real_size;
+        }
+        if (hole > data && add_extent(map, data, hole - data) != 0) {
+            ret = -1;
+            break;
+        }
+        pos = hole;
+    }
+    if (ret == 1 && map->data_size == map->real_size) {
+        ret = 0;    // blocks were missing for some other reason (compression, inline data)
+    }
+    // A trailing hole is marked with an empty extent at the end, as GNU tar does, so readers extend the file
+    if (ret == 1 && (map->count == 0 || map->extents[map->count - 1].offset + map->extents[map->count - 1].length
+                                        < map->real_size)) {
+        ret = add_extent(map, map->real_size, 0) == 0 ? 1 : -1;
+    }
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        perror("Failed to rewind file after looking for holes");
+        ret = -1;
+    }
+    if (ret != 1) {
+        sparse_map_free(map);
+    }
+    return ret;
+}
+
+/*
+ * Formats the map text of 'map' into a new buffer, zero padded to whole blocks
+ * Returns the buffer (its length in '*len'), or NULL if out of memory
+ */
+static char *format_map(const sparse_map_t *map, size_t *len) {
+    size_t cap = 32 + (size_t)map->count * 42;  // two 20-digit numbers and their newlines per extent
+    char *text = malloc(cap);
+    if (text == NULL) {
+        perror("Failed to allocate sparse map");
+        return NULL;
+    }
+    size_t used = snprintf(text, cap, "%d\n", map->count);
+    for (int i = 0; i < map->count; i++) {
+        used += snprintf(text + used, cap - used, "%lld\n%lld\n", (long long)map->extents[i].offset,
+                         (long long)map->extents[i].length);
+    }
+    size_t padded = (used + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    char *block_text = realloc(text, padded);
+    if (block_text == NULL) {
+        perror("Failed to allocate sparse map");
+        free(text);
+        return NULL;
+    }
+    memset(block_text + used, 0, padded - used);
+    *len = padded;
+    return block_text;
+}
+
+off_t sparse_member_size(const sparse_map_t *map) {
+    size_t len = snprintf(NULL, 0, "%d\n", map->count);
+    for (int i = 0; i < map->count; i++) {
+        len += snprintf(NULL, 0, "%lld\n%lld\n", (long long)map->extents[i].offset, (long long)map->extents[i].length);
+    }
+    return (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE + map->data_size;
+}
+
+int sparse_write_body(int src_fd, int dst_fd, const sparse_map_t *map) {
+    size_t len;
+    char *text = format_map(map, &len);
+    if (text == NULL) {
+        return -1;
+    }
+    int ret = write_all(dst_fd, text, len);
+    free(text);
+    for (int i = 0; ret == 0 && i < map->count; i++) {
+        const sparse_extent_t *extent = &map->extents[i];
+        off_t copied = copy_fd_data_at(src_fd, extent->offset, dst_fd, extent->length);
+        if (copied == -1) {
+            ret = -1;
+        } else if (copied < extent->length) {   // the file shrank since its holes were mapped
+            ret = write_zeros(dst_fd, extent->length - copied);
+        }
+    }
+    if (ret == 0) {
+        ret = write_block_padding(dst_fd, map->data_size);
+    }
+    return ret;
+}
+
+int sparse_write_body_fn(int src_fd, archive_write_fn write_fn, void *ctx, const sparse_map_t *map) {
+    size_t len;
+    char *text = format_map(map, &len);
+    if (text == NULL) {
+        return -1;
+    }
+    int ret = write_fn(ctx, text, len);
+    free(text);
+    char *buf = ret == 0 ? malloc(SPARSE_BUF_SIZE) : NULL;
+    if (ret == 0 && buf == NULL) {
+        perror("Failed to allocate sparse buffer");
+        return -1;
+    }
+    for (int i = 0; ret == 0 && i < map->count; i++) {
+        const sparse_extent_t *extent = &map->extents[i];
+        off_t done = 0;
+        while (ret == 0 && done < extent->length) {
+            size_t want = extent->length - done > SPARSE_BUF_SIZE ? SPARSE_BUF_SIZE : extent->length - done;
+            ssize_t n = pread(src_fd, buf, want, extent->offset + done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {   // the file shrank since its holes were mapped
+                memset(buf, 0, want);
+                n = want;
+            }
+            ret = n == -1 ? -1 : write_fn(ctx, buf, n);
+            done += n;
+        }
+    }
+    size_t remainder = map->data_size % BLOCK_SIZE;
+    if (ret == 0 && remainder != 0) {
+        memset(buf, 0, BLOCK_SIZE - remainder);
+        ret = write_fn(ctx, buf, BLOCK_SIZE - remainder);
+    }
+    free(buf);
+    return ret;
+}
+
+// Reads the decimal lines of a sparse map one block at a time
+typedef struct {
+    archive_pread_fn read_fn;
+    void *ctx;
+    off_t pos;          // archive offset of the next block to read
+    off_t end;          // end of the member data
+    char block[BLOCK_SIZE];
+    size_t len;         // bytes of 'block' that are valid
+    size_t at;          // next byte of 'block' to parse
+} map_reader_t;
+
+/*
+ * Parses the next "NUMBER\n" line of the map into '*value'
+ * Returns 0 on success, -1 if the map is malformed or couldn't be read
+ */
+static int map_number(map_reader_t *reader, long long *value) {
+    long long result = 0;
+    int digits = 0;
+    while (1) {
+        if (reader->at == reader->len) {
+            if (reader->pos >= reader->end) {
+                return -1;
+            }
+            ssize_t n = reader->read_fn(reader->ctx, reader->block, BLOCK_SIZE, reader->pos);
+            if (n != BLOCK_SIZE) {
+                return -1;
+            }
+            reader->pos += BLOCK_SIZE;
+            reader->len = BLOCK_SIZE;
+            reader->at = 0;
+        }
+        char c = reader->block[reader->at++];
+        if (c == '\n' && digits > 0) {
+            *value = result;
+            return 0;
+        }
+        if (c < '0' || c > '9' || ++digits > 18) {  // 18 digits can't overflow
+            return -1;
+        }
+        result = result * 10 + (c - '0');
+    }
+}
+
+int sparse_map_read(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size,
+                    sparse_map_t *map, off_t *extents_offset) {
+    sparse_map_init(map);
+    map->real_size = real_size;
+    map_reader_t reader = {read_fn, ctx, data_offset, data_offset + size, {0}, 0, 0};
+    long long count;
+    if (map_number(&reader, &count) != 0 || count < 0 || count > size) {    // every entry takes at least 4 bytes
+        printf("Error: malformed sparse map at offset %lld\n", (long long)data_offset);
+        return -1;
+    }
+    off_t file_end = 0;
+    for (long long i = 0; i < count; i++) {
+        long long offset;
+        long long length;
+        if (map_number(&reader, &offset) != 0 || map_number(&reader, &length) != 0 || offset < file_end
+            || length > real_size - offset) {
+            printf("Error: malformed sparse map at offset %lld\n", (long long)data_offset);
+            sparse_map_free(map);
+            return -1;
+        }
+        if (add_extent(map, offset, length) != 0) {
+            sparse_map_free(map);
+            return -1;
+        }
+        file_end = offset + length;
+    }
+    *extents_offset = reader.pos;   // the map ends with the block it was read from
+    if (*extents_offset + map->data_size > data_offset + size) {
+        printf("Error: sparse map at offset %lld describes more data than the member holds\n", (long long)data_offset);
+        sparse_map_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+// Called by expand with each piece of an extent and where it goes in the file
+typedef int (*sparse_sink_fn)(void *ctx, const char *buf, size_t len, off_t file_offset);
+
+/*
+ * Reads the map of a sparse member, then feeds the contents of its extents to 'sink' in file order.
+ * Holes are left to the sink
+ * Returns 0 on success, -1 on error
+ */
+static int expand(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size,
+                  sparse_sink_fn sink, void *sink_ctx) {
+    sparse_map_t map;
+    off_t pos;
+    if (sparse_map_read(read_fn, ctx, data_offset, size, real_size, &map, &pos) != 0) {
+        return -1;
+    }
+    char *buffer = malloc(SPARSE_BUF_SIZE);
+    if (buffer == NULL) {
+        perror("Failed to allocate buffer for sparse member");
+        sparse_map_free(&map);
+        return -1;
+    }
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < map.count; i++) {
+        off_t done = 0;
+        while (ret == 0 && done < map.extents[i].length) {
+            size_t chunk = map.extents[i].length - done > SPARSE_BUF_SIZE ? SPARSE_BUF_SIZE : map.extents[i].length - done;
+            ssize_t n = read_fn(ctx, buffer, chunk, pos);
+            if (n <= 0) {
+                printf("Error: archive ends in the middle of a sparse member\n");
+                ret = -1;
+                break;
+            }
+            ret = sink(sink_ctx, buffer, n, map.extents[i].offset + done);
+            pos += n;
+            done += n;
+        }
+    }
+    free(buffer);
+    sparse_map_free(&map);
+    return ret;
+}
+
+static int write_sink(void *ctx, const char *buf, size_t len, off_t file_offset) {
+    int fd = *(int *)ctx;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, file_offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        file_offset += n;
+    }
+    return 0;
+}
+
+int sparse_extract(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size, int out_fd) {
+    if (expand(read_fn, ctx, data_offset, size, real_size, write_sink, &out_fd) != 0) {
+        return -1;
+    }
+    return ftruncate(out_fd, real_size);    // a trailing hole, nothing is written for it
+}
+
+// Hashing state for sparse_hash: holes have to be fed in as zeros
+typedef struct {
+    content_hash_t hash;
+    off_t pos;      // how much of the file has been hashed
+} hash_sink_t;
+
+static void hash_zeros(hash_sink_t *state, off_t until) {
+    static const char zeros[BLOCK_SIZE * 8];
+    while (state->pos < until) {
+        size_t chunk = until - state->pos > (off_t)sizeof(zeros) ? sizeof(zeros) : until - state->pos;
+        content_hash_update(&state->hash, zeros, chunk);
+        state->pos += chunk;
+    }
+}
+
+static int hash_sink(void *ctx, const char *buf, size_t len, off_t file_offset) {
+    hash_sink_t *state = ctx;
+    hash_zeros(state, file_offset);
+    content_hash_update(&state->hash, buf, len);
+    state->pos += len;
+    return 0;
+}
+
+int sparse_hash(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size, uint64_t *out) {
+    hash_sink_t state;
+    content_hash_init(&state.hash);
+    state.pos = 0;
+    if (expand(read_fn, ctx, data_offset, size, real_size, hash_sink, &state) != 0) {
+        return -1;
+    }
+    hash_zeros(&state, real_size);
+    *out = content_hash_digest(&state.hash);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef _SPARSE_H
+#define _SPARSE_H
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "archive_io.h"
+#include "minitar.h"
+
+/*
+ * Files with holes (--sparse) are stored in the GNU PAX sparse format 1.0, which GNU tar
+ * and libarchive read as well. The ustar header is named "DIR/GNUSparseFile.0/BASE";
+ * the PAX records GNU.sparse.major=1, GNU.sparse.minor=0, GNU.sparse.name and
+ * GNU.sparse.realsize give the real name and size of the file. The member data starts
+ * with the map of data extents as decimal text, "COUNT\n" and then "OFFSET\nLENGTH\n"
+ * per extent, padded to whole blocks, followed by the contents of the extents back to
+ * back. Only the extents are read on create and written on extract.
+ */
+
+// Bytes of member data read or written at a time when moving extents around
+#define SPARSE_BUF_SIZE (1 << 20)
+
+void sparse_map_init(sparse_map_t *map);
+
+void sparse_map_free(sparse_map_t *map);
+
+/*
+ * Find the data extents of the regular file open at 'fd' with SEEK_DATA/SEEK_HOLE.
+ * A file whose allocated blocks cover its whole size is taken as not sparse without
+ * seeking at all. The file offset is back at 0 when this returns.
+ * Returns 1 if the file has holes and 'map' now describes it, 0 if it should be stored
+ * as a plain member (no holes, or the file system can't tell), -1 on error
+ */
+int sparse_map_build(int fd, const struct stat *stat_buf, sparse_map_t *map);
+
+// Length of the member data for 'map': the map text padded to whole blocks, then the extents
+off_t sparse_member_size(const sparse_map_t *map);
+
+/*
+ * Write the member data for 'map' to 'dst_fd': the map, each extent read from 'src_fd',
+ * then the padding of the last block. An extent the file no longer has is zero filled,
+ * so the archive always matches the size in the header.
+ * Returns 0 on success, -1 on error
+ */
+int sparse_write_body(int src_fd, int dst_fd, const sparse_map_t *map);
+
+/*
+ * Same as sparse_write_body, for a sink without a descriptor: the member data goes to
+ * 'write_fn' through a buffer instead of the copy engine.
+ * Returns 0 on success, -1 on error
+ */
+int sparse_write_body_fn(int src_fd, archive_write_fn write_fn, void *ctx, const sparse_map_t *map);
+
+/*
+ * Read the map of the sparse member whose 'size' bytes of data start at 'data_offset'
+ * through 'read_fn', for a file of 'real_size' bytes. '*extents_offset' is set to where
+ * the contents of the first extent start.
+ * Returns 0 on success, -1 if the map is malformed or couldn't be read
+ */
+int sparse_map_read(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size,
+                    sparse_map_t *map, off_t *extents_offset);
+
+/*
+ * Recreate the sparse member whose data starts at 'data_offset' in the empty file open at
+ * 'out_fd': the extents are written where they belong and the file is extended to
+ * 'real_size' with ftruncate, so the holes stay holes.
+ * Returns 0 on success, -1 on error
+ */
+int sparse_extract(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size, int out_fd);
+
+/*
+ * Hash the file a sparse member unpacks to, holes as zeros, the same way content_hash_fd
+ * hashes a file on disk
+ * Returns 0 on success (hash in '*out'), -1 on error
+ */
+int sparse_hash(archive_pread_fn read_fn, void *ctx, off_t data_offset, off_t size, off_t real_size, uint64_t *out);
+
+#endif
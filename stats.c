@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "minitar.h"
+#include "stats.h"
+
+static const char *phase_names[NUM_PHASES] = {"scan", "header", "data", "footer"};
+
+static uint64_t run_start;
+static uint64_t phase_ns[NUM_PHASES];
+static uint64_t counters[NUM_STAT_COUNTERS];
+
+// What the kernel counted for the whole process, read from /proc/self/io
+typedef struct {
+    unsigned long long rchar;   // bytes passed to read-like calls, page cache hits included
+    unsigned long long wchar;
+    unsigned long long syscr;   // read-like system calls
+    unsigned long long syscw;   // write-like system calls
+} proc_io_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_start(void) {
+    run_start = now_ns();
+}
+
+uint64_t stats_phase_begin(void) {
+    return minitar_opts.stats != STATS_OFF ? now_ns() : 0;
+}
+
+void stats_phase_end(stats_phase_t phase, uint64_t start) {
+    if (start != 0) {
+        __atomic_fetch_add(&phase_ns[phase], now_ns() - start, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_count(stats_counter_t counter, uint64_t n) {
+    if (minitar_opts.stats != STATS_OFF) {
+        __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Fill 'io' from /proc/self/io
+ * Returns 0 on success, -1 if it isn't available (no procfs, or an old kernel)
+ */
+static int read_proc_io(proc_io_t *io) {
+    memset(io, 0, sizeof(proc_io_t));
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char key[32];
+    unsigned long long value;
+    while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) {
+            io->rchar = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            io->wchar = value;
+        } else if (strcmp(key, "syscr") == 0) {
+            io->syscr = value;
+        } else if (strcmp(key, "syscw") == 0) {
+            io->syscw = value;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+void stats_report(FILE *out, const char *operation) {
+    double wall = (now_ns() - run_start) / 1e9;
+    double phases[NUM_PHASES];
+    for (int i = 0; i < NUM_PHASES; i++) {
+        phases[i] = __atomic_load_n(&phase_ns[i], __ATOMIC_RELAXED) / 1e9;
+    }
+    uint64_t c[NUM_STAT_COUNTERS];
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        c[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+    proc_io_t io;
+    int have_io = read_proc_io(&io) == 0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double mb_per_s = wall > 0 ? c[STAT_DATA_BYTES] / wall / 1e6 : 0;
+    double files_per_s = wall > 0 ? c[STAT_FILES] / wall : 0;
+
+    if (minitar_opts.stats == STATS_JSON) {
+        fprintf(out, "{\"operation\":\"%s\",\"threads\":%d,\"wall_s\":%.6f,\"phases_s\":{", operation,
+                minitar_opts.num_threads, wall);
+        for (int i = 0; i < NUM_PHASES; i++) {
+            fprintf(out, "%s\"%s\":%.6f", i ? "," : "", phase_names[i], phases[i]);
+        }
+        fprintf(out, "},\"files\":%llu,\"data_bytes\":%llu,\"blocks\":%llu,\"mb_per_s\":%.2f,\"files_per_s\":%.1f,",
+                (unsigned long long)c[STAT_FILES], (unsigned long long)c[STAT_DATA_BYTES],
+                (unsigned long long)c[STAT_BLOCKS], mb_per_s, files_per_s);
+        fprintf(out, "\"owner_cache_hits\":%llu,\"owner_cache_misses\":%llu,", (unsigned long long)c[STAT_OWNER_HITS],
+                (unsigned long long)c[STAT_OWNER_MISSES]);
+        if (have_io) {
+            fprintf(out, "\"read_syscalls\":%llu,\"write_syscalls\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,",
+                    io.syscr, io.syscw, io.rchar, io.wchar);
+        }
+        fprintf(out, "\"peak_rss_kb\":%ld}\n", usage.ru_maxrss);
+        return;
+    }
+
+    fprintf(out, "%s: %.3f s wall, %d thread(s)\n", operation, wall, minitar_opts.num_threads);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(out, "  %-8s %10.3f ms\n", phase_names[i], phases[i] * 1e3);
+    }
+    fprintf(out, "  files %llu, data %llu bytes, %llu blocks\n", (unsigned long long)c[STAT_FILES],
+            (unsigned long long)c[STAT_DATA_BYTES], (unsigned long long)c[STAT_BLOCKS]);
+    fprintf(out, "  throughput %.1f MB/s, %.1f files/s\n", mb_per_s, files_per_s);
+    uint64_t lookups = c[STAT_OWNER_HITS] + c[STAT_OWNER_MISSES];
+    fprintf(out, "  owner name cache %llu hits, %llu misses (%.1f%% hit rate)\n", (unsigned long long)c[STAT_OWNER_HITS],
+            (unsigned long long)c[STAT_OWNER_MISSES], lookups ? 100.0 * c[STAT_OWNER_HITS] / lookups : 0.0);
+    if (have_io) {
+        fprintf(out, "  syscalls %llu read, %llu write; %llu bytes read, %llu written\n", io.syscr, io.syscw,
+                io.rchar, io.wchar);
+    }
+    fprintf(out, "  peak RSS %ld KiB\n", usage.ru_maxrss);
+}
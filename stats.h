@@ -0,0 +1,55 @@
+#ifndef _STATS_H
+#define _STATS_H
+#include <stdint.h>
+#include <stdio.h>
+
+// Values of minitar_opts.stats
+#define STATS_OFF 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/*
+ * Where an operation spends its time. Worker threads add their own time, so with -j
+ * the phases can add up to more than the wall time of the run.
+ */
+typedef enum {
+    PHASE_SCAN,     // walking directories, reading archive headers, loading the index
+    PHASE_HEADER,   // opening and stat-ing member files and building their headers
+    PHASE_DATA,     // moving member data into or out of the archive, (de)compression
+    PHASE_FOOTER,   // end-of-archive marker, committing an append, writing the sidecar index
+    NUM_PHASES
+} stats_phase_t;
+
+typedef enum {
+    STAT_FILES,             // members written, extracted, listed or checked
+    STAT_DATA_BYTES,        // member data moved
+    STAT_BLOCKS,            // 512-byte archive blocks written or read: headers, data, padding and footer
+    STAT_OWNER_HITS,        // owner and group name lookups answered by the cache
+    STAT_OWNER_MISSES,      // lookups that went to the system (passwd/group, possibly over NSS)
+    NUM_STAT_COUNTERS
+} stats_counter_t;
+
+// Mark the start of the run, so the report can give the wall time
+void stats_start(void);
+
+/*
+ * Current time in nanoseconds, to pass to stats_phase_end later.
+ * Returns 0 without reading the clock when --stats is off
+ */
+uint64_t stats_phase_begin(void);
+
+// Charge the time since 'start' (from stats_phase_begin) to 'phase'
+void stats_phase_end(stats_phase_t phase, uint64_t start);
+
+// Add 'n' to 'counter'. Safe to call from any thread
+void stats_count(stats_counter_t counter, uint64_t n);
+
+/*
+ * Print everything collected for 'operation' to 'out': wall time, time per phase, files,
+ * bytes, blocks, throughput, owner cache use, and the number of read and write system
+ * calls and bytes the kernel accounted to the process (/proc/self/io). With STATS_JSON
+ * the report is a single JSON object on one line
+ */
+void stats_report(FILE *out, const char *operation);
+
+#endif
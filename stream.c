@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "stream.h"
+
+// Most bytes moved by one splice call
+#define STREAM_SPLICE_MAX (1 << 30)
+
+int stream_reader_init(stream_reader_t *reader, int fd) {
+    memset(reader, 0, sizeof(stream_reader_t));
+    reader->fd = fd;
+    struct stat stat_buf;
+    reader->seekable = fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+    reader->splice_ok = !reader->seekable;
+    int status = posix_memalign((void **)&reader->buf, DIRECT_ALIGN, STREAM_BUF_SIZE);
+    if (status != 0) {
+        reader->buf = NULL;
+        errno = status;
+        perror("Failed to allocate stream buffer");
+        return -1;
+    }
+    return 0;
+}
+
+int stream_reader_bypass_cache(stream_reader_t *reader) {
+    int flags = fcntl(reader->fd, F_GETFL);
+    if (flags != -1 && fcntl(reader->fd, F_SETFL, flags | O_DIRECT) == 0) {
+        reader->cache = CACHE_DIRECT;
+    } else {
+        reader->cache = CACHE_DROP;
+        posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);     // larger readahead, best effort
+    }
+    return reader->cache;
+}
+
+void stream_reader_free(stream_reader_t *reader) {
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+/*
+ * Move past the next 'len' bytes of the stream that never went into the window
+ * Returns 0 on success (also if the stream ends first, reads will then come back empty), -1 on error
+ */
+static int skip(stream_reader_t *reader, off_t len) {
+    if (len > 0 && reader->seekable && lseek(reader->fd, len, SEEK_CUR) != -1) {
+        return 0;
+    }
+    while (len > 0 && !reader->eof) {
+        ssize_t n = read(reader->fd, reader->buf, len > STREAM_BUF_SIZE ? STREAM_BUF_SIZE : len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read archive stream");
+            return -1;
+        }
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Make the window start at or before 'offset' and hold at least 'want' bytes from it
+ * (fewer only at the end of the stream). Bytes before 'offset' that the window has to
+ * give up are gone for good. With O_DIRECT the window always starts on an aligned offset,
+ * so it keeps the part of the block 'offset' is in that comes before it.
+ * Returns a pointer to 'offset' inside the window with the number of bytes available
+ * from there in '*avail', or NULL on error
+ */
+static const char *window_at(stream_reader_t *reader, off_t offset, size_t want, size_t *avail) {
+    if (offset < reader->start) {
+        errno = ESPIPE;
+        return NULL;
+    }
+    off_t keep = reader->cache == CACHE_DIRECT ? offset & ~(off_t)(DIRECT_ALIGN - 1) : offset;
+    size_t lead = offset - keep;
+    if (want > STREAM_BUF_SIZE - lead) {
+        want = STREAM_BUF_SIZE - lead;
+    }
+    off_t end = reader->start + reader->len;
+    if (offset + (off_t)want > end) {
+        if (keep >= end) {      // nothing in the window is wanted any more, nor what comes before 'keep'
+            if (skip(reader, keep - end) != 0) {
+                return NULL;
+            }
+            reader->len = 0;
+        } else {                // keep the part from 'keep' on, at the front
+            reader->len = end - keep;
+            memmove(reader->buf, reader->buf + (keep - reader->start), reader->len);
+        }
+        reader->start = keep;
+        if (reader->cache == CACHE_DROP && keep > reader->cached_from) {    // pages behind the window are done with
+            // Only whole folios are dropped and they can be large, so start well before a partial one left last time
+            off_t from = reader->cached_from & ~(off_t)(STREAM_BUF_SIZE - 1);
+            posix_fadvise(reader->fd, from, keep - from, POSIX_FADV_DONTNEED);
+            reader->cached_from = keep;
+        }
+        while (reader->len < lead + want && !reader->eof) {
+            size_t room = STREAM_BUF_SIZE - reader->len;
+            ssize_t n = read(reader->fd, reader->buf + reader->len, room);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Failed to read archive stream");
+                return NULL;
+            }
+            // A short O_DIRECT read is the end of the file, the next one would start unaligned
+            if (n == 0 || (reader->cache == CACHE_DIRECT && (size_t)n < room)) {
+                reader->eof = 1;
+            }
+            reader->len += n;
+        }
+    }
+    *avail = reader->start + reader->len - offset;
+    return reader->buf + (offset - reader->start);
+}
+
+ssize_t stream_pread(void *arg, void *buf, size_t len, off_t offset) {
+    stream_reader_t *reader = arg;
+    size_t avail;
+    const char *data = window_at(reader, offset, len, &avail);
+    if (data == NULL) {
+        return -1;
+    }
+    size_t n = avail < len ? avail : len;
+    memcpy(buf, data, n);
+    return n;
+}
+
+int stream_copy(stream_reader_t *reader, off_t offset, off_t len, int out_fd) {
+    while (len > 0) {
+        // Once the window has been written out, the rest can go from the pipe to the file inside the kernel
+        if (reader->splice_ok && offset == reader->start + (off_t)reader->len) {
+            ssize_t n = splice(reader->fd, NULL, out_fd, NULL, len > STREAM_SPLICE_MAX ? STREAM_SPLICE_MAX : len,
+                               SPLICE_F_MOVE);
+            if (n > 0) {
+                reader->start = offset + n;
+                reader->len = 0;
+                offset += n;
+                len -= n;
+                continue;
+            }
+            if (n == -1 && errno != EINVAL && errno != ENOSYS) {
+                perror("Failed to splice member data from archive stream");
+                return -1;
+            }
+            reader->splice_ok = 0;  // e.g. the output file system can't take spliced pages, or the stream ended
+        }
+        size_t avail;
+        const char *data = window_at(reader, offset, len, &avail);
+        if (data == NULL) {
+            return -1;
+        }
+        if (avail == 0) {
+            printf("Error: archive stream ends in the middle of a member\n");
+            return -1;
+        }
+        size_t n = (off_t)avail < len ? avail : (size_t)len;
+        if (write_all(out_fd, data, n) != 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Reads up to 'len' bytes at 'offset' of 'file' into 'buf', which has room for the whole
+ * blocks around them and is DIRECT_ALIGN aligned if 'file' is read with O_DIRECT
+ * Returns the number of bytes read from 'offset' on (short only at the end of the file),
+ * with '*data' pointing to them in 'buf', or -1 on error
+ */
+static ssize_t file_read_at(const archive_file_t *file, char *buf, size_t len, off_t offset, const char **data) {
+    off_t from = offset;
+    size_t want = len;
+    if (file->cache == CACHE_DIRECT) {
+        from = offset & ~(off_t)(DIRECT_ALIGN - 1);
+        want = (offset + len - from + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    }
+    size_t need = offset + len - from;
+    size_t done = 0;
+    while (done < need) {
+        ssize_t n = pread(file->fd, buf + done, want - done, from + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("Failed to read archive");
+            return -1;
+        }
+        done += n;
+        // A short O_DIRECT read is the end of the file, the next one would start unaligned
+        if (n == 0 || (file->cache == CACHE_DIRECT && (size_t)n < want - (done - n))) {
+            break;
+        }
+    }
+    if (file->cache == CACHE_DROP && done > 0) {    // best effort, like the reader's window
+        posix_fadvise(file->fd, from, done, POSIX_FADV_DONTNEED);
+    }
+    size_t lead = offset - from;
+    size_t got = done > lead ? done - lead : 0;
+    *data = buf + lead;
+    return got < len ? got : len;
+}
+
+ssize_t archive_file_pread(void *arg, void *buf, size_t len, off_t offset) {
+    const archive_file_t *file = arg;
+    if (file->cache != CACHE_DIRECT) {
+        const char *data;
+        return file_read_at(file, buf, len, offset, &data);
+    }
+    char *bounce;
+    int status = posix_memalign((void **)&bounce, DIRECT_ALIGN, len + 2 * DIRECT_ALIGN);
+    if (status != 0) {
+        errno = status;
+        perror("Failed to allocate archive read buffer");
+        return -1;
+    }
+    const char *data;
+    ssize_t n = file_read_at(file, bounce, len, offset, &data);
+    if (n > 0) {
+        memcpy(buf, data, n);
+    }
+    free(bounce);
+    return n;
+}
+
+int archive_file_copy(const archive_file_t *file, off_t offset, off_t len, int out_fd) {
+    if (file->cache == CACHE_KEEP) {
+        return copy_fd_data_at(file->fd, offset, out_fd, len) == len ? 0 : -1;
+    }
+    size_t piece = len < STREAM_BUF_SIZE ? len : STREAM_BUF_SIZE;
+    char *buf;
+    int status = posix_memalign((void **)&buf, DIRECT_ALIGN, piece + 2 * DIRECT_ALIGN);
+    if (status != 0) {
+        errno = status;
+        perror("Failed to allocate archive read buffer");
+        return -1;
+    }
+    int ret = 0;
+    while (len > 0 && ret == 0) {
+        const char *data;
+        ssize_t n = file_read_at(file, buf, len < (off_t)piece ? len : (off_t)piece, offset, &data);
+        if (n == 0) {
+            printf("Error: archive ends in the middle of a member\n");
+        }
+        ret = n <= 0 ? -1 : write_all(out_fd, data, n);
+        offset += n;
+        len -= n;
+    }
+    free(buf);
+    return ret;
+}
+
+int stream_drain(stream_reader_t *reader) {
+    if (reader->seekable) {     // nobody is waiting on the other end of a file
+        return 0;
+    }
+    while (!reader->eof) {
+        ssize_t n = read(reader->fd, reader->buf, STREAM_BUF_SIZE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read archive stream");
+            return -1;
+        }
+        reader->eof = n == 0;
+    }
+    return 0;
+}
+
+/*
+ * Filler thread: reads the tar stream from the pipe into the buffers in turn. A buffer
+ * is handed to the drainer when it is full, or as soon as the drainer has nothing to do,
+ * so the output never sits idle while there is data
+ */
+static void *fill_thread(void *arg) {
+    stream_writer_t *writer = arg;
+    int cur = 0;
+    while (1) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->full[cur] && !writer->failed) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        int failed = writer->failed;
+        pthread_mutex_unlock(&writer->lock);
+
+        // After a failed write keep reading, so the archive writer doesn't block on a full pipe
+        char *dst = failed ? writer->bufs[cur] : writer->bufs[cur] + writer->lens[cur];
+        size_t room = failed ? STREAM_BUF_SIZE : STREAM_BUF_SIZE - writer->lens[cur];
+        ssize_t n = read(writer->pipe_fds[0], dst, room);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (n <= 0) {
+            if (n == -1) {
+                perror("Failed to read tar stream");
+                writer->failed = 1;
+            }
+            if (writer->lens[cur] > 0 && !writer->failed) {
+                writer->full[cur] = 1;
+            }
+            writer->eof = 1;
+            pthread_cond_broadcast(&writer->changed);
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        if (!failed) {
+            writer->lens[cur] += n;
+            // O_DIRECT takes whole blocks, so there a buffer only goes out unfilled at the end
+            if (writer->lens[cur] == STREAM_BUF_SIZE || (writer->drainer_idle && writer->cache == CACHE_KEEP)) {
+                writer->full[cur] = 1;
+                pthread_cond_broadcast(&writer->changed);
+                cur ^= 1;
+            }
+        }
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+/*
+ * With CACHE_DROP, waits until everything written before 'upto' is on disk and drops it
+ * from the page cache. Best effort, like the fadvise calls of the reader
+ */
+static void drop_written(stream_writer_t *writer, off_t upto) {
+    if (upto > writer->cached_from) {
+        sync_file_range(writer->out_fd, writer->cached_from, upto - writer->cached_from,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(writer->out_fd, writer->cached_from, upto - writer->cached_from, POSIX_FADV_DONTNEED);
+        writer->cached_from = upto;
+    }
+}
+
+/*
+ * Writes one buffer to the output the way its cache mode asks
+ * Returns 0 on success, -1 on error
+ */
+static int drain_write(stream_writer_t *writer, const char *buf, size_t len) {
+    size_t direct_len = writer->cache == CACHE_DIRECT ? len & ~(size_t)(DIRECT_ALIGN - 1) : 0;
+    if (direct_len > 0 && write_all(writer->out_fd, buf, direct_len) != 0) {
+        return -1;
+    }
+    if (direct_len < len && writer->cache == CACHE_DIRECT) {    // the tail of the last buffer isn't a whole block
+        int flags = fcntl(writer->out_fd, F_GETFL);
+        if (flags == -1 || fcntl(writer->out_fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+            return -1;
+        }
+        writer->cache = CACHE_DROP;
+        writer->cached_from = writer->written + direct_len;
+    }
+    if (direct_len < len && write_all(writer->out_fd, buf + direct_len, len - direct_len) != 0) {
+        return -1;
+    }
+    if (writer->cache == CACHE_DROP) {
+        // Start writing this buffer back, the one before it has had all that time to get to disk
+        sync_file_range(writer->out_fd, writer->written, len, SYNC_FILE_RANGE_WRITE);
+        drop_written(writer, writer->written);
+    }
+    writer->written += len;
+    return 0;
+}
+
+// Drainer thread: writes the buffers to the output in the order the filler hands them over
+static void *drain_thread(void *arg) {
+    stream_writer_t *writer = arg;
+    int cur = 0;
+    while (1) {
+        pthread_mutex_lock(&writer->lock);
+        while (!writer->full[cur] && !writer->eof && !writer->failed) {
+            writer->drainer_idle = 1;
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        writer->drainer_idle = 0;
+        if (!writer->full[cur] || writer->failed) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        int status = drain_write(writer, writer->bufs[cur], writer->lens[cur]);
+
+        pthread_mutex_lock(&writer->lock);
+        if (status != 0) {
+            perror("Failed to write archive stream");
+            writer->failed = 1;
+        }
+        writer->full[cur] = 0;
+        writer->lens[cur] = 0;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+        cur ^= 1;
+    }
+    return NULL;
+}
+
+/*
+ * Starts 'writer' on 'out_fd', whose page cache use is set up for 'cache' already
+ * Returns the descriptor to write the tar stream to, or -1 on error
+ */
+static int start_writer(stream_writer_t *writer, int out_fd, int cache) {
+    memset(writer, 0, sizeof(stream_writer_t));
+    writer->out_fd = out_fd;
+    writer->cache = cache;
+    if (pipe(writer->pipe_fds) != 0) {
+        perror("Failed to create pipe for archive stream");
+        return -1;
+    }
+    fcntl(writer->pipe_fds[1], F_SETPIPE_SZ, 1 << 20);  // fewer wakeups, best effort
+    fcntl(out_fd, F_SETPIPE_SZ, 1 << 20);               // same for the pipe we feed, if it is one
+    int status = posix_memalign((void **)&writer->bufs[0], DIRECT_ALIGN, STREAM_BUF_SIZE);
+    if (status == 0) {
+        status = posix_memalign((void **)&writer->bufs[1], DIRECT_ALIGN, STREAM_BUF_SIZE);
+    }
+    if (status != 0) {
+        errno = status;
+        perror("Failed to allocate stream buffers");
+        goto fail;
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->drainer, NULL, drain_thread, writer) != 0) {
+        perror("Failed to start archive stream writer");
+        goto fail_sync;
+    }
+    if (pthread_create(&writer->filler, NULL, fill_thread, writer) != 0) {
+        perror("Failed to start archive stream writer");
+        pthread_mutex_lock(&writer->lock);
+        writer->failed = 1;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->drainer, NULL);
+        goto fail_sync;
+    }
+    return writer->pipe_fds[1];
+
+fail_sync:
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+fail:
+    free(writer->bufs[0]);
+    free(writer->bufs[1]);
+    close(writer->pipe_fds[0]);
+    close(writer->pipe_fds[1]);
+    return -1;
+}
+
+int stream_writer_start(stream_writer_t *writer, int out_fd) {
+    return start_writer(writer, out_fd, CACHE_KEEP);
+}
+
+int stream_writer_start_direct(stream_writer_t *writer, int out_fd) {
+    int flags = fcntl(out_fd, F_GETFL);
+    int direct = flags != -1 && fcntl(out_fd, F_SETFL, flags | O_DIRECT) == 0;
+    return start_writer(writer, out_fd, direct ? CACHE_DIRECT : CACHE_DROP);
+}
+
+int stream_writer_finish(stream_writer_t *writer) {
+    close(writer->pipe_fds[1]);     // EOF for the filler
+    pthread_join(writer->filler, NULL);
+    pthread_join(writer->drainer, NULL);
+    if (writer->cache == CACHE_DROP) {
+        drop_written(writer, writer->written);
+    }
+    close(writer->pipe_fds[0]);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    free(writer->bufs[0]);
+    free(writer->bufs[1]);
+    return writer->failed ? -1 : 0;
+}
@@ -0,0 +1,144 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Archives on a pipe ("-f -"): create writes the tar stream to stdout, list and extract
+ * read it from stdin. Nothing here ever seeks backwards. The reader serves the header
+ * walkers through the archive_pread_fn interface, as long as offsets only move forward,
+ * and skips member data it isn't asked for by reading past it (or seeking, if stdin is
+ * a regular file after all). The writer decouples the archive writer from whoever reads
+ * stdout with two large buffers, so reading member files and draining the pipe overlap.
+ * Both also serve archive files with --direct, to keep them out of the page cache.
+ */
+
+// Name given to -f for an archive on stdin or stdout
+#define STDIO_ARCHIVE "-"
+
+// Size of the reader's window and of each of the writer's two buffers
+#define STREAM_BUF_SIZE (4 << 20)
+
+// Alignment of buffers, offsets and lengths for O_DIRECT, enough for the logical block size of any common device
+#define DIRECT_ALIGN 4096
+
+// How a stream on an archive file uses the page cache
+#define CACHE_KEEP 0        // normal reads and writes
+#define CACHE_DIRECT 1      // O_DIRECT, in whole DIRECT_ALIGN blocks from aligned buffers
+#define CACHE_DROP 2        // the file system refused O_DIRECT: normal I/O, each window is dropped from the cache once done
+
+// Forward-only reader over a pipe
+typedef struct {
+    int fd;
+    int seekable;       // 'fd' is a regular file, skips can lseek
+    int splice_ok;      // cleared once splice turns out not to work for this pipe
+    int cache;          // CACHE_* mode, see stream_reader_bypass_cache
+    off_t cached_from;  // with CACHE_DROP, start of what may still be in the page cache
+    char *buf;          // STREAM_BUF_SIZE bytes, DIRECT_ALIGN aligned
+    off_t start;        // stream offset of buf[0]
+    size_t len;         // valid bytes in buf
+    int eof;
+} stream_reader_t;
+
+/*
+ * Set up 'reader' on 'fd', positioned at offset 0 of the stream
+ * Returns 0 on success, -1 on error
+ */
+int stream_reader_init(stream_reader_t *reader, int fd);
+
+void stream_reader_free(stream_reader_t *reader);
+
+/*
+ * Read the archive file behind 'reader' without filling the page cache: with O_DIRECT
+ * into the window, or if the file system doesn't support that, with normal reads whose
+ * pages are dropped as soon as the window moves past them. Call right after
+ * stream_reader_init, on a regular file positioned at offset 0.
+ * Returns the CACHE_* mode in use
+ */
+int stream_reader_bypass_cache(stream_reader_t *reader);
+
+/*
+ * archive_pread_fn over a stream_reader_t. 'offset' may not be before the start of the
+ * reader's window; anything between the window and 'offset' is read and dropped.
+ * Returns the number of bytes read (short only at the end of the stream), or -1 with
+ * errno set to ESPIPE if 'offset' has already gone by
+ */
+ssize_t stream_pread(void *reader, void *buf, size_t len, off_t offset);
+
+/*
+ * Write 'len' bytes of the stream starting at 'offset' to 'out_fd', straight from the
+ * window, or spliced from the pipe once the window is used up
+ * Returns 0 on success, -1 on error (including the stream ending early)
+ */
+int stream_copy(stream_reader_t *reader, off_t offset, off_t len, int out_fd);
+
+/*
+ * Read the rest of the stream, such as the record padding GNU tar writes after the
+ * end-of-archive marker, so whatever is writing into the pipe finishes normally
+ * Returns 0 on success, -1 on error
+ */
+int stream_drain(stream_reader_t *reader);
+
+/*
+ * An archive file read at any offset, by several threads at once, that uses the page cache
+ * the way a stream_reader_t in the same CACHE_* mode does: with CACHE_DIRECT its descriptor
+ * is in O_DIRECT mode, so each read covers whole aligned blocks through an aligned buffer
+ * of its own; with CACHE_DROP the pages are dropped as soon as they have been read.
+ */
+typedef struct {
+    int fd;
+    int cache;
+} archive_file_t;
+
+// archive_pread_fn over an archive_file_t
+ssize_t archive_file_pread(void *file, void *buf, size_t len, off_t offset);
+
+/*
+ * Write 'len' bytes of 'file' starting at 'offset' to 'out_fd', with the copy engine if
+ * the page cache is used normally
+ * Returns 0 on success, -1 on error (including the file ending early)
+ */
+int archive_file_copy(const archive_file_t *file, off_t offset, off_t len, int out_fd);
+
+// Double-buffered writer: a filler thread reads the tar stream, a drainer thread writes it out
+typedef struct {
+    int out_fd;
+    int cache;                  // CACHE_* mode for 'out_fd'
+    off_t written;              // bytes written to 'out_fd' so far
+    off_t cached_from;          // with CACHE_DROP, start of what may still be in the page cache
+    int pipe_fds[2];            // the archive writer writes into pipe_fds[1]
+    char *bufs[2];              // DIRECT_ALIGN aligned
+    size_t lens[2];
+    int full[2];                // handed to the drainer, not to be touched by the filler
+    int drainer_idle;           // the drainer is waiting, hand over whatever there is
+    int eof;                    // the filler saw the end of the tar stream
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t filler;
+    pthread_t drainer;
+} stream_writer_t;
+
+/*
+ * Start 'writer' on 'out_fd'
+ * Returns the descriptor to write the tar stream to, or -1 on error
+ */
+int stream_writer_start(stream_writer_t *writer, int out_fd);
+
+/*
+ * Same as stream_writer_start, for 'out_fd' an empty archive file that should stay out of
+ * the page cache. The buffers go out whole with O_DIRECT, only the final part of one is
+ * written normally; where O_DIRECT isn't supported each buffer is written back and
+ * dropped from the cache once the next one is on its way.
+ * Returns the descriptor to write the tar stream to, or -1 on error
+ */
+int stream_writer_start_direct(stream_writer_t *writer, int out_fd);
+
+/*
+ * Close the descriptor from stream_writer_start and wait until everything written to it is out
+ * Returns 0 on success, -1 if anything could not be written
+ */
+int stream_writer_finish(stream_writer_t *writer);
+
+#endif
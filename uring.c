@@ -0,0 +1,666 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#undef BLOCK_SIZE   // linux/fs.h's 1 KiB one, minitar.h defines the 512-byte tar block
+
+#include "copy_engine.h"
+#include "minitar.h"
+#include "sparse.h"
+#include "stats.h"
+#include "uring.h"
+
+#define MAX_MSG_LEN 512
+
+// Number of operations in the kernel's probe answer we ask for, more than there are opcodes
+#define URING_PROBE_OPS 256
+
+// The operations batched create and extract rely on, all there since Linux 5.6
+static const int needed_ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+
+/*
+ * Ask the kernel behind 'ring_fd' whether it implements every operation in needed_ops
+ * Returns 1 if it does, 0 otherwise
+ */
+static int ops_supported(int ring_fd) {
+    size_t len = sizeof(struct io_uring_probe) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL) {
+        return 0;
+    }
+    int ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed_ops) / sizeof(needed_ops[0]); i++) {
+        ok = needed_ops[i] <= probe->last_op && (probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    memset(ring, 0, sizeof(uring_t));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    // Newer kernels map both rings with one mmap, older ones need one each
+    int single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single_map && ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    if (single_map) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            uring_free(ring);
+            return -1;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    if (!ops_supported(ring->fd)) {
+        uring_free(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void uring_free(uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    close(ring->fd);
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_queue(uring_t *ring, int *result) {
+    if (ring->queued == ring->entries && uring_run(ring) != 0) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)result;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->unsubmitted++;
+    ring->queued++;
+    return sqe;
+}
+
+int uring_run(uring_t *ring) {
+    // The entries are filled in, let the kernel see them
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (ring->queued > 0) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to submit to io_uring");
+            return -1;
+        }
+        ring->unsubmitted -= submitted;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            *(int *)(uintptr_t)cqe->user_data = cqe->res;
+            head++;
+            ring->queued--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Fill in 'sqe' for an openat relative to the current directory
+static void prep_openat(struct io_uring_sqe *sqe, const char *path, int flags, mode_t mode) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+}
+
+// Fill in 'sqe' for a read or write ('opcode') of 'len' bytes at 'offset' of 'fd'
+static void prep_rw(struct io_uring_sqe *sqe, int opcode, int fd, const void *buf, unsigned len, off_t offset) {
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+static void prep_close(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+
+// A member on its way into the archive during a batched create
+typedef struct {
+    const char *name;
+    int fd;             // result of the openat, -1 once closed
+    int stat_res;
+    int read_res;
+    int close_res;
+    struct statx stx;
+    off_t size;         // body length recorded in the header
+    int large;          // body is streamed by the copy engine instead of read through the ring
+    sparse_map_t sparse;    // data extents of a sparse member (always large), count 0 otherwise
+    size_t out_start;   // where the member's header blocks start in the batch buffer
+    size_t data_pos;    // where its body goes in the batch buffer, right after the headers
+} create_slot_t;
+
+static void close_create_slots(create_slot_t *slots, int n) {
+    for (int i = 0; i < n; i++) {
+        if (slots[i].fd >= 0) {
+            close(slots[i].fd);
+            slots[i].fd = -1;
+        }
+        sparse_map_free(&slots[i].sparse);
+    }
+}
+
+// The parts of 'stx' fill_tar_header_from_stat looks at, as a struct stat
+static void stat_from_statx(struct stat *stat_buf, const struct statx *stx) {
+    memset(stat_buf, 0, sizeof(struct stat));
+    stat_buf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    stat_buf->st_ino = stx->stx_ino;
+    stat_buf->st_mode = stx->stx_mode;
+    stat_buf->st_nlink = stx->stx_nlink;
+    stat_buf->st_uid = stx->stx_uid;
+    stat_buf->st_gid = stx->stx_gid;
+    stat_buf->st_size = stx->stx_size;
+    stat_buf->st_blocks = stx->stx_blocks;
+    stat_buf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    stat_buf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/*
+ * Make sure '*buf' can hold 'len' bytes, growing it (and '*cap') if needed
+ * Returns 0 on success, -1 on error
+ */
+static int reserve(char **buf, size_t *cap, size_t len) {
+    if (len <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : (1 << 20);
+    while (new_cap < len) {
+        new_cap *= 2;
+    }
+    char *grown = realloc(*buf, new_cap);
+    if (grown == NULL) {
+        perror("Failed to allocate batch buffer in write_members_uring");
+        return -1;
+    }
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+/*
+ * Write the 'n' members in 'slots' (only their names filled in) to 'destination'.
+ * Three rounds go through the ring: open all of them, statx all of them through their
+ * descriptors, then read each small body straight into its place in the batch buffer
+ * (linked to the close of its file). The buffer then goes out in a single write.
+ * Members 'links' knows from earlier get a link header and nothing is read for them;
+ * with --dedupe every file is hashed with plain preads while the batch is laid out.
+ * Returns 0 on success, -1 on error
+ */
+static int create_batch(uring_t *ring, create_slot_t *slots, int n, int destination, char **buf, size_t *cap,
+                        link_table_t *links) {
+    char err_msg[MAX_MSG_LEN];
+    uint64_t start = stats_phase_begin();
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = uring_queue(ring, &slots[i].fd);
+        if (sqe == NULL) {
+            return -1;
+        }
+        prep_openat(sqe, slots[i].name, O_RDONLY | O_CLOEXEC, 0);
+    }
+    if (uring_run(ring) != 0) {
+        close_create_slots(slots, n);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (slots[i].fd < 0) {
+            errno = -slots[i].fd;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", slots[i].name);
+            perror(err_msg);
+            close_create_slots(slots, n);
+            return -1;
+        }
+    }
+
+    // Stat the open descriptors rather than the names, so each header describes the file whose data we read
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = uring_queue(ring, &slots[i].stat_res);
+        if (sqe == NULL) {
+            close_create_slots(slots, n);
+            return -1;
+        }
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = slots[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)"";
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&slots[i].stx;
+        sqe->statx_flags = AT_EMPTY_PATH;
+    }
+    if (uring_run(ring) != 0) {
+        close_create_slots(slots, n);
+        return -1;
+    }
+
+    // Lay the batch out: every member's header blocks, each followed by its zero padded body unless it's large
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        create_slot_t *slot = &slots[i];
+        struct stat stat_buf;
+        if (slot->stat_res == 0) {
+            stat_from_statx(&stat_buf, &slot->stx);
+        } else if (fstat(slot->fd, &stat_buf) != 0) {   // some kernels refuse an empty path here
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", slot->name);
+            perror(err_msg);
+            close_create_slots(slots, n);
+            return -1;
+        }
+        member_header_t hed;
+        uint64_t hash;
+        int linked = link_content_hash(slot->fd, &stat_buf, &hash) == 0
+                         ? link_member_header(links, &hed, slot->name, &stat_buf, hash) : -1;
+        if (linked == -1 || (!linked && fill_member_header_fd(&hed, slot->name, slot->fd, &stat_buf, &slot->sparse) != 0)) {
+            close_create_slots(slots, n);
+            return -1;
+        }
+        // a directory or link is just its header
+        slot->size = S_ISDIR(stat_buf.st_mode) || linked ? 0 : stat_buf.st_size;
+        slot->large = slot->size > URING_SMALL_FILE || slot->sparse.count > 0;
+        if (slot->sparse.count > 0) {
+            slot->size = sparse_member_size(&slot->sparse);
+        }
+        size_t padded = slot->large ? 0 : (slot->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (reserve(buf, cap, len + hed.pax_len + BLOCK_SIZE + padded) != 0) {
+            member_header_free(&hed);
+            close_create_slots(slots, n);
+            return -1;
+        }
+        slot->out_start = len;
+        if (hed.pax != NULL) {
+            memcpy(*buf + len, hed.pax, hed.pax_len);
+            len += hed.pax_len;
+        }
+        memcpy(*buf + len, &hed.header, BLOCK_SIZE);
+        len += BLOCK_SIZE;
+        member_header_free(&hed);
+        slot->data_pos = len;
+        memset(*buf + len, 0, padded);  // a file that shrank since statx is zero filled like copy_member_body does
+        len += padded;
+    }
+    stats_phase_end(PHASE_HEADER, start);
+
+    start = stats_phase_begin();
+    for (int i = 0; i < n; i++) {
+        create_slot_t *slot = &slots[i];
+        if (slot->large) {     // stays open for the copy engine
+            continue;
+        }
+        struct io_uring_sqe *sqe;
+        slot->read_res = 0;
+        if (slot->size > 0) {
+            sqe = uring_queue(ring, &slot->read_res);
+            if (sqe == NULL) {
+                close_create_slots(slots, n);
+                return -1;
+            }
+            prep_rw(sqe, IORING_OP_READ, slot->fd, *buf + slot->data_pos, slot->size, 0);
+            sqe->flags |= IOSQE_IO_LINK;    // the close waits for the read
+        }
+        sqe = uring_queue(ring, &slot->close_res);
+        if (sqe == NULL) {
+            close_create_slots(slots, n);
+            return -1;
+        }
+        prep_close(sqe, slot->fd);
+    }
+    if (uring_run(ring) != 0) {
+        close_create_slots(slots, n);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!slots[i].large && slots[i].close_res != -ECANCELED) {
+            slots[i].fd = -1;   // closed by the ring (a failed close of a read-only file loses nothing)
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (!slots[i].large && slots[i].read_res < 0) {
+            errno = -slots[i].read_res;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read file %s in write_members_uring", slots[i].name);
+            perror(err_msg);
+            close_create_slots(slots, n);
+            return -1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (!slots[i].large && slots[i].fd >= 0) {    // its close was cancelled by a short read
+            close(slots[i].fd);
+            slots[i].fd = -1;
+        }
+    }
+
+    // Everything up to a large member goes out in one write, then the copy engine streams its body
+    size_t written = 0;
+    for (int i = 0; i < n; i++) {
+        create_slot_t *slot = &slots[i];
+        if (slot->large) {
+            if (write_all(destination, *buf + written, slot->data_pos - written) != 0
+                || (slot->sparse.count > 0 ? sparse_write_body(slot->fd, destination, &slot->sparse)
+                                           : copy_member_body(slot->fd, destination, slot->size)) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to copy file %s into archive in write_members_uring", slot->name);
+                perror(err_msg);
+                close_create_slots(slots, n);
+                return -1;
+            }
+            close(slot->fd);
+            slot->fd = -1;
+            written = slot->data_pos;
+        }
+        stats_count(STAT_FILES, 1);
+        stats_count(STAT_DATA_BYTES, slot->size);
+        stats_count(STAT_BLOCKS, (slot->data_pos - slot->out_start + slot->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+    close_create_slots(slots, n);
+    if (write_all(destination, *buf + written, len - written) != 0) {
+        perror("Failed to write the buffer into archive in function write_members_uring");
+        return -1;
+    }
+    stats_phase_end(PHASE_DATA, start);
+    return 0;
+}
+
+int write_members_uring(int destination, const file_list_t *files, link_table_t *links) {
+    uring_t ring;
+    if (uring_init(&ring, URING_ENTRIES) != 0) {
+        fprintf(stderr, "io_uring is not available, using regular I/O\n");
+        return 1;
+    }
+    create_slot_t *slots = calloc(URING_BATCH, sizeof(create_slot_t));
+    if (slots == NULL) {
+        perror("Failed to allocate slots in write_members_uring");
+        uring_free(&ring);
+        return -1;
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    int ret = 0;
+    node_t *current = files->head;
+    while (ret == 0 && current != NULL) {
+        int n = 0;
+        for (; n < URING_BATCH && current != NULL; n++, current = current->next) {
+            memset(&slots[n], 0, sizeof(create_slot_t));
+            slots[n].name = current->name;
+            slots[n].fd = -1;
+        }
+        ret = create_batch(&ring, slots, n, destination, &buf, &cap, links);
+    }
+    free(buf);
+    free(slots);
+    uring_free(&ring);
+    return ret;
+}
+
+
+// A member on its way out of the archive during a batched extract
+typedef struct {
+    const char *name;
+    const char *data;   // body, inside the mapped archive
+    off_t size;
+    int fd;             // result of the openat, -1 once closed
+    int write_res;
+    int close_res;
+} extract_slot_t;
+
+static void close_extract_slots(extract_slot_t *slots, int n) {
+    for (int i = 0; i < n; i++) {
+        if (slots[i].fd >= 0) {
+            close(slots[i].fd);
+            slots[i].fd = -1;
+        }
+    }
+}
+
+/*
+ * Create the 'n' files in 'slots' and write their bodies in two rounds through the ring:
+ * open all of them, then each write linked to the close of its file. Bodies over
+ * URING_MAX_WRITE only get their first part written by the ring, the rest with write_all.
+ * Returns 0 on success, -1 on error
+ */
+static int extract_batch(uring_t *ring, extract_slot_t *slots, int n) {
+    char err_msg[MAX_MSG_LEN];
+    uint64_t start = stats_phase_begin();
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = uring_queue(ring, &slots[i].fd);
+        if (sqe == NULL) {
+            return -1;
+        }
+        prep_openat(sqe, slots[i].name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (uring_run(ring) != 0) {
+        close_extract_slots(slots, n);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        extract_slot_t *slot = &slots[i];
+        if (slot->fd == -ENOENT && make_dirs(slot->name) == 0) {
+            // Parent directory is missing, its member may come later or the archive has none
+            slot->fd = open(slot->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (slot->fd == -1) {
+                slot->fd = -errno;
+            }
+        }
+        if (slot->fd < 0) {
+            errno = -slot->fd;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to create file %s in function extract", slot->name);
+            perror(err_msg);
+            close_extract_slots(slots, n);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        extract_slot_t *slot = &slots[i];
+        int whole = slot->size <= URING_MAX_WRITE;
+        struct io_uring_sqe *sqe;
+        slot->write_res = 0;
+        slot->close_res = -ECANCELED;   // left that way when the close is ours to do
+        if (slot->size > 0) {
+            sqe = uring_queue(ring, &slot->write_res);
+            if (sqe == NULL) {
+                close_extract_slots(slots, n);
+                return -1;
+            }
+            prep_rw(sqe, IORING_OP_WRITE, slot->fd, slot->data, whole ? slot->size : URING_MAX_WRITE, 0);
+            if (whole) {
+                sqe->flags |= IOSQE_IO_LINK;    // the close waits for the write
+            }
+        }
+        if (whole) {
+            sqe = uring_queue(ring, &slot->close_res);
+            if (sqe == NULL) {
+                close_extract_slots(slots, n);
+                return -1;
+            }
+            prep_close(sqe, slot->fd);
+        }
+    }
+    if (uring_run(ring) != 0) {
+        close_extract_slots(slots, n);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (slots[i].close_res != -ECANCELED) {
+            slots[i].fd = -1;
+        }
+    }
+
+    int ret = 0;
+    for (int i = 0; i < n && ret == 0; i++) {
+        extract_slot_t *slot = &slots[i];
+        if (slot->write_res < 0
+            || write_all(slot->fd, slot->data + slot->write_res, slot->size - slot->write_res) != 0) {
+            // the rest of a short or partial write goes out with write_all
+            if (slot->write_res < 0) {
+                errno = -slot->write_res;
+            }
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write file %s in function extract", slot->name);
+            perror(err_msg);
+            ret = -1;
+        } else if (slot->close_res < 0 && slot->close_res != -ECANCELED) {
+            errno = -slot->close_res;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s in function extract", slot->name);
+            perror(err_msg);
+            ret = -1;
+        } else if (slot->fd >= 0) {
+            int fd = slot->fd;
+            slot->fd = -1;
+            if (close(fd) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s in function extract", slot->name);
+                perror(err_msg);
+                ret = -1;
+            }
+        }
+        stats_count(STAT_FILES, 1);
+        stats_count(STAT_DATA_BYTES, slot->size);
+        stats_count(STAT_BLOCKS, (slot->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+    close_extract_slots(slots, n);
+    stats_phase_end(PHASE_DATA, start);
+    return ret;
+}
+
+/*
+ * Creates the file 'name' and writes the sparse member 'entry' into it from 'archive_fd'
+ * Returns 0 on success, -1 on error
+ */
+static int extract_sparse(const char *name, int archive_fd, const index_entry_t *entry) {
+    char err_msg[MAX_MSG_LEN];
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1 && errno == ENOENT && make_dirs(name) == 0) {
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to create file %s in function extract", name);
+        perror(err_msg);
+        return -1;
+    }
+    int ret = sparse_extract(fd_pread, &archive_fd, entry->data_offset, entry->size, entry->real_size, fd);
+    if (ret != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write file %s in function extract", name);
+        perror(err_msg);
+    }
+    if (close(fd) != 0 && ret == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s in function extract", name);
+        perror(err_msg);
+        ret = -1;
+    }
+    stats_count(STAT_FILES, 1);
+    stats_count(STAT_DATA_BYTES, entry->size);
+    stats_count(STAT_BLOCKS, (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    return ret;
+}
+
+int extract_members_uring(const char *archive_name, int archive_fd, const char *map, off_t archive_size,
+                          const archive_index_t *index, const index_entry_t **live, uint32_t num_live) {
+    uring_t ring;
+    if (uring_init(&ring, URING_ENTRIES) != 0) {
+        fprintf(stderr, "io_uring is not available, using regular I/O\n");
+        return 1;
+    }
+    extract_slot_t slots[URING_BATCH];
+    int n = 0;
+    int ret = 0;
+    for (uint32_t i = 0; i < num_live && ret == 0; i++) {
+        const index_entry_t *entry = live[i];
+        const char *name = archive_index_name(index, entry);
+        if ((off_t)(entry->data_offset + entry->size) > archive_size) {
+            printf("Error: archive %s is truncated\n", archive_name);
+            ret = -1;
+            break;
+        }
+        size_t name_len = strlen(name);
+        if (name_len > 0 && name[name_len - 1] == '/') {   // directory member, made right away
+            stats_count(STAT_FILES, 1);
+            ret = make_dirs(name);
+            continue;
+        }
+        if (entry->flags & INDEX_SPARSE) {     // a few extents, not worth a slot
+            ret = extract_sparse(name, archive_fd, entry);
+            continue;
+        }
+        slots[n].name = name;
+        slots[n].data = map + entry->data_offset;
+        slots[n].size = entry->size;
+        slots[n].fd = -1;
+        if (++n == URING_BATCH) {
+            ret = extract_batch(&ring, slots, n);
+            n = 0;
+        }
+    }
+    if (ret == 0 && n > 0) {
+        ret = extract_batch(&ring, slots, n);
+    }
+    uring_free(&ring);
+    return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef _URING_H
+#define _URING_H
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "archive_index.h"
+#include "file_list.h"
+#include "links.h"
+
+// Members handled per round of submissions
+#define URING_BATCH 64
+
+// Submission queue depth: a batch queues at most two operations per member (read or write, then close)
+#define URING_ENTRIES (2 * URING_BATCH)
+
+// Create: files up to this size are read through the ring straight into the batch output buffer.
+// Anything bigger is streamed by the copy engine when its turn comes, like the parallel writer does.
+#define URING_SMALL_FILE (1 << 16)
+
+// Extract: members up to this size are written through the ring, bigger ones with a plain write loop
+#define URING_MAX_WRITE (1 << 30)
+
+// From <linux/io_uring.h>, which is only included by uring.c: it drags in linux/fs.h and its own BLOCK_SIZE
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ * A single io_uring instance, set up with the raw system calls (no liburing).
+ * Operations are queued, then submitted and waited for together with uring_run.
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned sq_local_tail; // tail including entries not yet handed to the kernel
+    unsigned unsubmitted;   // queued entries io_uring_enter hasn't consumed yet
+    unsigned queued;        // operations queued but not completed yet
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;           // same as sq_map if the kernel maps both rings at once
+    size_t cq_map_len;
+    size_t sqes_len;
+} uring_t;
+
+/*
+ * Set up 'ring' with room for 'entries' operations in flight, and check that the kernel
+ * supports every operation the batched create and extract use (openat, statx, read, write, close)
+ * Returns 0 on success, -1 if io_uring can't be used here (old kernel, seccomp, disabled by sysctl)
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+void uring_free(uring_t *ring);
+
+/*
+ * Get a cleared submission entry for the caller to fill in. When the operation completes,
+ * its result (what the system call would have returned, or -errno) is stored in '*result'.
+ * If the queue is full, everything queued so far is run first.
+ * Returns NULL only if that run failed
+ */
+struct io_uring_sqe *uring_queue(uring_t *ring, int *result);
+
+/*
+ * Submit every queued operation and wait until all of them have completed
+ * Returns 0 on success, -1 on error
+ */
+int uring_run(uring_t *ring);
+
+/*
+ * io_uring counterpart of write_members_parallel: opens, stats and reads URING_BATCH
+ * members at a time with a single thread, and writes each batch to 'destination'
+ * with one write, in the order of 'files'. The output is byte for byte identical to
+ * the serial path, hard links to earlier members included ('links'). The footer is left
+ * to the caller.
+ * Returns 0 on success, -1 on error, 1 if io_uring isn't available and nothing was written
+ */
+int write_members_uring(int destination, const file_list_t *files, link_table_t *links);
+
+/*
+ * io_uring counterpart of the extract workers: creates and writes the 'num_live' members
+ * in 'live' from 'map', the whole archive 'archive_name' of 'archive_size' bytes mapped
+ * into memory, URING_BATCH members at a time. Sparse members are written on the side
+ * with positional reads from 'archive_fd'.
+ * Returns 0 on success, -1 on error, 1 if io_uring isn't available and nothing was written
+ */
+int extract_members_uring(const char *archive_name, int archive_fd, const char *map, off_t archive_size,
+                          const archive_index_t *index, const index_entry_t **live, uint32_t num_live);
+
+#endif
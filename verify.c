@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive_index.h"
+#include "compress.h"
+#include "hash.h"
+#include "minitar.h"
+#include "parallel.h"
+#include "sparse.h"
+#include "stats.h"
+#include "verify.h"
+
+#define MAX_MSG_LEN 512
+
+// A window of the tar stream, so that runs of small members cost one read instead of one per header
+typedef struct {
+    archive_pread_fn read_fn;
+    void *ctx;
+    char *buf;          // VERIFY_BUF_SIZE bytes
+    off_t start;        // stream offset of buf[0]
+    size_t len;         // valid bytes in buf
+} stream_window_t;
+
+// Everything a content comparison worker needs
+typedef struct {
+    archive_pread_fn read_fn;
+    void *ctx;
+    const archive_index_t *index;
+    const index_entry_t **members;
+    long mismatches;
+    unsigned long long bytes;
+} compare_job_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double mb_per_sec(unsigned long long bytes, double seconds) {
+    return seconds > 0 ? bytes / seconds / 1e6 : 0.0;
+}
+
+/*
+ * archive_pread_fn that serves reads from the window, refilling it at 'offset' when the
+ * requested range isn't in it. Reads bigger than the window go straight through
+ */
+static ssize_t window_pread(void *ctx, void *buf, size_t len, off_t offset) {
+    stream_window_t *win = ctx;
+    if (len > VERIFY_BUF_SIZE) {
+        return win->read_fn(win->ctx, buf, len, offset);
+    }
+    if (offset < win->start || offset + (off_t)len > win->start + (off_t)win->len) {
+        win->start = offset;
+        win->len = 0;
+        while (win->len < VERIFY_BUF_SIZE) {
+            ssize_t n = win->read_fn(win->ctx, win->buf + win->len, VERIFY_BUF_SIZE - win->len, offset + win->len);
+            if (n == -1) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            win->len += n;
+        }
+    }
+    size_t left = win->len - (offset - win->start);
+    size_t n = left < len ? left : len;
+    memcpy(buf, win->buf + (offset - win->start), n);
+    return n;
+}
+
+/*
+ * Returns 1 if 'field' is a well-formed octal number: optional leading spaces, at least one
+ * digit, then only spaces or null bytes up to the end of the field. Otherwise 0
+ */
+static int valid_octal(const char *field, size_t len) {
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    size_t digits = 0;
+    while (i < len && field[i] >= '0' && field[i] <= '7') {
+        i++;
+        digits++;
+    }
+    for (; i < len; i++) {
+        if (field[i] != ' ' && field[i] != '\0') {
+            return 0;
+        }
+    }
+    return digits > 0;
+}
+
+/*
+ * Hash 'size' bytes of the tar stream behind 'read_fn' starting at 'offset'
+ * Returns 0 on success (hash in '*out'), -1 on error
+ */
+static int hash_stream(archive_pread_fn read_fn, void *ctx, off_t offset, off_t size, uint64_t *out) {
+    char *buffer = malloc(VERIFY_BUF_SIZE);
+    if (buffer == NULL) {
+        perror("Failed to allocate hash buffer in verify");
+        return -1;
+    }
+    content_hash_t state;
+    content_hash_init(&state);
+    while (size > 0) {
+        size_t chunk = size > VERIFY_BUF_SIZE ? VERIFY_BUF_SIZE : size;
+        ssize_t n = read_fn(ctx, buffer, chunk, offset);
+        if (n <= 0) {
+            perror("Failed to read member data in verify");
+            free(buffer);
+            return -1;
+        }
+        content_hash_update(&state, buffer, n);
+        offset += n;
+        size -= n;
+    }
+    free(buffer);
+    *out = content_hash_digest(&state);
+    return 0;
+}
+
+/*
+ * Compares member number 'i' of the job with the file of the same name on disk, a hard
+ * link with the data of the member it links to.
+ * A difference is reported and counted but doesn't stop the other workers
+ * Returns 0 upon success, -1 if the archive couldn't be read
+ */
+static int compare_member(void *arg, long i) {
+    compare_job_t *job = arg;
+    const char *name = archive_index_name(job->index, job->members[i]);
+    const index_entry_t *entry = archive_index_resolve(job->index, job->members[i]);
+    const char *problem = NULL;
+
+    int fd = entry != NULL ? open(name, O_RDONLY) : -1;
+    struct stat stat_buf;
+    if (entry == NULL) {
+        problem = "link target missing from archive";
+    } else if (fd == -1) {
+        problem = "missing on disk";
+    } else if (fstat(fd, &stat_buf) != 0 || (uint64_t)stat_buf.st_size != entry->real_size) {
+        problem = "size differs";
+    } else {
+        uint64_t disk_hash;
+        uint64_t member_hash;
+        int status = entry->flags & INDEX_SPARSE
+                         ? sparse_hash(job->read_fn, job->ctx, entry->data_offset, entry->size, entry->real_size, &member_hash)
+                         : hash_stream(job->read_fn, job->ctx, entry->data_offset, entry->size, &member_hash);
+        if (status != 0) {
+            close(fd);
+            return -1;
+        }
+        if (content_hash_fd(fd, 0, entry->real_size, &disk_hash) != 0 || disk_hash != member_hash) {
+            problem = "contents differ";
+        }
+        __atomic_fetch_add(&job->bytes, entry->real_size, __ATOMIC_RELAXED);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (problem != NULL) {
+        printf("%s: %s\n", name, problem);
+        __atomic_fetch_add(&job->mismatches, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/*
+ * Hash the latest version of every file member and compare it with the disk.
+ * Compressed archives are hashed on one thread, their reader keeps a shared chunk cache
+ * Returns the number of mismatches, or -1 on error
+ */
+static long compare_contents(archive_pread_fn read_fn, void *ctx, int num_threads) {
+    archive_index_t index;
+    archive_index_init(&index);
+    uint64_t phase_start = stats_phase_begin();
+    if (archive_index_scan_from(read_fn, ctx, &index) != 0) {
+        archive_index_free(&index);
+        return -1;
+    }
+    stats_phase_end(PHASE_SCAN, phase_start);
+    const index_entry_t **members = malloc(sizeof(index_entry_t *) * (index.num_entries + 1));
+    if (members == NULL) {
+        perror("Failed to allocate member list in verify");
+        archive_index_free(&index);
+        return -1;
+    }
+    uint32_t num_live = archive_index_latest(&index, members);
+    uint32_t num_files = 0;
+    for (uint32_t i = 0; i < num_live; i++) {   // directories have nothing to compare
+        const char *name = archive_index_name(&index, members[i]);
+        if (name[0] != '\0' && name[strlen(name) - 1] != '/') {
+            members[num_files++] = members[i];
+        }
+    }
+
+    compare_job_t job = {read_fn, ctx, &index, members, 0, 0};
+    double start = now_seconds();
+    phase_start = stats_phase_begin();
+    int status = run_jobs_parallel(num_threads, num_files, compare_member, &job);
+    stats_phase_end(PHASE_DATA, phase_start);
+    stats_count(STAT_DATA_BYTES, job.bytes);
+    double elapsed = now_seconds() - start;
+    if (status == 0) {
+        printf("Compared %u files, %llu bytes in %.3f s (%.1f MB/s, %d threads)\n", num_files, job.bytes, elapsed,
+               mb_per_sec(job.bytes, elapsed), num_threads);
+    }
+    free(members);
+    archive_index_free(&index);
+    return status == 0 ? job.mismatches : -1;
+}
+
+
+// mtz_chunk_fn for pass 1: inflating a chunk checks it, only its length is kept, added up in 'ctx'
+static int count_chunk(void *ctx, uint64_t index, const char *raw, size_t len, off_t offset) {
+    (void)index;
+    (void)raw;
+    (void)offset;
+    __atomic_fetch_add((uint64_t *)ctx, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+int verify_archive(const char *archive_name, int compare) {
+    char err_msg[MAX_MSG_LEN];
+    int fd = open(archive_name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s in verify", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        perror("Failed to open archive in verify");
+        close(fd);
+        return -1;
+    }
+    // A chunk table that doesn't add up is one more problem to report, the readers stay inside it
+    mtz_reader_t mtz;
+    int compressed = mtz_open_unchecked(fd, &mtz);
+    if (compressed == -1) {     // what went wrong has been printed
+        printf("Archive %s: 1 problem(s) found\n", archive_name);
+        close(fd);
+        return -1;
+    }
+    stream_window_t win = {fd_pread, &fd, malloc(VERIFY_BUF_SIZE), 0, 0};
+    off_t stream_size = stat_buf.st_size;
+    if (compressed) {   // offsets are positions in the tar stream inside the chunks
+        win.read_fn = mtz_pread;
+        win.ctx = &mtz;
+        stream_size = mtz.raw_size;
+    }
+    if (win.buf == NULL) {
+        perror("Failed to allocate buffer in verify");
+        if (compressed) {
+            mtz_close(&mtz);
+        }
+        close(fd);
+        return -1;
+    }
+
+    // Pass 1: every header, without touching member data
+    double start = now_seconds();
+    uint64_t phase_start = stats_phase_begin();
+    long problems = compressed ? mtz_check_table(&mtz) : 0;
+    unsigned long num_members = 0;
+    unsigned long long data_bytes = 0;
+    off_t offset = 0;
+    int ret = 0;
+    archive_member_t member;
+    archive_member_init(&member);
+    while (1) {
+        int status = read_member_from(window_pread, &win, offset, &member);
+        if (status == -1) {     // what went wrong has been printed
+            printf("Error: unreadable member at offset %lld\n", (long long)offset);
+            problems++;
+            break;
+        }
+        if (status == 0) {
+            char block[BLOCK_SIZE];
+            ssize_t n = window_pread(&win, block, BLOCK_SIZE, offset);
+            if (n == 0) {
+                printf("Error: archive ends at offset %lld without an end-of-archive marker\n", (long long)offset);
+                problems++;
+            } else if ((n = window_pread(&win, block, BLOCK_SIZE, offset + BLOCK_SIZE)) != BLOCK_SIZE
+                       || !is_zero_block(block)) {  // the marker is two zero blocks
+                printf("Error: end-of-archive marker at offset %lld is not two zero blocks\n", (long long)offset);
+                problems++;
+            }
+            break;
+        }
+
+        const tar_header *hed = &member.header;
+        if (!member.checksum_ok || !valid_octal(hed->chksum, sizeof(hed->chksum))) {
+            // Nothing after a damaged header can be trusted, not even where the next one is
+            printf("Error: bad header checksum at offset %lld (%s)\n", (long long)offset, member.name);
+            problems++;
+            break;
+        }
+        if (!valid_octal(hed->size, sizeof(hed->size)) && !(hed->size[0] & 0x80)) {   // octal or base-256
+            printf("Error: bad size field in header at offset %lld (%s)\n", (long long)offset, member.name);
+            problems++;
+            break;
+        }
+        if (member.next_offset > stream_size) {
+            printf("Error: data of %s at offset %lld runs past the end of the archive\n", member.name,
+                   (long long)offset);
+            problems++;
+            break;
+        }
+        if (member.linkname != NULL && member.linkname[0] == '\0') {
+            printf("Error: hard link %s at offset %lld has no target\n", member.name, (long long)offset);
+            problems++;
+        }
+        if (member.sparse) {    // the map has to fit the data the member holds, what's wrong gets printed
+            sparse_map_t map;
+            off_t extents_offset;
+            if (sparse_map_read(window_pread, &win, member.data_offset, member.size, member.real_size, &map,
+                                &extents_offset) != 0) {
+                problems++;
+            }
+            sparse_map_free(&map);
+        }
+        num_members++;
+        data_bytes += member.size;
+        offset = member.next_offset;
+    }
+    archive_member_free(&member);
+    // The walk skips over data, so chunks holding nothing but member data were never inflated.
+    // Inflate them all on the thread pool, zlib checks each one; the first bad one is printed.
+    uint64_t inflated = 0;
+    if (compressed && mtz_inflate_each(&mtz, mtz_default_threads(), count_chunk, &inflated) != 0) {
+        problems++;
+    } else if (compressed && inflated != mtz.raw_size) {
+        printf("Error: chunks inflate to %llu bytes of tar stream, the trailer says %llu\n",
+               (unsigned long long)inflated, (unsigned long long)mtz.raw_size);
+        problems++;
+    }
+    stats_phase_end(PHASE_SCAN, phase_start);
+    stats_count(STAT_FILES, num_members);
+    double elapsed = now_seconds() - start;
+    free(win.buf);
+    if (ret == 0) {
+        printf("Checked %lu members, %llu bytes of member data in %.3f s (%.1f MB/s of archive)\n", num_members,
+               data_bytes, elapsed, mb_per_sec(offset, elapsed));
+    }
+
+    // Pass 2: member data against the files on disk, only worth doing if the layout is sound
+    if (ret == 0 && problems == 0 && compare) {
+        long mismatches = compare_contents(win.read_fn, win.ctx, compressed ? 1 : mtz_default_threads());
+        if (mismatches == -1) {
+            ret = -1;
+        } else {
+            problems += mismatches;
+        }
+    }
+
+    if (compressed) {
+        mtz_close(&mtz);
+    }
+    close(fd);
+    if (ret == 0) {
+        if (problems == 0) {
+            printf("Archive %s is OK\n", archive_name);
+        } else {
+            printf("Archive %s: %ld problem(s) found\n", archive_name, problems);
+        }
+    }
+    return ret == 0 && problems == 0 ? 0 : -1;
+}
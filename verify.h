@@ -0,0 +1,22 @@
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+// Read size for the header walk and for hashing member bodies
+#define VERIFY_BUF_SIZE (1 << 20)
+
+/*
+ * Check the integrity of the archive 'archive_name' (plain or compressed) without
+ * extracting it. Every header must have a valid checksum and size field, every
+ * member's data must be inside the archive, and the archive must end in the two
+ * zero blocks of the end-of-archive marker. Every chunk of a compressed archive is
+ * inflated too, so damage inside member data is found as well, and its chunk table
+ * has to add up to the tar stream its trailer gives.
+ * If 'compare_contents' is set, the latest version of each file member is also hashed
+ * and compared with the file of the same name on disk, on a pool of threads.
+ * Each problem found is printed, followed by a summary with the throughput of each pass.
+ * This function should return 0 if the archive is intact (and matches the disk),
+ * or -1 if a problem was found or an error occurred
+ */
+int verify_archive(const char *archive_name, int compare_contents);
+
+#endif
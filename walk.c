@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "walk.h"
+
+#define MAX_MSG_LEN 512
+
+// Record layout returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct walk_dir walk_dir_t;
+
+// One entry of a directory that ends up in the archive
+typedef struct {
+    size_t name_offset;     // start of the entry's null-terminated name in the directory's name table
+    walk_dir_t *subdir;     // the subdirectory, or NULL for a regular file
+} walk_entry_t;
+
+// A directory of the tree. Its entries are kept so the members can be listed in order afterwards
+struct walk_dir {
+    char *path;             // full path, ending in '/'
+    walk_entry_t *entries;
+    size_t num_entries;
+    size_t entries_cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    walk_dir_t *next_queued;
+};
+
+// State shared by the walker threads
+typedef struct {
+    walk_dir_t *queue;      // directories handed off for any thread to read, opened by path
+    long pending;           // directories queued or being read, the walk is done when this hits 0
+    int idle;               // threads waiting for work, a busy thread shares subdirectories while > 0
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+} walker_t;
+
+static walk_dir_t *new_dir(const char *parent, const char *name, size_t name_len) {
+    walk_dir_t *dir = calloc(1, sizeof(walk_dir_t));
+    if (dir == NULL) {
+        return NULL;
+    }
+    size_t parent_len = strlen(parent);
+    dir->path = malloc(parent_len + name_len + 2);
+    if (dir->path == NULL) {
+        free(dir);
+        return NULL;
+    }
+    memcpy(dir->path, parent, parent_len);
+    memcpy(dir->path + parent_len, name, name_len);
+    dir->path[parent_len + name_len] = '/';
+    dir->path[parent_len + name_len + 1] = '\0';
+    return dir;
+}
+
+static void free_dir(walk_dir_t *dir) {
+    if (dir == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        free_dir(dir->entries[i].subdir);
+    }
+    free(dir->entries);
+    free(dir->names);
+    free(dir->path);
+    free(dir);
+}
+
+/*
+ * Append an entry called 'name' to 'dir'
+ * Returns the new entry, or NULL if out of memory
+ */
+static walk_entry_t *add_entry(walk_dir_t *dir, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (dir->names_len + len > dir->names_cap) {
+        size_t cap = dir->names_cap ? dir->names_cap * 2 : 1024;
+        while (cap < dir->names_len + len) {
+            cap *= 2;
+        }
+        char *names = realloc(dir->names, cap);
+        if (names == NULL) {
+            return NULL;
+        }
+        dir->names = names;
+        dir->names_cap = cap;
+    }
+    if (dir->num_entries == dir->entries_cap) {
+        size_t cap = dir->entries_cap ? dir->entries_cap * 2 : 16;
+        walk_entry_t *entries = realloc(dir->entries, cap * sizeof(walk_entry_t));
+        if (entries == NULL) {
+            return NULL;
+        }
+        dir->entries = entries;
+        dir->entries_cap = cap;
+    }
+    walk_entry_t *entry = &dir->entries[dir->num_entries++];
+    entry->name_offset = dir->names_len;
+    entry->subdir = NULL;
+    memcpy(dir->names + dir->names_len, name, len);
+    dir->names_len += len;
+    return entry;
+}
+
+static int compare_entries(const void *a, const void *b, void *arg) {
+    const char *names = arg;
+    return strcmp(names + ((const walk_entry_t *)a)->name_offset, names + ((const walk_entry_t *)b)->name_offset);
+}
+
+/*
+ * Read every entry of the directory open at 'fd' into 'dir', 'dents' is a scratch
+ * buffer of WALK_DENTS_BUF_SIZE bytes. Subdirectory nodes are created but not read.
+ * Returns 0 on success, -1 on error
+ */
+static int read_dir(walk_dir_t *dir, int fd, char *dents) {
+    char err_msg[MAX_MSG_LEN];
+    while (1) {
+        long n = syscall(SYS_getdents64, fd, dents, WALK_DENTS_BUF_SIZE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read directory %s", dir->path);
+            perror(err_msg);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {   // some file systems don't fill in d_type, ask the inode
+                struct stat stat_buf;
+                if (fstatat(fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) != 0) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s%s", dir->path, name);
+                    perror(err_msg);
+                    return -1;
+                }
+                type = S_ISDIR(stat_buf.st_mode) ? DT_DIR : S_ISREG(stat_buf.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG) {
+                fprintf(stderr, "Skipping %s%s: not a regular file or directory\n", dir->path, name);
+                continue;
+            }
+            walk_entry_t *entry = add_entry(dir, name);
+            if (entry == NULL || (type == DT_DIR && (entry->subdir = new_dir(dir->path, name, strlen(name))) == NULL)) {
+                perror("Failed to allocate memory in expand_paths");
+                return -1;
+            }
+        }
+    }
+    qsort_r(dir->entries, dir->num_entries, sizeof(walk_entry_t), compare_entries, dir->names);
+    return 0;
+}
+
+static void enqueue(walker_t *walker, walk_dir_t *dir) {
+    pthread_mutex_lock(&walker->lock);
+    dir->next_queued = walker->queue;
+    walker->queue = dir;
+    walker->pending++;
+    pthread_cond_signal(&walker->work);
+    pthread_mutex_unlock(&walker->lock);
+}
+
+/*
+ * Read 'dir', open at 'fd', and everything below it. Subdirectories are opened relative
+ * to 'fd' and walked depth first, unless another thread is idle; then they are queued
+ * for it instead. Closes 'fd'.
+ * Returns 0 on success, -1 on error
+ */
+static int walk_dir(walker_t *walker, walk_dir_t *dir, int fd, char *dents) {
+    char err_msg[MAX_MSG_LEN];
+    int ret = read_dir(dir, fd, dents);
+    for (size_t i = 0; i < dir->num_entries && ret == 0; i++) {
+        walk_dir_t *subdir = dir->entries[i].subdir;
+        if (subdir == NULL) {
+            continue;
+        }
+        if (__atomic_load_n(&walker->idle, __ATOMIC_RELAXED) > 0) {
+            enqueue(walker, subdir);
+            continue;
+        }
+        const char *name = dir->names + dir->entries[i].name_offset;
+        int sub_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub_fd == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to open directory %s", subdir->path);
+            perror(err_msg);
+            ret = -1;
+            break;
+        }
+        ret = walk_dir(walker, subdir, sub_fd, dents);
+    }
+    close(fd);
+    return ret;
+}
+
+static void *walker_thread(void *arg) {
+    walker_t *walker = arg;
+    char *dents = malloc(WALK_DENTS_BUF_SIZE);
+    pthread_mutex_lock(&walker->lock);
+    if (dents == NULL) {
+        perror("Failed to allocate memory in expand_paths");
+        walker->failed = 1;
+    }
+    while (dents != NULL) {
+        walker->idle++;
+        while (walker->queue == NULL && walker->pending > 0) {
+            pthread_cond_wait(&walker->work, &walker->lock);
+        }
+        walker->idle--;
+        walk_dir_t *dir = walker->queue;
+        if (dir == NULL) {  // nothing queued and nobody reading, so nothing more can show up
+            break;
+        }
+        walker->queue = dir->next_queued;
+        pthread_mutex_unlock(&walker->lock);
+
+        int status = -1;
+        if (!__atomic_load_n(&walker->failed, __ATOMIC_RELAXED)) {   // after an error, just drain the queue
+            int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1) {
+                char err_msg[MAX_MSG_LEN];
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to open directory %s", dir->path);
+                perror(err_msg);
+            } else {
+                status = walk_dir(walker, dir, fd, dents);
+            }
+        }
+
+        pthread_mutex_lock(&walker->lock);
+        if (status != 0) {
+            walker->failed = 1;
+        }
+        if (--walker->pending == 0) {
+            pthread_cond_broadcast(&walker->work);  // wake the idle threads so they can exit
+        }
+    }
+    pthread_mutex_unlock(&walker->lock);
+    free(dents);
+    return NULL;
+}
+
+/*
+ * Add 'dir' and everything below it to 'members', in sorted order. 'path' is a
+ * scratch buffer of '*path_cap' bytes, grown as needed
+ * Returns 0 on success, -1 if out of memory
+ */
+static int list_dir(const walk_dir_t *dir, file_list_t *members, char **path, size_t *path_cap) {
+    if (file_list_add(members, dir->path) != 0) {
+        return -1;
+    }
+    size_t dir_len = strlen(dir->path);
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        const walk_entry_t *entry = &dir->entries[i];
+        if (entry->subdir != NULL) {
+            if (list_dir(entry->subdir, members, path, path_cap) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        const char *name = dir->names + entry->name_offset;
+        size_t len = dir_len + strlen(name) + 1;
+        if (len > *path_cap) {
+            char *bigger = realloc(*path, len * 2);
+            if (bigger == NULL) {
+                return -1;
+            }
+            *path = bigger;
+            *path_cap = len * 2;
+        }
+        memcpy(*path, dir->path, dir_len);
+        strcpy(*path + dir_len, name);
+        if (file_list_add(members, *path) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int expand_paths(const file_list_t *paths, file_list_t *members, int num_threads) {
+    char err_msg[MAX_MSG_LEN];
+    walk_dir_t **roots = calloc(paths->size > 0 ? paths->size : 1, sizeof(walk_dir_t *));
+    if (roots == NULL) {
+        perror("Failed to allocate memory in expand_paths");
+        return -1;
+    }
+    walker_t walker = {NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+    // Every directory named on the command line starts out on the queue
+    int ret = 0;
+    int i = 0;
+    for (node_t *current = paths->head; current != NULL; current = current->next, i++) {
+        struct stat stat_buf;
+        if (stat(current->name, &stat_buf) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", current->name);
+            perror(err_msg);
+            ret = -1;
+            break;
+        }
+        if (!S_ISDIR(stat_buf.st_mode)) {
+            continue;
+        }
+        size_t len = strlen(current->name);
+        while (len > 1 && current->name[len - 1] == '/') {  // "dir//" is stored as "dir/"
+            len--;
+        }
+        roots[i] = new_dir("", current->name, current->name[len - 1] == '/' ? len - 1 : len);
+        if (roots[i] == NULL) {
+            perror("Failed to allocate memory in expand_paths");
+            ret = -1;
+            break;
+        }
+        enqueue(&walker, roots[i]);
+    }
+
+    if (ret == 0 && walker.pending > 0) {
+        int num_helpers = num_threads > 1 ? num_threads - 1 : 0;
+        pthread_t *helpers = malloc((num_helpers + 1) * sizeof(pthread_t));
+        int started = 0;
+        while (helpers != NULL && started < num_helpers
+               && pthread_create(&helpers[started], NULL, walker_thread, &walker) == 0) {
+            started++;
+        }
+        walker_thread(&walker);     // the calling thread walks too
+        for (int t = 0; t < started; t++) {
+            pthread_join(helpers[t], NULL);
+        }
+        free(helpers);
+        if (walker.failed) {
+            ret = -1;
+        }
+    }
+
+    // Lay the members out in command line order, each tree depth first
+    char *path = NULL;
+    size_t path_cap = 0;
+    i = 0;
+    for (node_t *current = paths->head; current != NULL && ret == 0; current = current->next, i++) {
+        int status = roots[i] != NULL ? list_dir(roots[i], members, &path, &path_cap)
+                                      : file_list_add(members, current->name);
+        if (status != 0) {
+            perror("Failed to add file to members list in expand_paths");
+            ret = -1;
+        }
+    }
+    free(path);
+    for (i = 0; i < paths->size; i++) {
+        free_dir(roots[i]);
+    }
+    free(roots);
+    pthread_mutex_destroy(&walker.lock);
+    pthread_cond_destroy(&walker.work);
+    return ret;
+}
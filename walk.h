@@ -0,0 +1,21 @@
+#ifndef _WALK_H
+#define _WALK_H
+#include "file_list.h"
+
+// Bytes of directory entries fetched per getdents64 call
+#define WALK_DENTS_BUF_SIZE (64 * 1024)
+
+/*
+ * Build the list of archive members for the command line 'paths'. Anything that is
+ * not a directory is added as is. A directory is added as "name/", followed by
+ * everything below it: subdirectories (again as "name/") and regular files, each
+ * directory's entries sorted by name so the order doesn't depend on the file system.
+ * Other file types (symlinks, devices, ...) found inside a tree are skipped with a note.
+ * The tree is read with getdents64 and opened relative to the parent's descriptor, on
+ * 'num_threads' threads that share out subdirectories; the result is the same for
+ * any number of threads.
+ * This function should return 0 upon success or -1 if an error occurred
+ */
+int expand_paths(const file_list_t *paths, file_list_t *members, int num_threads);
+
+#endif